@@ -0,0 +1,126 @@
+// Churn through string-object-sized blocks, once through reallocate() and
+// the slab allocator and once through plain malloc/free, and compare
+// throughput and fragmentation.
+//
+//   make clean && make bench DEFINES=-DCLOX_RELEASE
+//   ./bin/bench/alloc_bench [live blocks] [operations]
+//
+// The workload keeps a fixed number of blocks alive and replaces a random
+// one on every operation, with sizes shaped like ObjStrings : a header plus
+// a short string most of the time, a long one now and then.
+//
+// Fragmentation is what the allocator holds divided by what is live :
+// the slabs for reallocate(), the in-use bytes mallinfo2() reports for
+// malloc (chunk headers included). Each side runs in a child process of
+// its own, so neither sees the blocks of the other.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// the VM whose heap reallocate() works with
+static VM vm;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// xorshift, rand() is slow enough to show up in the numbers
+static uint32_t state = 2463534242u;
+static uint32_t nextRandom()
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static size_t nextSize()
+{
+    uint32_t r = nextRandom();
+    // 7 out of 8 strings are short, the rest up to 1 KB
+    size_t length = (r & 7) != 0 ? (r >> 3) % 48 : (r >> 3) % 1024;
+    return sizeof(ObjString) + length + 1;
+}
+
+static void run(bool useSlabs, int live, long operations)
+{
+    initVM(&vm);
+    // the blocks are no objects, there is nothing for the collector to do
+    vm.nextGC = SIZE_MAX;
+
+    void** blocks = (void**)calloc(live, sizeof(void*));
+    size_t* sizes = (size_t*)calloc(live, sizeof(size_t));
+    size_t baseline = mallinfo2().uordblks;
+
+    double start = now();
+    for (long i = 0; i < operations; i++)
+    {
+        int slot = (int)(nextRandom() % (uint32_t)live);
+        if (blocks[slot] != NULL)
+        {
+            if (useSlabs) reallocate(&vm, blocks[slot], sizes[slot], 0, MEM_STRINGS);
+            else free(blocks[slot]);
+        }
+
+        sizes[slot] = nextSize();
+        blocks[slot] = useSlabs ? reallocate(&vm, NULL, 0, sizes[slot], MEM_STRINGS) : malloc(sizes[slot]);
+        // touch it, like the string copy would
+        *(char*)blocks[slot] = (char)i;
+    }
+    double elapsed = now() - start;
+
+    size_t liveBytes = 0;
+    for (int i = 0; i < live; i++) liveBytes += sizes[i];
+
+    // slab pages come from malloc too, so the malloc side of the slab run
+    // includes them, and the slab side only counts the small blocks
+    size_t heldBytes = mallinfo2().uordblks - baseline;
+
+    printf("%-6s : %.1f ns / operation\n", useSlabs ? "slab" : "malloc", elapsed * 1e9 / operations);
+    printf("  live     %10.3f MB\n", liveBytes / 1048576.0);
+    printf("  held     %10.3f MB (x%.2f)\n", heldBytes / 1048576.0, (double)heldBytes / liveBytes);
+
+    if (useSlabs)
+    {
+        SlabStats stats;
+        getSlabStats(&vm, &stats);
+        printf("  slabs    %10.3f MB in %zu slabs, %.1f%% of it in use\n",
+            stats.slabBytes / 1048576.0, stats.slabCount,
+            stats.slabBytes > 0 ? 100.0 * stats.usedBytes / stats.slabBytes : 0.0);
+    }
+}
+
+int main(int argc, const char* argv[])
+{
+    int live = argc > 1 ? atoi(argv[1]) : 100000;
+    long operations = argc > 2 ? atol(argv[2]) : 20000000;
+
+    for (int useSlabs = 0; useSlabs <= 1; useSlabs++)
+    {
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0)
+        {
+            run(useSlabs, live, operations);
+            exit(0);
+        }
+
+        int status;
+        waitpid(child, &status, 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+// Measure the dispatch cost per instruction of run().
+//
+// The chunk is assembled by hand so that its shape does not depend on the
+// compiler : one long left-leaning arithmetic expression
+//
+//   k op k op k op ... op k
+//
+// which is "OP_CONSTANT (OP_CONSTANT OP_xxx)*" in bytecode. Every handler
+// is a couple of loads and stores, so the time per instruction is mostly
+// the cost of getting from one handler to the next. Compare
+//
+//   make clean && make bench DEFINES=-DCLOX_RELEASE
+//   make clean && make bench DEFINES="-DCLOX_RELEASE -DSWITCH_DISPATCH"
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "vm.h"
+
+static VM vm;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, const char* argv[])
+{
+    int operations = argc > 1 ? atoi(argv[1]) : 100000;
+    int iterations = argc > 2 ? atoi(argv[2]) : 200;
+
+    initVM(&vm);
+
+    Chunk chunk;
+    initChunk(&chunk);
+
+    // 1.0 keeps the running value finite whatever the operator mix is
+    int constant = addConstant(&vm, &chunk, NUMBER_VAL(1.0));
+    static const uint8_t operators[] = { OP_ADD, OP_MULTIPLY, OP_SUBTRACT, OP_DIVIDE };
+
+    // a fixed pseudo random operator order, so the predictor can't
+    // just learn a period of four
+    uint32_t seed = 12345;
+
+    writeChunk(&vm, &chunk, OP_CONSTANT, 1);
+    writeChunk(&vm, &chunk, constant, 1);
+    for (int i = 0; i < operations; i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        writeChunk(&vm, &chunk, OP_CONSTANT, 1);
+        writeChunk(&vm, &chunk, constant, 1);
+        writeChunk(&vm, &chunk, operators[(seed >> 16) & 3], 1);
+    }
+    writeChunk(&vm, &chunk, OP_RETURN, 1);
+    // what the compiler would have set, interpretChunk() reserves it
+    chunk.maxStack = stackDepth(&chunk);
+
+    long instructions = 2L * operations + 2;
+
+    double start = now();
+    for (int i = 0; i < iterations; i++)
+    {
+        if (interpretChunk(&vm, &chunk) != INTERPRET_OK) exit(70);
+    }
+    double elapsed = now() - start;
+
+#ifdef THREADED_DISPATCH
+    const char* mode = "threaded (computed goto)";
+#else
+    const char* mode = "switch";
+#endif
+    fprintf(stderr, "%s : %ld instructions x %d runs, %.3f ns / instruction\n",
+        mode, instructions, iterations,
+        elapsed * 1e9 / ((double)instructions * iterations));
+
+    freeChunk(&vm, &chunk);
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,109 @@
+// Allocate millions of short-lived strings and report how the collector
+// keeps up : heap size, number of cycles, and the pause of every step.
+//
+//   make clean && make bench DEFINES=-DCLOX_RELEASE
+//   ./bin/bench/gc_bench [strings] [live]
+//
+// Every string is unique, so interning cannot hide the allocation. The
+// last 'live' of them stay reachable from the VM stack, like the operands
+// of a long running expression would, everything older is garbage.
+//
+// Without a collector the heap grows with the number of strings, with it
+// the heap stays around GC_HEAP_GROW_FACTOR times the live data (but never
+// below GC_HEAP_MIN, plus the intern table sized for it). The pause
+// percentiles are computed from the per-step pauses of GcStats, so they
+// measure exactly what a mutator waits for.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+static VM vm;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compareUint64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, const char* argv[])
+{
+    long strings = argc > 1 ? atol(argv[1]) : 5000000;
+    int live = argc > 2 ? atoi(argv[2]) : 200;
+    initVM(&vm);
+    // copyString() pushes one more while it interns
+    if (live < 1 || !reserveStack(&vm, live + STACK_SLACK))
+    {
+        fprintf(stderr, "live must be between 1 and %d\n", vm.stackMax - STACK_SLACK);
+        exit(64);
+    }
+    for (int i = 0; i < live; i++) push(&vm, NIL_VAL);
+
+    // every pause, one sample per collector step
+    size_t sampleCapacity = 1 << 20;
+    size_t sampleCount = 0;
+    uint64_t* samples = (uint64_t*)malloc(sizeof(uint64_t) * sampleCapacity);
+
+    size_t peakHeap = 0;
+    double start = now();
+    for (long i = 0; i < strings; i++)
+    {
+        char buffer[64];
+        int length = snprintf(buffer, sizeof(buffer), "temporary string number %ld", i);
+
+        size_t steps = vm.gcStats.steps;
+        uint64_t pauseTotal = vm.gcStats.totalPauseNs;
+
+        vm.stack[i % live] = OBJ_VAL(copyString(&vm, buffer, length));
+
+        // at most a couple of steps per string, take their mean
+        if (vm.gcStats.steps != steps && sampleCount < sampleCapacity)
+        {
+            samples[sampleCount++] = (vm.gcStats.totalPauseNs - pauseTotal) / (vm.gcStats.steps - steps);
+        }
+
+        MemoryStats heap;
+        getMemoryStats(&vm, MEM_CATEGORY_COUNT, &heap);
+        if (heap.currentBytes > peakHeap) peakHeap = heap.currentBytes;
+    }
+    double elapsed = now() - start;
+
+    MemoryStats heap;
+    getMemoryStats(&vm, MEM_CATEGORY_COUNT, &heap);
+    GcStats* gc = &vm.gcStats;
+
+    printf("%ld strings, %d live, %.1f ns / string\n", strings, live, elapsed * 1e9 / strings);
+    printf("  heap now   %10.3f MB, peak %.3f MB\n", heap.currentBytes / 1048576.0, peakHeap / 1048576.0);
+    printf("  gc         %zu cycles, %zu steps, %zu objects freed\n",
+        gc->cycles, gc->steps, gc->freedObjects);
+
+    if (sampleCount > 0)
+    {
+        qsort(samples, sampleCount, sizeof(uint64_t), compareUint64);
+        printf("  pause      p50 %.3f us, p99 %.3f us, p99.9 %.3f us, max %.3f us\n",
+            samples[sampleCount / 2] / 1e3,
+            samples[sampleCount * 99 / 100] / 1e3,
+            samples[sampleCount * 999 / 1000] / 1e3,
+            gc->maxPauseNs / 1e3);
+    }
+
+    printMemoryStats(&vm, stdout);
+    free(samples);
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+"""
+Generate machine-made Lox expressions for the benchmarks in this directory.
+
+    python3 bench/gen.py arith 250 > arith.lox
+    python3 bench/gen.py string 250 > string.lox
+
+The first argument picks the shape of the expression, the second one is the
+number of literals in it (each distinct literal takes a constant slot).
+"""
+
+import random
+import sys
+
+
+def arith(count, rng):
+    # small groups keep the stack shallow while still mixing every operator
+    terms = []
+    while count > 0:
+        n = min(count, rng.randint(2, 4))
+        count -= n
+        group = str(rng.randint(1, 99))
+        for _ in range(n - 1):
+            group += " %s %d" % (rng.choice("+-*/"), rng.randint(1, 99))
+        terms.append("(" + group + ")")
+    out = terms[0]
+    for term in terms[1:]:
+        out += "\n  %s %s" % (rng.choice("+-"), term)
+    return out
+
+
+def string(count, rng):
+    letters = "abcdefghijklmnopqrstuvwxyz"
+    pieces = []
+    for _ in range(count):
+        size = rng.randint(4, 24)
+        pieces.append('"%s"' % "".join(rng.choice(letters) for _ in range(size)))
+    return "\n  + ".join(pieces)
+
+
+KINDS = {"arith": arith, "string": string}
+
+
+def main():
+    if len(sys.argv) < 3 or sys.argv[1] not in KINDS:
+        sys.stderr.write("Usage: gen.py [%s] count [seed]\n" % "|".join(KINDS))
+        sys.exit(64)
+
+    seed = int(sys.argv[3]) if len(sys.argv) > 3 else 1
+    rng = random.Random(seed)
+    print(KINDS[sys.argv[1]](int(sys.argv[2]), rng))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,207 @@
+// Hash strings of a few lengths with hashString() and with FNV-1a (what it
+// used to be) and report the throughput, then check that the new hash does
+// not probe worse : both sets of hashes go through the probing of Table and
+// InternSet (group.h), and the bench counts what a lookup looks at.
+//
+//   make clean && make bench DEFINES=-DCLOX_RELEASE
+//   ./bin/bench/hash_bench [keys]
+//
+// Built with FNV_HASH both columns are FNV-1a.
+//
+// For the distribution, keys are put in a table of control bytes at 7/8
+// load, and for every key the bench counts the groups probed to find it
+// and the slots whose control byte matched but held another key (each one
+// is a string compare in a real lookup). The key sets are what hashes tend
+// to have trouble with : sequential names, short names differing in one
+// character, and long strings differing only at the end.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "group.h"
+#include "object.h"
+
+typedef uint32_t (*HashFn)(const char* key, int length);
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the old hashString()
+static uint32_t hashFnv1a(const char* key, int length)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// MB hashed per second, over strings of 'length' bytes at every offset of
+// a buffer, so that the reads are not all aligned
+static double throughput(HashFn hash, const char* buffer, int length, long bytes)
+{
+    long count = bytes / length;
+    uint32_t sum = 0;
+
+    double start = now();
+    for (long i = 0; i < count; i++) sum += hash(buffer + (i & 63), length);
+    double elapsed = now() - start;
+
+    // keep the loop from being optimized away
+    if (sum == 1) printf(" ");
+    return (double)count * length / elapsed / 1e6;
+}
+
+typedef struct
+{
+    double groups;
+    double falseMatches;
+    int maxGroups;
+} ProbeStats;
+
+// the first keys of the set, as many as fill the table to 7/8
+static ProbeStats probe(HashFn hash, char** keys, int* lengths, int count)
+{
+    int capacity = GROUP_SIZE;
+    while (capacity * 2 * 0.875 <= count) capacity *= 2;
+    count = (int)(capacity * 0.875);
+
+    uint8_t* control = (uint8_t*)malloc(capacity);
+    int* owner = (int*)malloc(sizeof(int) * capacity);
+    uint32_t* hashes = (uint32_t*)malloc(sizeof(uint32_t) * count);
+    memset(control, CONTROL_EMPTY, capacity);
+
+    for (int i = 0; i < count; i++)
+    {
+        hashes[i] = hash(keys[i], lengths[i]);
+        int slot = findFreeSlot(control, capacity, hashes[i]);
+        control[slot] = controlHash(hashes[i]);
+        owner[slot] = i;
+    }
+
+    ProbeStats stats = { 0, 0, 0 };
+    for (int i = 0; i < count; i++)
+    {
+        Probe probe = startProbe(capacity, hashes[i]);
+        for (int groups = 1;; groups++)
+        {
+            int base = probe.group * GROUP_SIZE;
+            uint32_t match = matchControl(&control[base], controlHash(hashes[i]));
+            bool found = false;
+            for (; match != 0; match &= match - 1)
+            {
+                if (owner[base + __builtin_ctz(match)] == i)
+                {
+                    found = true;
+                    break;
+                }
+                stats.falseMatches++;
+            }
+
+            if (found)
+            {
+                stats.groups += groups;
+                if (groups > stats.maxGroups) stats.maxGroups = groups;
+                break;
+            }
+            nextProbe(&probe);
+        }
+    }
+
+    stats.groups /= count;
+    stats.falseMatches /= count;
+    free(control);
+    free(owner);
+    free(hashes);
+    return stats;
+}
+
+static void distribution(const char* name, char** keys, int* lengths, int count)
+{
+    ProbeStats fnv = probe(hashFnv1a, keys, lengths, count);
+    ProbeStats words = probe(hashString, keys, lengths, count);
+    printf("%-12s %8.3f %8.3f %8d %8d %8.4f %8.4f\n", name,
+        fnv.groups, words.groups, fnv.maxGroups, words.maxGroups,
+        fnv.falseMatches, words.falseMatches);
+}
+
+int main(int argc, const char* argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    char buffer[4096 + 64];
+    for (int i = 0; i < (int)sizeof(buffer); i++) buffer[i] = (char)('a' + i % 26);
+
+    printf("throughput, MB/s\n");
+    printf("%8s %12s %12s\n", "length", "fnv-1a", "hashString");
+    int lengths[] = { 4, 8, 12, 16, 32, 64, 256, 4096 };
+    for (int i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++)
+    {
+        long bytes = 200L * 1000 * 1000;
+        printf("%8d %12.0f %12.0f\n", lengths[i],
+            throughput(hashFnv1a, buffer, lengths[i], bytes),
+            throughput(hashString, buffer, lengths[i], bytes));
+    }
+
+    char** keys = (char**)malloc(sizeof(char*) * count);
+    int* keyLengths = (int*)malloc(sizeof(int) * count);
+    char* text = (char*)malloc((size_t)count * 160);
+
+    printf("\nkeys at 7/8 load, per lookup\n");
+    printf("%-12s %17s %17s %17s\n", "", "mean groups", "max groups", "false matches");
+    printf("%-12s %8s %8s %8s %8s %8s %8s\n",
+        "keys", "fnv-1a", "new", "fnv-1a", "new", "fnv-1a", "new");
+
+    char* cursor = text;
+    for (int i = 0; i < count; i++)
+    {
+        keys[i] = cursor;
+        keyLengths[i] = sprintf(cursor, "identifier_%d", i);
+        cursor += keyLengths[i] + 1;
+    }
+    distribution("sequential", keys, keyLengths, count);
+
+    // every combination of up to four letters and digits, in order
+    cursor = text;
+    for (int i = 0; i < count; i++)
+    {
+        keys[i] = cursor;
+        int n = i;
+        int length = 0;
+        do
+        {
+            cursor[length++] = "abcdefghijklmnopqrstuvwxyz0123456789_ABCDEFGHIJKLMNOPQRSTUVWXYZ"[n % 63];
+            n /= 63;
+        } while (n > 0);
+        keyLengths[i] = length;
+        cursor += length + 1;
+    }
+    distribution("short", keys, keyLengths, count);
+
+    // 150 equal bytes, then the number
+    cursor = text;
+    for (int i = 0; i < count; i++)
+    {
+        keys[i] = cursor;
+        memset(cursor, 'x', 150);
+        keyLengths[i] = 150 + sprintf(cursor + 150, "%d", i % 100000000);
+        cursor += 159;
+    }
+    distribution("long", keys, keyLengths, count);
+
+    free(keys);
+    free(keyLengths);
+    free(text);
+    return 0;
+}
@@ -0,0 +1,169 @@
+// Intern millions of strings, once through a Table used as a set (what
+// vm.strings used to be), once through an InternSet one string at a time,
+// and once through an InternSet in bulk, the way copyStrings() does it :
+// with the lookups a few strings ahead prefetched.
+//
+//   make clean && make bench DEFINES=-DCLOX_RELEASE
+//   ./bin/bench/intern_bench [strings]
+//
+// Two workloads : every string distinct (a miss and an insert each), and
+// the same number of strings drawn from a pool of 1/16 as many (mostly
+// hits). Interning a string is a lookup, plus an insert when it missed. The
+// strings are made up front, only the sets are timed.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "intern.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+static VM vm;
+
+// how many lookups ahead the bulk path prefetches, as in copyStrings()
+#define PREFETCH_DISTANCE (16)
+
+typedef struct
+{
+    // a copy of the characters, apart from the string object, like the
+    // source text a literal is interned from
+    const char* chars;
+    int length;
+    uint32_t hash;
+    ObjString* string;
+} Input;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// xorshift, rand() is slow enough to show up in the numbers
+static uint32_t state = 2463534242u;
+static uint32_t nextRandom()
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static double internTable(Input* inputs, int count)
+{
+    Table table;
+    initTable(&table);
+
+    double start = now();
+    for (int i = 0; i < count; i++)
+    {
+        Input* input = &inputs[i];
+        if (tableFindString(&vm, &table, input->chars, input->length, input->hash) == NULL)
+        {
+            tableSet(&vm, &table, input->string, NIL_VAL);
+        }
+    }
+    double elapsed = now() - start;
+
+    freeTable(&vm, &table);
+    return elapsed * 1e9 / count;
+}
+
+static double internOneByOne(Input* inputs, int count)
+{
+    InternSet set;
+    initInternSet(&set);
+
+    double start = now();
+    for (int i = 0; i < count; i++)
+    {
+        Input* input = &inputs[i];
+        if (internFind(&vm, &set, input->chars, input->length, input->hash) == NULL)
+        {
+            internAdd(&vm, &set, input->string);
+        }
+    }
+    double elapsed = now() - start;
+
+    freeInternSet(&vm, &set);
+    return elapsed * 1e9 / count;
+}
+
+static double internBulk(Input* inputs, int count)
+{
+    InternSet set;
+    initInternSet(&set);
+
+    double start = now();
+    for (int i = 0; i < count; i++)
+    {
+        if (i + PREFETCH_DISTANCE < count)
+        {
+            internPrefetch(&set, inputs[i + PREFETCH_DISTANCE].hash);
+        }
+
+        Input* input = &inputs[i];
+        if (internFind(&vm, &set, input->chars, input->length, input->hash) == NULL)
+        {
+            internAdd(&vm, &set, input->string);
+        }
+    }
+    double elapsed = now() - start;
+
+    freeInternSet(&vm, &set);
+    return elapsed * 1e9 / count;
+}
+
+static void run(const char* name, Input* inputs, int count)
+{
+    printf("%-10s %12.1f %12.1f %12.1f\n", name,
+        internTable(inputs, count), internOneByOne(inputs, count), internBulk(inputs, count));
+}
+
+int main(int argc, const char* argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 2000000;
+
+    initVM(&vm);
+    // the strings are only referenced from the inputs, which the collector
+    // does not know about (don't run the bench with DEBUG_STRESS_GC)
+    vm.nextGC = SIZE_MAX;
+
+    // a distinct string per input
+    Input* distinct = (Input*)malloc(sizeof(Input) * count);
+    char* text = (char*)malloc((size_t)count * 32);
+    char* cursor = text;
+    for (int i = 0; i < count; i++)
+    {
+        int length = sprintf(cursor, "identifier_%d", i);
+        ObjString* string = copyString(&vm, cursor, length);
+        distinct[i] = (Input){ cursor, length, string->hash, string };
+        cursor += length + 1;
+    }
+
+    // and the same number drawn from the first 1/16 of them
+    int pool = count / 16 > 0 ? count / 16 : 1;
+    Input* repeated = (Input*)malloc(sizeof(Input) * count);
+    for (int i = 0; i < count; i++)
+    {
+        repeated[i] = distinct[nextRandom() % (uint32_t)pool];
+    }
+
+    printf("%d strings, ns per string\n", count);
+    printf("%-10s %12s %12s %12s\n", "", "table", "intern set", "bulk");
+    run("distinct", distinct, count);
+    run("repeated", repeated, count);
+
+    free(distinct);
+    free(repeated);
+    free(text);
+    freeVM(&vm);
+    return 0;
+}
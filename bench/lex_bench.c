@@ -0,0 +1,79 @@
+// Scan a Lox file into a token array with scanTokens() on 1, 2, 4... up to
+// the given number of threads, and report the throughput of each next to
+// the one of a plain scanToken() loop.
+//
+//   make clean && make bench DEFINES=-DCLOX_RELEASE
+//   python3 bench/gen.py string 20000000 > huge.lox
+//   ./bin/bench/lex_bench huge.lox [max threads]
+//
+// The token array times include splitSource(), the pre-pass that finds
+// where the pieces start, and the copy into the array. The token counts
+// have to be the same for every number of threads.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lexer.h"
+#include "source.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: lex_bench path [max threads]\n");
+        exit(64);
+    }
+    int maxThreads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (maxThreads < 1) maxThreads = 1;
+    if (maxThreads > LEX_MAX_THREADS) maxThreads = LEX_MAX_THREADS;
+
+    SourceFile source;
+    if (!loadSource(&source, argv[1], true))
+    {
+        fprintf(stderr, "Could not read file \"%s\". \n", argv[1]);
+        exit(74);
+    }
+    double megabytes = source.length / 1e6;
+    printf("%.1f MB, %ld cores online\n", megabytes, sysconf(_SC_NPROCESSORS_ONLN));
+
+    double start = now();
+    Scanner scanner;
+    initScanner(&scanner, source.chars, source.length);
+    long tokens = 0;
+    while (scanToken(&scanner).type != TOKEN_EOF) tokens++;
+    double serial = now() - start;
+
+    printf("%-14s %10s %10s %12s\n", "", "MB/s", "speedup", "tokens");
+    printf("%-14s %10.0f %10s %12ld\n", "scanToken()", megabytes / serial, "", tokens);
+
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        TokenArray array;
+        start = now();
+        scanTokens(&array, source.chars, source.length, threads);
+        double elapsed = now() - start;
+
+        char name[32];
+        snprintf(name, sizeof(name), "%d thread%s", threads, threads > 1 ? "s" : "");
+        // the array ends with the TOKEN_EOF, the loop above did not count it
+        printf("%-14s %10.0f %9.2fx %12d\n", name, megabytes / elapsed, serial / elapsed,
+            array.count - 1);
+        freeTokenArray(&array);
+
+        if (threads < maxThreads && threads * 2 > maxThreads) threads = maxThreads / 2;
+    }
+
+    freeSource(&source);
+    return 0;
+}
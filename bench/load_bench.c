@@ -0,0 +1,114 @@
+// Load a Lox file and scan it to the end, once with the old read-into-a-
+// buffer path and once with the mmap path, and report load time, scan time
+// and peak RSS for each.
+//
+//   make clean && make bench DEFINES=-DCLOX_RELEASE
+//   python3 bench/gen.py arith 20000000 > huge.lox
+//   ./bin/bench/load_bench huge.lox
+//
+// Peak RSS only ever grows within a process, so every path is measured in
+// a child process of its own.
+//
+// Peak RSS counts the mapped pages of the file too, so it barely moves.
+// What mmap saves is the anonymous copy : the buffer of the read path can
+// only go to swap, while the mapped pages are clean page cache the kernel
+// can drop at any time. The split is printed from /proc/self/status, taken
+// right after the scan while the whole file is still resident.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scanner.h"
+#include "source.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// prints the RssAnon and RssFile lines of /proc/self/status (Linux only)
+static void printResidentSplit()
+{
+    FILE* status = fopen("/proc/self/status", "r");
+    if (status == NULL) return;
+
+    char line[256];
+    while (fgets(line, sizeof(line), status) != NULL)
+    {
+        if (strncmp(line, "RssAnon:", 8) == 0 || strncmp(line, "RssFile:", 8) == 0)
+        {
+            printf("  %s", line);
+        }
+    }
+    fclose(status);
+}
+
+static void measure(const char* path, bool useMmap)
+{
+    double start = now();
+    SourceFile source;
+    if (!loadSource(&source, path, useMmap))
+    {
+        fprintf(stderr, "Could not read file \"%s\". \n", path);
+        exit(74);
+    }
+    double loadTime = now() - start;
+
+    start = now();
+    Scanner scanner;
+    initScanner(&scanner, source.chars, source.length);
+    long tokens = 0;
+    for (;;)
+    {
+        Token token = scanToken(&scanner);
+        if (token.type == TOKEN_EOF) break;
+        tokens++;
+    }
+    double scanTime = now() - start;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("%-5s : %zu bytes, %ld tokens\n", useMmap ? "mmap" : "read", source.length, tokens);
+    printf("  load     %12.3f ms\n", loadTime * 1e3);
+    printf("  scan     %12.3f ms\n", scanTime * 1e3);
+    // ru_maxrss is in kilobytes on Linux
+    printf("  peak RSS %12.3f MB\n", usage.ru_maxrss / 1024.0);
+    printResidentSplit();
+
+    freeSource(&source);
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: load_bench path\n");
+        exit(64);
+    }
+
+    for (int useMmap = 0; useMmap <= 1; useMmap++)
+    {
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0)
+        {
+            measure(argv[1], useMmap);
+            exit(0);
+        }
+
+        int status;
+        waitpid(child, &status, 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,157 @@
+// Time every single call into a table while it grows, and report the tail
+// of those times, once with incremental resizing and once with resizes
+// done in one go (isIncremental = false, what the tables used to do).
+//
+//   make clean && make bench DEFINES=-DCLOX_RELEASE
+//   ./bin/bench/resize_bench [keys]
+//
+// Three workloads :
+// - grow : tableSet() of distinct keys, crossing a resize at every power
+//   of two. Done in one go, the call that resizes copies the whole table.
+// - intern : the same through vm.strings' InternSet, internFind() and then
+//   internAdd(), which is what interning a new string costs.
+// - churn : a steady number of keys, every call adds a new one and deletes
+//   the oldest. The tombstones fill the table up, and the rebuilds that
+//   drop them are what the tail is made of.
+// The capacity at the end shows the shrinking : the churn starts from a
+// table grown for all the keys and keeps only 1/32 of them.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "intern.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+static VM vm;
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int compareUint64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char* name, bool isIncremental, uint64_t* samples, int count,
+    int capacity)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++) total += samples[i];
+    qsort(samples, count, sizeof(uint64_t), compareUint64);
+
+    printf("%-8s %-12s %8.1f %8lu %8lu %8lu %10lu %10d\n",
+        name, isIncremental ? "incremental" : "in one go", (double)total / count,
+        (unsigned long)samples[count / 2],
+        (unsigned long)samples[(long)count * 99 / 100],
+        (unsigned long)samples[(long)count * 999 / 1000],
+        (unsigned long)samples[count - 1], capacity);
+}
+
+static void grow(ObjString** keys, int count, uint64_t* samples, bool isIncremental)
+{
+    Table table;
+    initTable(&table);
+    table.groups.isIncremental = isIncremental;
+
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t start = nowNs();
+        tableSet(&vm, &table, keys[i], NIL_VAL);
+        samples[i] = nowNs() - start;
+    }
+
+    report("grow", isIncremental, samples, count, table.groups.capacity);
+    freeTable(&vm, &table);
+}
+
+static void intern(ObjString** keys, int count, uint64_t* samples, bool isIncremental)
+{
+    InternSet set;
+    initInternSet(&set);
+    set.groups.isIncremental = isIncremental;
+
+    for (int i = 0; i < count; i++)
+    {
+        ObjString* key = keys[i];
+        uint64_t start = nowNs();
+        if (internFind(&vm, &set, key->chars, key->length, key->hash) == NULL) internAdd(&vm, &set, key);
+        samples[i] = nowNs() - start;
+    }
+
+    report("intern", isIncremental, samples, count, set.groups.capacity);
+    freeInternSet(&vm, &set);
+}
+
+static void churn(ObjString** keys, int count, uint64_t* samples, bool isIncremental)
+{
+    Table table;
+    initTable(&table);
+    table.groups.isIncremental = isIncremental;
+
+    // grown for all the keys, then down to the live ones
+    int live = count / 32;
+    for (int i = 0; i < count; i++) tableSet(&vm, &table, keys[i], NIL_VAL);
+    for (int i = 0; i < count - live; i++) tableDelete(&vm, &table, keys[i]);
+
+    // the live keys are a window sliding over the array, every call
+    // deletes the oldest one and adds the key after the newest
+    for (int i = 0; i < count; i++)
+    {
+        ObjString* oldest = keys[(count - live + i) % count];
+        uint64_t start = nowNs();
+        tableDelete(&vm, &table, oldest);
+        tableSet(&vm, &table, keys[i], NIL_VAL);
+        samples[i] = nowNs() - start;
+    }
+
+    report("churn", isIncremental, samples, count, table.groups.capacity);
+    freeTable(&vm, &table);
+}
+
+int main(int argc, const char* argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 2000000;
+
+    initVM(&vm);
+    // the keys are only referenced from the array below, which the
+    // collector does not know about (don't run the bench with
+    // DEBUG_STRESS_GC)
+    vm.nextGC = SIZE_MAX;
+
+    ObjString** keys = (ObjString**)malloc(sizeof(ObjString*) * count);
+    for (int i = 0; i < count; i++)
+    {
+        char buffer[32];
+        int length = snprintf(buffer, sizeof(buffer), "key-%d", i);
+        keys[i] = copyString(&vm, buffer, length);
+    }
+    uint64_t* samples = (uint64_t*)malloc(sizeof(uint64_t) * count);
+
+    printf("%d calls each, ns per call\n", count);
+    printf("%-8s %-12s %8s %8s %8s %8s %10s %10s\n",
+        "", "resize", "mean", "p50", "p99", "p99.9", "max", "capacity");
+    for (int isIncremental = 1; isIncremental >= 0; isIncremental--)
+    {
+        grow(keys, count, samples, isIncremental);
+        intern(keys, count, samples, isIncremental);
+        churn(keys, count, samples, isIncremental);
+    }
+
+    free(samples);
+    free(keys);
+    freeVM(&vm);
+    return 0;
+}
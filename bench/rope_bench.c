@@ -0,0 +1,106 @@
+// Build one long string out of many short pieces, "a + b + c + ...", once
+// the way concatenate() used to (a new interned string per step) and
+// once with ropes, and report the time per piece for growing piece counts.
+//
+//   make clean && make bench DEFINES=-DCLOX_RELEASE
+//   ./bin/bench/rope_bench [max pieces]
+//
+// Copying makes the chain quadratic, the time per piece grows with the
+// number of pieces. With ropes it stays flat : every "+" is one node, and
+// the single flattenRope() at the end copies each byte once.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+static VM vm;
+
+#define PIECE "a piece of text, "
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the old concatenate() : a new interned string for every intermediate
+static ObjString* buildCopying(int pieces)
+{
+    ObjString* piece = copyString(&vm, PIECE, (int)strlen(PIECE));
+    push(&vm, OBJ_VAL(piece));
+    push(&vm, OBJ_VAL(piece));
+
+    for (int i = 1; i < pieces; i++)
+    {
+        ObjString* result = AS_STRING(vm.stackTop[-1]);
+        ObjString* string = reserveString(&vm, result->length + piece->length);
+        memcpy(string->chars, result->chars, result->length);
+        memcpy(string->chars + result->length, piece->chars, piece->length);
+        vm.stackTop[-1] = OBJ_VAL(finishString(&vm, string));
+    }
+
+    ObjString* result = AS_STRING(pop(&vm));
+    pop(&vm);
+    return result;
+}
+
+static ObjString* buildRope(int pieces)
+{
+    ObjString* piece = copyString(&vm, PIECE, (int)strlen(PIECE));
+    push(&vm, OBJ_VAL(piece));
+    push(&vm, OBJ_VAL(piece));
+
+    for (int i = 1; i < pieces; i++)
+    {
+        vm.stackTop[-1] = OBJ_VAL(concatenateStrings(&vm, AS_OBJ(vm.stackTop[-1]), (Obj*)piece));
+    }
+
+    Value result = vm.stackTop[-1];
+    ObjString* string = IS_ROPE(result) ? flattenRope(&vm, AS_ROPE(result)) : AS_STRING(result);
+    pop(&vm);
+    pop(&vm);
+    return string;
+}
+
+int main(int argc, const char* argv[])
+{
+    int maxPieces = argc > 1 ? atoi(argv[1]) : 16384;
+
+    initVM(&vm);
+
+    printf("%10s %16s %16s\n", "pieces", "copy ns/piece", "rope ns/piece");
+    for (int pieces = 1024; pieces <= maxPieces; pieces *= 2)
+    {
+        double start = now();
+        buildCopying(pieces);
+        double copyTime = now() - start;
+
+        // nothing references the copy any more, collect it so the rope does
+        // not find its result interned already
+        collectGarbage(&vm);
+
+        start = now();
+        ObjString* roped = buildRope(pieces);
+        double ropeTime = now() - start;
+
+        if (roped->length != (int)strlen(PIECE) * pieces)
+        {
+            fprintf(stderr, "wrong length %d\n", roped->length);
+            exit(1);
+        }
+
+        printf("%10d %16.1f %16.1f\n", pieces, copyTime * 1e9 / pieces, ropeTime * 1e9 / pieces);
+        collectGarbage(&vm);
+    }
+
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,185 @@
+// Scan generated sources to the end and report the throughput in MB/s, one
+// source per kind of run the scanner has fast paths for, and one of
+// keywords for identifierType().
+//
+//   make clean && make bench DEFINES=-DCLOX_RELEASE
+//   ./bin/bench/scan_bench [MB per source]
+//
+// For the numbers without the fast paths, build with
+// DEFINES="-DCLOX_RELEASE -DSCALAR_SCANNER", and with "-mavx2" added for
+// the 32 byte chunks. The counts have to be the same whatever the build.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scanner.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// xorshift, so that every build scans the same sources
+static unsigned int state = 2463534242u;
+static unsigned int nextRandom()
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+typedef struct
+{
+    char* chars;
+    size_t length;
+    size_t capacity;
+} Source;
+
+static void append(Source* source, const char* text)
+{
+    size_t length = strlen(text);
+    if (source->length + length > source->capacity) return;
+    memcpy(source->chars + source->length, text, length);
+    source->length += length;
+}
+
+static bool isFull(Source* source)
+{
+    return source->length + 256 > source->capacity;
+}
+
+static void randomWord(char* buffer, int length)
+{
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789";
+    // an identifier can't start with a digit
+    buffer[0] = letters[nextRandom() % 53];
+    for (int i = 1; i < length; i++) buffer[i] = letters[nextRandom() % 63];
+    buffer[length] = '\0';
+}
+
+// a line of code every few lines of comment
+static void comments(Source* source)
+{
+    char word[64];
+    while (!isFull(source))
+    {
+        append(source, "// ");
+        for (int i = 0; i < 10; i++)
+        {
+            randomWord(word, 2 + nextRandom() % 8);
+            append(source, word);
+            append(source, " ");
+        }
+        append(source, "\n");
+        if (nextRandom() % 4 == 0) append(source, "1 + 2\n");
+    }
+}
+
+// long literals, some of them over several lines
+static void strings(Source* source)
+{
+    char word[64];
+    while (!isFull(source))
+    {
+        append(source, "\"");
+        int words = 4 + nextRandom() % 32;
+        for (int i = 0; i < words; i++)
+        {
+            randomWord(word, 2 + nextRandom() % 8);
+            append(source, word);
+            append(source, nextRandom() % 8 == 0 ? "\n" : " ");
+        }
+        append(source, "\" + ");
+    }
+    append(source, "\"\"");
+}
+
+static void identifiers(Source* source)
+{
+    char word[64];
+    while (!isFull(source))
+    {
+        randomWord(word, 1 + nextRandom() % 24);
+        append(source, word);
+        append(source, nextRandom() % 8 == 0 ? " +\n" : " + ");
+    }
+    append(source, "x");
+}
+
+// keywords, and as many identifiers that only just aren't one, the words
+// identifierType() has the most work with
+static void keywords(Source* source)
+{
+    static const char* words[] =
+    {
+        "and", "class", "else", "false", "for", "fun", "if", "nil", "or", "print",
+        "return", "super", "this", "true", "var", "while",
+        "an", "classy", "elsa", "fals", "fo", "fund", "iff", "nail", "ok", "prints",
+        "retain", "supper", "thus", "tree", "val", "whale",
+    };
+    while (!isFull(source))
+    {
+        append(source, words[nextRandom() % 32]);
+        append(source, nextRandom() % 8 == 0 ? "\n" : " ");
+    }
+}
+
+// deeply indented code
+static void blanks(Source* source)
+{
+    static const char indent[] = "\n                                        ";
+    while (!isFull(source))
+    {
+        append(source, "(1 +");
+        append(source, indent + nextRandom() % 32);
+        append(source, "2) * ");
+        append(source, indent + nextRandom() % 32);
+    }
+    append(source, "3");
+}
+
+static void run(const char* name, void (*generate)(Source*), size_t size)
+{
+    Source source = { (char*)malloc(size), 0, size };
+    generate(&source);
+
+    double start = now();
+    Scanner scanner;
+    initScanner(&scanner, source.chars, source.length);
+    long tokens = 0;
+    long keywords = 0;
+    Token token;
+    for (;;)
+    {
+        token = scanToken(&scanner);
+        if (token.type == TOKEN_EOF) break;
+        tokens++;
+        keywords += token.type >= TOKEN_AND && token.type <= TOKEN_WHILE;
+    }
+    double elapsed = now() - start;
+
+    printf("%-12s %10.0f %12ld %12ld %12d\n", name, source.length / elapsed / 1e6,
+        tokens, keywords, token.line);
+    free(source.chars);
+}
+
+int main(int argc, const char* argv[])
+{
+    size_t size = (size_t)(argc > 1 ? atoi(argv[1]) : 64) * 1024 * 1024;
+
+    printf("%-12s %10s %12s %12s %12s\n", "source", "MB/s", "tokens", "keywords", "lines");
+    run("comments", comments, size);
+    run("strings", strings, size);
+    run("identifiers", identifiers, size);
+    run("blanks", blanks, size);
+    run("keywords", keywords, size);
+    return 0;
+}
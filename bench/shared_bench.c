@@ -0,0 +1,176 @@
+// Intern overlapping sets of strings from 1, 4 and 16 threads, each thread
+// with a VM of its own, once with every VM interning into its own set and
+// once through one SharedStrings (shared.h) for all of them, and report
+// the strings interned per second and the memory the strings and their
+// tables take.
+//
+//   make clean && make bench DEFINES=-DCLOX_RELEASE
+//   ./bin/bench/shared_bench [common strings] [rounds]
+//
+// Every thread interns the same common strings, the literals of the code
+// all the interpreters run, plus a quarter as many of its own, 'rounds'
+// times over. The first round mostly misses and inserts, the others hit.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+#include "object.h"
+#include "shared.h"
+#include "vm.h"
+
+#define MAX_THREADS (16)
+
+typedef struct
+{
+    pthread_t thread;
+    VM* vm;
+    StringRef* strings;
+    int count;
+    int rounds;
+    // a string of the first round and of the last one, they must be the same
+    ObjString* first;
+    ObjString* last;
+} Worker;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void* work(void* argument)
+{
+    Worker* worker = (Worker*)argument;
+    for (int round = 0; round < worker->rounds; round++)
+    {
+        for (int i = 0; i < worker->count; i++)
+        {
+            ObjString* string = copyString(worker->vm, worker->strings[i].chars, worker->strings[i].length);
+            if (i == 0 && round == 0) worker->first = string;
+            if (i == 0) worker->last = string;
+        }
+    }
+    return NULL;
+}
+
+// the characters of "<prefix><i>" for i in [0, count), in one buffer
+static char* makeText(const char* prefix, int count, StringRef* strings)
+{
+    char* text = (char*)malloc((size_t)count * 32);
+    char* cursor = text;
+    for (int i = 0; i < count; i++)
+    {
+        int length = sprintf(cursor, "%s%d", prefix, i);
+        strings[i].chars = cursor;
+        strings[i].length = length;
+        cursor += length + 1;
+    }
+    return text;
+}
+
+static void run(int threads, bool isShared, StringRef* common, int commonCount, int rounds)
+{
+    int ownCount = commonCount / 4;
+    int count = commonCount + ownCount;
+
+    SharedStrings* shared = isShared ? newSharedStrings() : NULL;
+    Worker workers[MAX_THREADS];
+    char* texts[MAX_THREADS];
+    for (int t = 0; t < threads; t++)
+    {
+        Worker* worker = &workers[t];
+        worker->vm = (VM*)malloc(sizeof(VM));
+        initVM(worker->vm);
+        // the strings are referenced from nowhere the collector looks
+        worker->vm->nextGC = SIZE_MAX;
+        worker->vm->sharedStrings = shared;
+
+        // the common strings and then this thread's own, the threads
+        // interleave on the common ones
+        worker->strings = (StringRef*)malloc(sizeof(StringRef) * count);
+        memcpy(worker->strings, common, sizeof(StringRef) * commonCount);
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "thread-%d-", t);
+        texts[t] = makeText(prefix, ownCount, worker->strings + commonCount);
+        worker->count = count;
+        worker->rounds = rounds;
+    }
+
+    double start = now();
+    for (int t = 0; t < threads; t++)
+    {
+        if (pthread_create(&workers[t].thread, NULL, work, &workers[t]) != 0) exit(71);
+    }
+    for (int t = 0; t < threads; t++) pthread_join(workers[t].thread, NULL);
+    double elapsed = now() - start;
+
+    size_t bytes = 0;
+    size_t strings = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        Worker* worker = &workers[t];
+        if (worker->first != worker->last || (isShared && worker->first != workers[0].first))
+        {
+            fprintf(stderr, "the same characters gave two strings\n");
+            exit(70);
+        }
+
+        MemoryStats stats;
+        getMemoryStats(worker->vm, MEM_STRINGS, &stats);
+        bytes += stats.currentBytes;
+        getMemoryStats(worker->vm, MEM_TABLE, &stats);
+        bytes += stats.currentBytes;
+        strings += worker->vm->strings.groups.keys;
+    }
+    if (shared != NULL)
+    {
+        SharedStringStats stats;
+        getSharedStringStats(shared, &stats);
+        bytes += stats.stringBytes + stats.tableBytes;
+        strings += stats.strings;
+    }
+
+    double total = (double)threads * count * rounds;
+    printf("%8d %-8s %12.2f %12zu %12.2f\n", threads, isShared ? "shared" : "private",
+        total / elapsed / 1e6, strings, bytes / 1048576.0);
+
+    for (int t = 0; t < threads; t++)
+    {
+        freeVM(workers[t].vm);
+        free(workers[t].vm);
+        free(workers[t].strings);
+        free(texts[t]);
+    }
+    if (shared != NULL) freeSharedStrings(shared);
+}
+
+int main(int argc, const char* argv[])
+{
+    int commonCount = argc > 1 ? atoi(argv[1]) : 200000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 4;
+
+    StringRef* common = (StringRef*)malloc(sizeof(StringRef) * commonCount);
+    char* text = makeText("literal_", commonCount, common);
+
+    printf("%d common strings and %d of its own per thread, %d rounds\n",
+        commonCount, commonCount / 4, rounds);
+    printf("%8s %-8s %12s %12s %12s\n", "threads", "", "M strings/s", "strings", "MB");
+    static const int threadCounts[] = { 1, 4, 16 };
+    for (int i = 0; i < 3; i++)
+    {
+        run(threadCounts[i], false, common, commonCount, rounds);
+        run(threadCounts[i], true, common, commonCount, rounds);
+    }
+
+    free(common);
+    free(text);
+    return 0;
+}
@@ -0,0 +1,102 @@
+// Fill a Table with more and more string keys and time lookups of keys
+// that are in it and of keys that are not, at the load factor each size
+// ends up with.
+//
+//   make clean && make bench DEFINES=-DCLOX_RELEASE
+//   ./bin/bench/table_bench [max keys] [lookups]
+//
+// Misses are what tableFindString() mostly sees : every string the scanner
+// or concatenate() makes is looked up before it is interned, and a new one
+// is not there yet. A miss has to probe until it is sure, so it is also the
+// lookup that suffers most from a full table.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+static VM vm;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static ObjString* makeKey(const char* prefix, int i)
+{
+    char buffer[32];
+    int length = snprintf(buffer, sizeof(buffer), "%s%d", prefix, i);
+    return copyString(&vm, buffer, length);
+}
+
+// lookups of keys[0 .. count), picked in a scattered order so that the
+// probes do not walk the table from front to back
+static double timeLookups(Table* table, ObjString** keys, int count, long lookups)
+{
+    uint32_t index = 0;
+    long found = 0;
+
+    double start = now();
+    for (long i = 0; i < lookups; i++)
+    {
+        index = (index + 2654435761u) % (uint32_t)count;
+        ObjString* key = keys[index];
+        if (tableFindString(&vm, table, key->chars, key->length, key->hash) != NULL) found++;
+    }
+    double elapsed = now() - start;
+
+    // keep the loop from being optimized away
+    if (found < 0) printf("%ld\n", found);
+    return elapsed * 1e9 / lookups;
+}
+
+int main(int argc, const char* argv[])
+{
+    int maxKeys = argc > 1 ? atoi(argv[1]) : 1800000;
+    long lookups = argc > 2 ? atol(argv[2]) : 2000000;
+
+    initVM(&vm);
+    // the keys are only referenced from the arrays below, which the
+    // collector does not know about (DEBUG_STRESS_GC ignores this, don't
+    // run the bench with it)
+    vm.nextGC = SIZE_MAX;
+
+    ObjString** present = (ObjString**)malloc(sizeof(ObjString*) * maxKeys);
+    ObjString** missing = (ObjString**)malloc(sizeof(ObjString*) * maxKeys);
+    for (int i = 0; i < maxKeys; i++)
+    {
+        present[i] = makeKey("key-", i);
+        missing[i] = makeKey("missing-", i);
+    }
+
+    Table table;
+    initTable(&table);
+
+    printf("%10s %10s %6s %12s %12s\n", "keys", "capacity", "load", "hit ns", "miss ns");
+    int count = 0;
+    // maxKeys / 16 more keys per row, which crosses a few resizes
+    for (int target = maxKeys / 8; target <= maxKeys; target += maxKeys / 16)
+    {
+        for (; count < target; count++) tableSet(&vm, &table, present[count], NIL_VAL);
+
+        double hit = timeLookups(&table, present, count, lookups);
+        double miss = timeLookups(&table, missing, count, lookups);
+        printf("%10d %10d %6.2f %12.1f %12.1f\n",
+            count, table.groups.capacity, (double)table.groups.keys / table.groups.capacity, hit, miss);
+    }
+
+    freeTable(&vm, &table);
+    free(present);
+    free(missing);
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,225 @@
+// Run scripts on many threads at once, each thread with a VM of its own,
+// and check that every result is the one a single thread gets.
+//
+//   make clean && make bench DEFINES=-DCLOX_RELEASE
+//   ./bin/bench/threads_bench [threads] [rounds]
+//
+// Every job is a script at one of the optimization levels, compiled and
+// run from scratch, so the scanner, the compiler, the interning, the heap
+// and the collector of each VM are all busy while the other threads use
+// theirs. The same jobs are then run one thread after the other for the
+// serial time. The results are printed by OP_RETURN, stdout goes to
+// /dev/null and the report to stderr.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "object.h"
+#include "vm.h"
+
+#define LEVEL_COUNT (3)
+#define MAX_JOBS (64)
+#define RESULT_MAX (64)
+
+typedef struct
+{
+    const char* source;
+    int level;
+    // the result a single thread gets, see describe()
+    char expected[RESULT_MAX];
+} Job;
+
+typedef struct
+{
+    pthread_t thread;
+    int first;
+    int rounds;
+    int failures;
+} Worker;
+
+static const char* fixedScripts[] = {
+    "1 + 2 * 3 - 4 / (5 - 6) * -7",
+    "(1 + 2) * (3 + 4) * (5 + 6) == 231",
+    "!(1 < 2) == !(3 >= 4) != !nil",
+    "\"con\" + \"cat\" + \"en\" + \"ation\"",
+    "\"a\" + \"b\" == \"ab\"",
+};
+
+static Job jobs[MAX_JOBS];
+static int jobCount = 0;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// "term op term op ..." : with strings a long rope, and at -O0 enough
+// intermediate nodes to keep the collector of the VM going
+static char* repeatTerm(const char* term, const char* op, int count)
+{
+    size_t termLength = strlen(term);
+    size_t opLength = strlen(op);
+    char* source = (char*)malloc(count * (termLength + opLength) + 1);
+    char* cursor = source;
+    for (int i = 0; i < count; i++)
+    {
+        if (i > 0)
+        {
+            memcpy(cursor, op, opLength);
+            cursor += opLength;
+        }
+        memcpy(cursor, term, termLength);
+        cursor += termLength;
+    }
+    *cursor = '\0';
+    return source;
+}
+
+// OP_RETURN prints the result and pops it, the slot under the stack top
+// still holds it until something is pushed again. Strings are summed up
+// by length and a few characters, comparing them whole would be most of
+// the work on the long ones.
+static void describe(VM* vm, char* buffer)
+{
+    Value value = *vm->stackTop;
+    if (IS_NUMBER(value))
+    {
+        snprintf(buffer, RESULT_MAX, "%g", AS_NUMBER(value));
+    }
+    else if (IS_BOOL(value))
+    {
+        snprintf(buffer, RESULT_MAX, "%s", AS_BOOL(value) ? "true" : "false");
+    }
+    else if (IS_STRING(value))
+    {
+        ObjString* string = AS_STRING(value);
+        snprintf(buffer, RESULT_MAX, "string %d %.8s %08x", string->length, string->chars, string->hash);
+    }
+    else
+    {
+        snprintf(buffer, RESULT_MAX, "nil");
+    }
+}
+
+static bool runJob(VM* vm, Job* job, char* result)
+{
+    setOptimizationLevel(vm, job->level);
+
+    Chunk chunk;
+    initChunk(&chunk);
+    bool ok = compile(vm, job->source, strlen(job->source), &chunk) &&
+        interpretChunk(vm, &chunk) == INTERPRET_OK;
+    if (ok) describe(vm, result);
+    freeChunk(vm, &chunk);
+    return ok;
+}
+
+static void* work(void* argument)
+{
+    Worker* worker = (Worker*)argument;
+
+    VM* vm = (VM*)malloc(sizeof(VM));
+    initVM(vm);
+
+    char result[RESULT_MAX];
+    for (int round = 0; round < worker->rounds; round++)
+    {
+        for (int i = 0; i < jobCount; i++)
+        {
+            Job* job = &jobs[(worker->first + i) % jobCount];
+            if (!runJob(vm, job, result) || strcmp(result, job->expected) != 0)
+            {
+                worker->failures++;
+            }
+        }
+    }
+
+    freeVM(vm);
+    free(vm);
+    return NULL;
+}
+
+int main(int argc, const char* argv[])
+{
+    int threadCount = argc > 1 ? atoi(argv[1]) : 8;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+
+    if (freopen("/dev/null", "w", stdout) == NULL) exit(74);
+
+    const char* scripts[MAX_JOBS / LEVEL_COUNT];
+    int scriptCount = 0;
+    for (size_t i = 0; i < sizeof(fixedScripts) / sizeof(fixedScripts[0]); i++)
+    {
+        scripts[scriptCount++] = fixedScripts[i];
+    }
+    char* rope = repeatTerm("\"a piece of text\"", " + ", 2000);
+    char* arithmetic = repeatTerm("(3 * 4 - 2) / 5", " + ", 3000);
+    scripts[scriptCount++] = rope;
+    scripts[scriptCount++] = arithmetic;
+
+    // the expected results, from a VM on this thread
+    VM* reference = (VM*)malloc(sizeof(VM));
+    initVM(reference);
+    for (int i = 0; i < scriptCount; i++)
+    {
+        for (int level = 0; level < LEVEL_COUNT; level++)
+        {
+            Job* job = &jobs[jobCount++];
+            job->source = scripts[i];
+            job->level = level;
+            if (!runJob(reference, job, job->expected))
+            {
+                fprintf(stderr, "script %d fails at -O%d\n", i, level);
+                exit(70);
+            }
+        }
+    }
+    freeVM(reference);
+    free(reference);
+
+    Worker* workers = (Worker*)calloc(threadCount, sizeof(Worker));
+    for (int i = 0; i < threadCount; i++)
+    {
+        workers[i].first = i % jobCount;
+        workers[i].rounds = rounds;
+    }
+
+    double start = now();
+    for (int i = 0; i < threadCount; i++) work(&workers[i]);
+    double serialTime = now() - start;
+
+    start = now();
+    for (int i = 0; i < threadCount; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0)
+        {
+            fprintf(stderr, "could not start thread %d\n", i);
+            exit(71);
+        }
+    }
+    for (int i = 0; i < threadCount; i++) pthread_join(workers[i].thread, NULL);
+    double threadedTime = now() - start;
+
+    int failures = 0;
+    for (int i = 0; i < threadCount; i++) failures += workers[i].failures;
+
+    fprintf(stderr, "%d threads x %d rounds x %d jobs\n", threadCount, rounds, jobCount);
+    fprintf(stderr, "  serial   %10.3f ms\n", serialTime * 1e3);
+    fprintf(stderr, "  threads  %10.3f ms (x%.2f)\n", threadedTime * 1e3, serialTime / threadedTime);
+    fprintf(stderr, "  %d results differ from the single thread ones\n", failures);
+
+    free(workers);
+    free(rope);
+    free(arithmetic);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,97 @@
+// Compile a Lox file once and run the resulting chunk over and over again,
+// so that only the execution itself is measured.
+//
+//   make clean && make bench DEFINES=-DCLOX_RELEASE
+//   ./bin/bench/vm_bench arith.lox 100000 > /dev/null
+//   ./bin/bench/vm_bench -O2 arith.lox 100000 > /dev/null
+//
+// The result of every run is printed to stdout by OP_RETURN, the timings go
+// to stderr.
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "vm.h"
+
+static VM vm;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char* readFile(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open file \"%s\". \n", path);
+        exit(74);
+    }
+
+    fseek(file, 0L, SEEK_END);
+    size_t fileSize = ftell(file);
+    rewind(file);
+
+    char* buffer = (char*)malloc(fileSize + 1);
+    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    buffer[bytesRead] = '\0';
+
+    fclose(file);
+    return buffer;
+}
+
+int main(int argc, const char* argv[])
+{
+    int level = 1;
+    if (argc > 1 && argv[1][0] == '-' && argv[1][1] == 'O')
+    {
+        level = atoi(argv[1] + 2);
+        argc--;
+        argv++;
+    }
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: vm_bench [-O0|-O1|-O2] [path] [iterations]\n");
+        exit(64);
+    }
+    int iterations = argc > 2 ? atoi(argv[2]) : 10000;
+
+    initVM(&vm);
+    setOptimizationLevel(&vm, level);
+
+    char* source = readFile(argv[1]);
+    Chunk chunk;
+    initChunk(&chunk);
+
+    double start = now();
+    if (!compile(&vm, source, strlen(source), &chunk)) exit(65);
+    double compileTime = now() - start;
+
+    start = now();
+    for (int i = 0; i < iterations; i++)
+    {
+        if (interpretChunk(&vm, &chunk) != INTERPRET_OK) exit(70);
+    }
+    double runTime = now() - start;
+
+    fprintf(stderr, "%s -O%d : sizeof(Value) = %zu, %d bytes of code, %d constants\n",
+        argv[1], level, sizeof(Value), chunk.count, chunk.constants.count);
+    fprintf(stderr, "  compile %10.3f us\n", compileTime * 1e6);
+    fprintf(stderr, "  run     %10.3f us / iteration (%d iterations)\n",
+        runTime * 1e6 / iterations, iterations);
+
+    freeChunk(&vm, &chunk);
+    free(source);
+    freeVM(&vm);
+    return 0;
+}
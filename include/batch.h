@@ -0,0 +1,41 @@
+#ifndef clox_batch_h
+#define clox_batch_h
+
+#include "cache.h"
+#include "common.h"
+
+// the most worker threads runBatch() starts
+#define BATCH_MAX_JOBS (256)
+
+// Runs many scripts at once, each one as runFile() would, on a pool of
+// worker threads. Every worker owns a VM and runs its scripts on it one
+// after the other. The files are split into one contiguous range per
+// worker, a worker that is done with its range steals the back half of
+// what another one has left.
+//
+// The output and the errors of every script are collected in memory and
+// written to stdout and stderr in the order the files were given, as soon
+// as all the files before it are done. At the end the files per second
+// and the percentiles of the time each file took go to stderr.
+typedef struct
+{
+    // worker threads, 0 for one per core online
+    int jobs;
+    // the settings of every worker VM, see compiler.h
+    int optimizationLevel;
+    int lexThreads;
+    // see setStackMax() (vm.h)
+    int stackMax;
+    CacheMode cacheMode;
+    bool useMmap;
+    // one SharedStrings (shared.h) for all the worker VMs
+    bool sharedStrings;
+    // print the memory statistics of every worker VM at the end
+    bool memStats;
+} BatchOptions;
+
+// returns the exit code of the first file (in the order given) that
+// failed, 0 when all of them ran
+int runBatch(const char** paths, int count, const BatchOptions* options);
+
+#endif
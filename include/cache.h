@@ -0,0 +1,51 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+
+// Compiled bytecode cache.
+//
+// interpretCached() keeps the chunk compiled from "script.lox" in "script.loxc",
+// keyed on a hash of the source and on everything else that changes the
+// bytecode (format version, byte order, optimization level). Constants are
+// stored as tagged entries rather than raw Values, so builds with and
+// without NAN_BOXING read each other's caches.
+// A valid cache file is mapped with mmap and its code and line records are
+// used in place, so loading a large script is a validate-and-map step
+// instead of a full scan and compile. Only the constants are copied out,
+// strings have to be interned into this VM anyway.
+
+// The default is CACHE_READ : a run never writes next to a script unless
+// it is asked to with --cache=auto|force|emit.
+typedef enum
+{
+    CACHE_READ,  // use the cache when it is valid, otherwise compile without writing it
+    CACHE_AUTO,  // use the cache when it is valid, otherwise compile and write it
+    CACHE_FORCE, // always compile and rewrite the cache
+    CACHE_OFF,   // neither read nor write the cache
+    CACHE_EMIT,  // compile and write the cache, but do not run the script
+} CacheMode;
+
+// a chunk backed by a mapped cache file
+typedef struct
+{
+    Chunk chunk;
+    void* mapping;
+    size_t mappingSize;
+} CachedChunk;
+
+// returns false when there is no cache file, or when it is stale or broken
+bool loadCache(VM* vm, const char* cachePath, const char* source, size_t length, CachedChunk* cached);
+// unmaps the file, 'cached->chunk' must not be freed with freeChunk()
+void freeCachedChunk(VM* vm, CachedChunk* cached);
+bool writeCache(VM* vm, const char* cachePath, const char* source, size_t length, Chunk* chunk);
+
+// Runs the script at 'path', whose text is 'source', through its cache the
+// way 'mode' says (anything but CACHE_OFF). With CACHE_EMIT the script is
+// only compiled, and failing to write the cache is INTERPRET_IO_ERROR,
+// reported to vm->err like the other errors.
+InterpretResult interpretCached(VM* vm, const char* path, const char* source, size_t length, CacheMode mode);
+
+#endif
@@ -27,12 +27,30 @@ typedef enum
     // end of - arithmetic
     OP_CONSTANT_LONG,
     OP_RETURN,
+    // - expression temporaries, only produced by the IR emitter (ir.c)
+    OP_DUP,             // push a copy of the top of the stack
+    OP_GET_TEMP,        // push stack slot <operand>
+    OP_SET_TEMP,        // copy the top of the stack into slot <operand>
+    // end of - expression temporaries
+    // - superinstructions, only produced by the peephole pass (peephole.c)
+    OP_NOT_EQUAL,       // OP_EQUAL   OP_NOT
+    OP_GREATER_EQUAL,   // OP_LESS    OP_NOT
+    OP_LESS_EQUAL,      // OP_GREATER OP_NOT
+    OP_ADD_CONST,       // OP_CONSTANT k OP_ADD
+    OP_SUBTRACT_CONST,  // OP_CONSTANT k OP_SUBTRACT
+    OP_MULTIPLY_CONST,  // OP_CONSTANT k OP_MULTIPLY
+    OP_DIVIDE_CONST,    // OP_CONSTANT k OP_DIVIDE
+    // end of - superinstructions
 } OpCode;
 
+// One run of consecutive bytes compiled from the same line. The run goes
+// from 'startOffset' up to the start of the next record (or the end of the
+// code), so the records are sorted by offset and a lookup is a binary
+// search, see getLine().
 typedef struct
 {
     int lineNumber;
-    int offsetPerLine;
+    int startOffset;
 } LineRecord;
 
 typedef struct
@@ -58,12 +76,37 @@ typedef struct
     // Reference :
     // https://en.wikibooks.org/wiki/MIPS_Assembly/Instruction_Formats
     ValueArray constants;
+
+    // Hash index over 'constants', so that repeated literals share one
+    // slot. Open addressing, every slot holds an index into
+    // constants.values or -1. Entries are only hints, a lookup always
+    // checks the value it lands on, so slots given back by
+    // removeLastConstant() need no cleanup here.
+    int constantIndexCount;
+    int constantIndexCapacity;
+    int* constantIndex;
+
+    // the most values the code has on the stack at once, see stackDepth()
+    int maxStack;
 } Chunk;
 
 void initChunk(Chunk* chunk);
-void freeChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
-int addConstant(Chunk* chunk, Value value);
-void writeConstant(Chunk* chunk, Value value, int line);
+void freeChunk(VM* vm, Chunk* chunk);
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
+// returns the index of 'value' in the constant pool, adding it if needed
+int addConstant(VM* vm, Chunk* chunk, Value value);
+// give back the last slot of the constant pool
+void removeLastConstant(Chunk* chunk);
+void writeConstant(VM* vm, Chunk* chunk, Value value, int line);
+// drop every byte from offset 'count' on, the line table included
+void truncateChunk(Chunk* chunk, int count);
+// size in bytes of an instruction, opcode and operands included
+int instructionLength(uint8_t instruction);
+// The most values on the stack at once while the code runs, the slots the
+// temporaries are read from and written to included. The code is straight
+// line, one pass over it is enough. Returns -1 when an instruction would
+// pop more than there is or use a temporary below nothing, code no
+// compiler makes.
+int stackDepth(Chunk* chunk);
 
 #endif
\ No newline at end of file
@@ -5,7 +5,33 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Build switches, pass them through the makefile, for example
+//
+//   make DEFINES="-DNAN_BOXING -DCLOX_RELEASE"
+//
+// NAN_BOXING      : pack every Value into a single 64-bit double (value.h)
+// CLOX_RELEASE    : drop the disassembler dump and execution trace, which
+//                   would otherwise dominate the runtime of any benchmark
+// SWITCH_DISPATCH : use the portable switch in run() even when the compiler
+//                   supports labels as values (computed goto)
+// DEBUG_STRESS_GC : keep the collector running at all times, one object of
+//                   work per allocation, to flush out missing roots
+// FNV_HASH        : hash strings a byte at a time with FNV-1a, instead of
+//                   the word at a time hash (object.c), also what compilers
+//                   without a 128 bit integer type get
+// SCALAR_SCANNER  : scan one character at a time, without the SSE2 (or
+//                   AVX2, when built with -mavx2) fast paths of scanner.c
+//
+// Remember to `make clean` after changing them, objects are not rebuilt
+// when only the flags change.
+
+#ifndef CLOX_RELEASE
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#endif
+
+#if defined(__GNUC__) && !defined(SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#endif
 
 #endif
\ No newline at end of file
@@ -4,6 +4,22 @@
 #include "object.h"
 #include "vm.h"
 
-bool compile(const char* source, Chunk* chunk);
+// 'source' does not need to be '\0' terminated, the strings and the
+// constants it makes belong to 'vm'
+bool compile(VM* vm, const char* source, size_t length, Chunk* chunk);
+
+// 0 : emit the code exactly as parsed
+// 1 : fold constants and fuse superinstructions (the default)
+// 2 : also build the whole expression as IR and optimize it (ir.h)
+void setOptimizationLevel(VM* vm, int level);
+int getOptimizationLevel(VM* vm);
+
+// 0 : scan the source a token at a time, as the parser asks for them (the
+//     default)
+// n : scan all of it before parsing, on up to n threads (lexer.h)
+void setLexThreads(VM* vm, int threads);
+
+// marks the objects the compiler of 'vm' holds on to, while compile() runs
+void markCompilerRoots(VM* vm);
 
 #endif
\ No newline at end of file
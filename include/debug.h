@@ -1,9 +1,11 @@
 #ifndef clox_debug_h
 #define clox_debug_h
 
+#include <stdio.h>
+
 #include "chunk.h"
 
-void disassembleChunk(Chunk* chunk, const char* name);
-int disassembleInstruction(Chunk* chunk, int offset);
+void disassembleChunk(FILE* out, Chunk* chunk, const char* name);
+int disassembleInstruction(FILE* out, Chunk* chunk, int offset);
 
 #endif
\ No newline at end of file
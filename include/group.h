@@ -0,0 +1,250 @@
+#ifndef clox_group_h
+#define clox_group_h
+
+#include "common.h"
+#include "value.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Control-byte groups, shared by Table (table.h) and InternSet (intern.h).
+//
+// Reference : https://abseil.io/about/design/swisstables
+//
+// Both keep one control byte per slot in an array of its own : EMPTY,
+// DELETED (a tombstone), or the low 7 bits of the hash of the key in that
+// slot. A probe looks at a group of GROUP_SIZE control bytes at once and
+// only touches the slots whose 7 bits match, so most of a probe never
+// leaves the control array.
+#define GROUP_SIZE (16)
+
+// a full slot holds 7 bits of hash and has the top bit clear
+#define CONTROL_EMPTY   ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xFE)
+
+static inline bool isFullControl(uint8_t control)
+{
+    return (control & 0x80) == 0;
+}
+
+// The hash is split in two : the top bits pick the group a probe starts
+// at, the low 7 go into the control byte. Using different bits for each
+// keeps the control byte from being the same for every key of a group.
+static inline uint32_t groupHash(uint32_t hash)
+{
+    return hash >> 7;
+}
+
+static inline uint8_t controlHash(uint32_t hash)
+{
+    return (uint8_t)(hash & 0x7F);
+}
+
+// Bit i of the result is set when control byte i of the group equals
+// 'control'.
+static inline uint32_t matchControl(const uint8_t* group, uint8_t control)
+{
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    __m128i match = _mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)control));
+    return (uint32_t)_mm_movemask_epi8(match);
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+    {
+        mask |= (uint32_t)(group[i] == control) << i;
+    }
+    return mask;
+#endif
+}
+
+// Same, for every slot that is empty or a tombstone, the two control bytes
+// with the top bit set.
+static inline uint32_t matchFree(const uint8_t* group)
+{
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(bytes);
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+    {
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+// Probe sequence : the group of groupHash(), then 1, 2, 3... groups further
+// on (triangular numbers). With a power of two number of groups that visits
+// every group once before it repeats, and since a table is never full a
+// probe always ends at a group with an empty slot.
+typedef struct
+{
+    uint32_t group;
+    uint32_t step;
+    uint32_t mask;
+} Probe;
+
+static inline Probe startProbe(int capacity, uint32_t hash)
+{
+    Probe probe;
+    probe.mask = (uint32_t)(capacity / GROUP_SIZE) - 1;
+    probe.group = groupHash(hash) & probe.mask;
+    probe.step = 0;
+    return probe;
+}
+
+static inline void nextProbe(Probe* probe)
+{
+    probe->step++;
+    probe->group = (probe->group + probe->step) & probe->mask;
+}
+
+// the first free slot on the probe sequence of 'hash', for a key that is
+// known not to be in the table
+static inline int findFreeSlot(const uint8_t* controls, int capacity, uint32_t hash)
+{
+    Probe probe = startProbe(capacity, hash);
+
+    for (;;)
+    {
+        int base = probe.group * GROUP_SIZE;
+        uint32_t freeSlots = matchFree(&controls[base]);
+        if (freeSlots != 0) return base + __builtin_ctz(freeSlots);
+        nextProbe(&probe);
+    }
+}
+
+// A group that still has an empty slot never made a probe go past it, so
+// a key deleted from it needs no tombstone to keep the others findable, the
+// slot can simply be empty again. Groups only lose empty slots between two
+// rebuilds, which keeps that true. Returns the new control byte.
+static inline uint8_t deletedControl(const uint8_t* controls, int slot)
+{
+    int base = slot & ~(GROUP_SIZE - 1);
+    return matchControl(&controls[base], CONTROL_EMPTY) != 0 ? CONTROL_EMPTY : CONTROL_DELETED;
+}
+
+// What the shared code needs to know about the slots of a table : how big
+// one is, and the hash of the key in a full one.
+typedef struct
+{
+    size_t slotSize;
+    uint32_t (*hashOf)(const void* slot);
+} GroupLayout;
+
+// The arrays of a table and the state of its resizes, which Table and
+// InternSet share. Resizing is incremental : the new arrays are allocated
+// right away, but the slots move over a few at a time, GROUP_MIGRATE_SLOTS
+// per operation on the table (group.c). Until they all have, lookups look
+// in both.
+typedef struct
+{
+    // slots in use in 'slots', tombstones included
+    int count;
+    // keys in the table, in both arrays while resizing
+    int keys;
+    // zero, or a power of two and a multiple of GROUP_SIZE
+    int capacity;
+    uint8_t* control;
+    void* slots;
+
+    // the arrays being moved out of, NULL when not resizing
+    int oldCapacity;
+    uint8_t* oldControl;
+    void* oldSlots;
+    // old slots below this one are moved already
+    int migrated;
+    // false to move every slot as soon as a resize starts, the way a plain
+    // hash table does it
+    bool isIncremental;
+} Groups;
+
+#define GROUP_MIGRATE_SLOTS (64)
+
+void initGroups(Groups* groups);
+void freeGroups(VM* vm, Groups* groups, const GroupLayout* layout);
+void migrateGroups(VM* vm, Groups* groups, const GroupLayout* layout, int slots);
+// Make room for one more key, and take the slot it goes to, reusing a
+// tombstone on the way if there is one. Returns the slot in the new arrays,
+// its control byte is set, what goes in it is up to the caller.
+int claimGroupSlot(VM* vm, Groups* groups, const GroupLayout* layout, uint32_t hash);
+
+// Every operation on a table starts with this, it moves a few more slots
+// while a resize is going on.
+static inline void stepResize(VM* vm, Groups* groups, const GroupLayout* layout)
+{
+    if (groups->oldControl != NULL) migrateGroups(vm, groups, layout, GROUP_MIGRATE_SLOTS);
+}
+
+static inline void* slotAt(void* slots, const GroupLayout* layout, int index)
+{
+    return (char*)slots + (size_t)index * layout->slotSize;
+}
+
+// whether a full slot holds the key a lookup is after
+typedef bool (*SlotMatch)(const void* slot, const void* key);
+
+// the slot of the given arrays that 'matches' takes, -1 when there is none
+// (slots below 'first' are ignored)
+static inline int probeGroups(const uint8_t* controls, void* slots, const GroupLayout* layout,
+    int capacity, int first, uint32_t hash, SlotMatch matches, const void* key)
+{
+    Probe probe = startProbe(capacity, hash);
+    uint8_t control = controlHash(hash);
+
+    for (;;)
+    {
+        int base = probe.group * GROUP_SIZE;
+        const uint8_t* group = &controls[base];
+
+        for (uint32_t match = matchControl(group, control); match != 0; match &= match - 1)
+        {
+            int index = base + __builtin_ctz(match);
+            if (index >= first && matches(slotAt(slots, layout, index), key)) return index;
+        }
+
+        // an empty slot means the key would have been put here, had it
+        // been inserted, tombstones don't end the probe
+        if (matchControl(group, CONTROL_EMPTY) != 0) return -1;
+        nextProbe(&probe);
+    }
+}
+
+// Where findGroups() found a key : slot 'index' of the new arrays, or of
+// the old ones while a resize is not done, -1 when it is in neither.
+typedef struct
+{
+    int index;
+    bool isOld;
+} GroupSlot;
+
+// Inline with the rest of the lookup, so that a constant 'layout' and
+// 'matches' get inlined as well.
+static inline GroupSlot findGroups(Groups* groups, const GroupLayout* layout, uint32_t hash,
+    SlotMatch matches, const void* key)
+{
+    GroupSlot found = { -1, false };
+    if (groups->keys == 0) return found;
+
+    found.index = probeGroups(groups->control, groups->slots, layout, groups->capacity, 0,
+        hash, matches, key);
+    if (found.index >= 0 || groups->oldControl == NULL) return found;
+
+    found.index = probeGroups(groups->oldControl, groups->oldSlots, layout,
+        groups->oldCapacity, groups->migrated, hash, matches, key);
+    found.isOld = true;
+    return found;
+}
+
+static inline void* foundSlot(Groups* groups, const GroupLayout* layout, GroupSlot found)
+{
+    return slotAt(found.isOld ? groups->oldSlots : groups->slots, layout, found.index);
+}
+
+// empties a slot findGroups() found, the caller clears what was in it
+void removeGroupSlot(Groups* groups, GroupSlot found);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef clox_intern_h
+#define clox_intern_h
+
+#include "common.h"
+#include "group.h"
+#include "value.h"
+
+// The set of interned strings, vm.strings.
+//
+// A Table would do, but it keeps a Value next to every key that interning
+// never reads, and it has to look at the ObjString itself to tell two keys
+// apart. A slot here holds the full hash and the length of its string next
+// to the pointer instead : a probe that lands on the wrong string is
+// rejected from the slot alone, and the only string ever dereferenced is
+// the one whose characters really have to be compared. Slots are found
+// through control-byte groups, like in Table (group.h).
+typedef struct
+{
+    uint32_t hash;
+    int length;
+    ObjString* string;
+} InternSlot;
+
+// Resizes move the slots over a few per call, the way Table does (group.h).
+typedef struct
+{
+    // the slots are InternSlots, Groups.keys counts the strings
+    Groups groups;
+} InternSet;
+
+void initInternSet(InternSet* set);
+void freeInternSet(VM* vm, InternSet* set);
+
+// the interned string with these characters, NULL when there is none
+ObjString* internFind(VM* vm, InternSet* set, const char* chars, int length, uint32_t hash);
+// adds a string that internFind() did not find, may grow the set
+void internAdd(VM* vm, InternSet* set, ObjString* string);
+bool internRemove(VM* vm, InternSet* set, ObjString* string);
+
+// Start loading the part of the set a lookup of 'hash' looks at first.
+// Issued a few lookups ahead, it hides the cache misses of a batch.
+void internPrefetch(InternSet* set, uint32_t hash);
+
+#endif
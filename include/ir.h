@@ -0,0 +1,69 @@
+#ifndef clox_ir_h
+#define clox_ir_h
+
+#include "chunk.h"
+#include "common.h"
+#include "value.h"
+
+// Expression IR, used by the compiler at -O2.
+//
+// Instead of emitting bytecode while parsing, the compiler builds a DAG of
+// IrNodes, optimizes it as a whole and only then emits bytecode from it.
+// Nodes live in one growable array (the arena) and refer to each other by
+// index, so a node is 32 bytes and the whole graph is freed at once.
+//
+// Nodes are hash-consed : asking for a node that already exists returns the
+// existing one, so identical subexpressions are shared by construction and
+// the emitter computes them only once.
+
+// index of a node in the arena, operands always have a smaller index than
+// the nodes using them
+typedef int IrRef;
+
+#define IR_NONE (-1)
+
+typedef struct
+{
+    // OP_CONSTANT for leaves, otherwise the OpCode of the operation :
+    // OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE, OP_EQUAL, OP_GREATER,
+    // OP_LESS, OP_NOT or OP_NEGATE
+    uint8_t op;
+    // "if this node evaluates without a runtime error, the result is a
+    // number", derived from the operands when the node is created
+    bool isNumeric;
+    int line;
+    IrRef left;  // the operand of unary nodes
+    IrRef right; // IR_NONE for unary nodes
+    Value value; // OP_CONSTANT only
+} IrNode;
+
+typedef struct
+{
+    int count;
+    int capacity;
+    IrNode* nodes;
+
+    // open addressing set of node indices, for hash-consing
+    int setCapacity;
+    IrRef* set;
+} IrGraph;
+
+void initIr(IrGraph* ir);
+void freeIr(VM* vm, IrGraph* ir);
+
+IrRef irConstant(VM* vm, IrGraph* ir, Value value, int line);
+IrRef irUnary(VM* vm, IrGraph* ir, OpCode op, IrRef operand, int line);
+IrRef irBinary(VM* vm, IrGraph* ir, OpCode op, IrRef left, IrRef right, int line);
+
+static inline bool irIsConstant(IrGraph* ir, IrRef ref)
+{
+    return ir->nodes[ref].op == OP_CONSTANT;
+}
+
+// run the optimization passes over the expression rooted at 'root',
+// returns the root of the optimized expression
+IrRef irOptimize(VM* vm, IrGraph* ir, IrRef root);
+// emit the bytecode computing 'root', leaving its value on top of the stack
+void irEmit(VM* vm, IrGraph* ir, IrRef root, Chunk* chunk);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef clox_lexer_h
+#define clox_lexer_h
+
+#include "common.h"
+#include "scanner.h"
+
+// the most threads scanTokens() runs on
+#define LEX_MAX_THREADS (64)
+
+// Every token of a source at once, in one array, instead of one at a time
+// from scanToken(). The last one is the TOKEN_EOF.
+typedef struct
+{
+    Token* tokens;
+    int count;
+} TokenArray;
+
+// Scans the whole source into 'array', split in pieces (splitSource()) and
+// the pieces scanned on up to 'threads' threads. The tokens are the ones
+// scanToken() would return, line numbers included.
+void scanTokens(TokenArray* array, const char* source, size_t length, int threads);
+void freeTokenArray(TokenArray* array);
+
+#endif
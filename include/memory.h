@@ -1,26 +1,143 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <stdio.h>
+
 #include "object.h"
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+// What a block is used for. Every allocation names its category, so that
+// reallocate() can keep the totals of each one, see getMemoryStats().
+typedef enum
+{
+    MEM_CODE,      // Chunk.code
+    MEM_LINES,     // Chunk.lineRecordList
+    MEM_CONSTANTS, // constant pools and their dedup index
+    MEM_TABLE,     // hash table entries
+    MEM_STRINGS,   // string objects and the buffers they are built in
+    MEM_IR,        // the -O2 expression graph (ir.c)
+    MEM_STACK,     // VM.stack
+    MEM_OTHER,
+    MEM_CATEGORY_COUNT
+} MemoryCategory;
+
+// Every block belongs to the heap of a VM, the one passed as 'vm'.
+#define ALLOCATE(vm, type, count, category) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count), category)
 
-#define FREE(type, pointer) \
-    reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer, category) \
+    reallocate(vm, pointer, sizeof(type), 0, category)
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(previous, type, oldCount, count) \
-    (type*)reallocate(previous, sizeof(type) * (oldCount), \
-        sizeof(type) * (count))
+#define GROW_ARRAY(vm, previous, type, oldCount, count, category) \
+    (type*)reallocate(vm, previous, sizeof(type) * (oldCount), \
+        sizeof(type) * (count), category)
+
+#define FREE_ARRAY(vm, type, pointer, oldCount, category) \
+    reallocate(vm, pointer, sizeof(type) * (oldCount), 0, category)
+
+// blocks up to SLAB_MAX_SIZE bytes come from the slab allocator (memory.c),
+// rounded up to a multiple of SLAB_GRANULE, larger ones from malloc
+#define SLAB_GRANULE (16)
+#define SLAB_MAX_SIZE (256)
+#define SLAB_CLASS_COUNT (SLAB_MAX_SIZE / SLAB_GRANULE)
+#define SLAB_SIZE (4096)
+
+typedef struct sFreeBlock
+{
+    struct sFreeBlock* next;
+} FreeBlock;
+
+// every slab starts with this header, the blocks follow it
+typedef struct sSlab
+{
+    struct sSlab* next;
+} Slab;
+
+typedef struct
+{
+    FreeBlock* freeList;
+    // blocks of the newest slab that were never handed out
+    char* unused;
+    char* unusedEnd;
+    size_t liveBlocks;
+} SizeClass;
+
+typedef struct
+{
+    size_t slabCount;
+    size_t slabBytes; // what the slabs take from the system allocator
+    size_t usedBytes; // what is handed out of them, rounded to the class size
+} SlabStats;
+
+typedef struct
+{
+    size_t currentBytes;
+    size_t peakBytes;
+    size_t allocations; // blocks allocated from nothing
+    size_t frees;       // blocks given back
+    size_t resizes;     // blocks grown or shrunk in place of both
+} MemoryStats;
+
+// What reallocate() works with, one per VM : its slabs, and the totals of
+// every category. Nothing in here is shared, VMs on different threads
+// allocate without any locking.
+typedef struct
+{
+    SizeClass sizeClasses[SLAB_CLASS_COUNT];
+    // every slab of every class, only walked by freeSlabs()
+    Slab* slabs;
+    size_t slabCount;
+
+    // One entry per category, plus the totals at MEM_CATEGORY_COUNT.
+    // Counted in the sizes callers ask for, what the slabs round them up
+    // to shows in getSlabStats().
+    MemoryStats stats[MEM_CATEGORY_COUNT + 1];
+} Heap;
+
+typedef enum
+{
+    GC_IDLE,  // waiting for the heap to reach VM.nextGC
+    GC_MARK,  // tracing from the roots, a few gray objects per step
+    GC_SWEEP, // freeing white objects, a few per step
+} GcPhase;
+
+typedef struct
+{
+    size_t cycles;
+    size_t steps;         // increments of work, each one a pause
+    size_t freedObjects;
+    uint64_t totalPauseNs;
+    uint64_t maxPauseNs;
+} GcStats;
+
+void initHeap(Heap* heap);
+void* reallocate(VM* vm, void* previous, size_t oldSize, size_t newSize, MemoryCategory category);
+
+// - garbage collector
+void markObject(VM* vm, Obj* object);
+void markValue(VM* vm, Value value);
+// Called on every string the intern table hands out. While a cycle is
+// running, that string may be white and unreachable, and without this it
+// would be freed right under the code that just got it back.
+void internBarrier(VM* vm, Obj* object);
+// runs the current cycle, or a new one, to the end
+void collectGarbage(VM* vm);
+// end of - garbage collector
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
+void freeObjects(VM* vm);
+// gives every slab back to the system, every block allocated from them
+// must be dead by then
+void freeSlabs(VM* vm);
+void getSlabStats(VM* vm, SlabStats* stats);
 
-void* reallocate(void* previous, size_t oldSize, size_t newSize);
-void freeObjects();
+// MEM_CATEGORY_COUNT gives the totals over every category, whose peak is
+// the peak of the sum, not the sum of the peaks
+void getMemoryStats(VM* vm, MemoryCategory category, MemoryStats* stats);
+const char* memoryCategoryName(MemoryCategory category);
+// the --mem-stats summary
+void printMemoryStats(VM* vm, FILE* out);
 
 
 #endif
\ No newline at end of file
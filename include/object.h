@@ -6,17 +6,30 @@
 
 #define OBJ_TYPE(value)         (AS_OBJ(value)->type)
 #define IS_STRING(value)        isObjType(value, OBJ_STRING)
+#define IS_ROPE(value)          isObjType(value, OBJ_ROPE)
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value))
+#define AS_ROPE(value)          ((ObjRope*)AS_OBJ(value))
 #define AS_CSTRING(value)       (((ObjString*)AS_OBJ(value))->chars)
 
+// Concatenations shorter than this are copied right away, a rope node is
+// not worth it for a handful of bytes. Every rope is at least this long.
+#define ROPE_MIN_LENGTH (64)
+
 typedef enum
 {
     OBJ_STRING,
+    OBJ_ROPE,
 } ObjType;
 
 struct sObj
 {
     ObjType type;
+    // black (reached by the collector) when it equals vm.markValue, see
+    // the collector in memory.c
+    bool isMarked;
+    // in the SharedStrings of the process (shared.h) : owned by no VM,
+    // never marked nor swept, and never changed again
+    bool isShared;
     // adding this pointer allows us to use this struct as a linked-list node
     // and by connecting every Lox object within this list, it's easier to
     // traverse every object and do GC
@@ -42,10 +55,61 @@ struct sObjString
     char chars[];
 };
 
-// this just takes in a c-string and construct a lox string out of it
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);
-void printObject(Value value);
+// A string concatenation that has not happened yet.
+//
+// Reference : https://en.wikipedia.org/wiki/Rope_(data_structure)
+//
+// "a + b" with two long operands makes a rope node pointing at both of them
+// instead of copying, so a chain of n concatenations costs n nodes, not n
+// copies of an ever longer prefix. The characters are only put together
+// (and interned) by flattenRope(), when something needs them : printing or
+// equality. Table keys are always ObjString, so a rope has to be flattened
+// before it can be one.
+typedef struct
+{
+    Obj obj;
+    int length;
+    // an ObjString or an ObjRope that is not flattened yet
+    Obj* left;
+    Obj* right;
+    // the interned result once flattened, left and right are dropped then
+    ObjString* flat;
+} ObjRope;
+
+// Build a string in place, in its final block : reserveString() allocates
+// it with room for 'length' chars (terminator included), the caller fills
+// in chars, and finishString() hashes and interns it. The string returned
+// by finishString() is the one to use, when an equal string is interned
+// already the reservation is freed and that one comes back instead.
+//
+// A reservation is not an object yet. The collector does not see it, so it
+// must not be the only reference to anything.
+ObjString* reserveString(VM* vm, int length);
+ObjString* finishString(VM* vm, ObjString* string);
+// construct a lox string out of a c-string that is not ours
+ObjString* copyString(VM* vm, const char* chars, int length);
+// the hash every ObjString carries, FNV-1a when built with FNV_HASH
+uint32_t hashString(const char* key, int length);
+
+// characters copyStrings() makes a string of
+typedef struct
+{
+    const char* chars;
+    int length;
+} StringRef;
+
+// copyString() for many strings at once, results[i] is the string of
+// strings[i]. Cheaper than one call per string when there are many, the
+// lookups are prefetched ahead. The strings made are
+// only referenced from 'results' until the call returns, so the caller has
+// to make sure the collector can see that array.
+void copyStrings(VM* vm, const StringRef* strings, int count, ObjString** results);
+// "a + b" for two strings or ropes, both stay reachable by the caller
+Obj* concatenateStrings(VM* vm, Obj* a, Obj* b);
+// The flat, interned string of a rope. Allocates the first time, so the
+// rope has to be reachable (on the stack) when this is called.
+ObjString* flattenRope(VM* vm, ObjRope* rope);
+void printObject(FILE* out, Value value);
 
 // Why use a function rather than macro?
 //
@@ -59,4 +123,10 @@ static inline bool isObjType(Value value, ObjType type)
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// a string, flattened or not
+static inline bool isText(Value value)
+{
+    return IS_STRING(value) || IS_ROPE(value);
+}
+
 #endif
\ No newline at end of file
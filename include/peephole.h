@@ -0,0 +1,10 @@
+#ifndef clox_peephole_h
+#define clox_peephole_h
+
+#include "chunk.h"
+
+// rewrite a finished chunk in place, fusing common instruction sequences
+// into the superinstructions listed at the end of OpCode
+void peepholeOptimize(VM* vm, Chunk* chunk);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include <stddef.h>
+
 typedef enum
 {
     // Single-character tokens.
@@ -37,7 +39,34 @@ typedef struct
 } Token;
 
 
-void initScanner(const char* source);
-Token scanToken();
+typedef struct
+{
+    const char* start;
+    const char* current;
+    // one past the last character, the source may be a read-only mapping
+    // of the file (see mapFile() in source.c), so there is no '\0' to stop at
+    const char* end;
+    int line;
+} Scanner;
+
+// A scanner belongs to whoever scans with it, the compiler has one and so
+// has every thread of the parallel lexer (lexer.c).
+void initScanner(Scanner* scanner, const char* source, size_t length);
+Token scanToken(Scanner* scanner);
+
+// A part of a source that scans to the same tokens on its own as it does
+// within the whole source, bar the line numbers : those start at 1 in a
+// piece, 'line' is the line it really starts at.
+typedef struct
+{
+    const char* start;
+    size_t length;
+    int line;
+} SourcePiece;
+
+// Splits a source in up to 'count' pieces of about the same length, each
+// but the first starting right after a newline that is neither in a string
+// literal nor in a comment. Returns the number of pieces.
+int splitSource(const char* source, size_t length, int count, SourcePiece* pieces);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,53 @@
+#ifndef clox_shared_h
+#define clox_shared_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "value.h"
+
+// String interning shared by every VM of the process, --shared-strings.
+//
+// Every VM interns into its own InternSet (intern.h), so many interpreters
+// running the same code each make and keep a copy of the same literals.
+// A VM given a SharedStrings (VM.sharedStrings) puts the strings it copies
+// in from outside, copyString() and copyStrings(), in here instead, once
+// for all of them.
+//
+// A shared string is published whole and never changes after that. It
+// belongs to no VM : it is allocated with malloc(), is not on any object
+// list and is never marked (Obj.isShared), so it lives until the table is
+// freed. Strings a VM makes itself (concatenations) stay in its own set,
+// they are rarely the same from one script to the next.
+//
+// The table is split in shards by the top bits of the hash. Lookups take
+// no lock at all : a slot is filled once and never emptied, and a grown
+// array is kept around until the table is freed, so a lookup racing with
+// an insert either sees the new string or misses it. Inserts lock only
+// their shard, and look again under the lock before adding.
+//
+// Every string is in the table at most once, so two shared strings are
+// equal exactly when they are the same object, whichever VMs they came
+// from.
+typedef struct sSharedStrings SharedStrings;
+
+typedef struct
+{
+    size_t strings;
+    size_t stringBytes;
+    size_t tableBytes;
+} SharedStringStats;
+
+SharedStrings* newSharedStrings();
+// frees every string too, no VM may use the table any more
+void freeSharedStrings(SharedStrings* shared);
+
+// the shared string with these characters, NULL when there is none
+ObjString* sharedFind(SharedStrings* shared, const char* chars, int length, uint32_t hash);
+// the shared string with these characters, added when there is none
+ObjString* sharedIntern(SharedStrings* shared, const char* chars, int length, uint32_t hash);
+
+void getSharedStringStats(SharedStrings* shared, SharedStringStats* stats);
+void printSharedStringStats(SharedStrings* shared, FILE* out);
+
+#endif
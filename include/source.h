@@ -0,0 +1,24 @@
+#ifndef clox_source_h
+#define clox_source_h
+
+#include "common.h"
+
+// The text of a script file.
+//
+// By default the file is mapped read-only with mmap, the scanner walks the
+// page cache directly and no copy of the source is ever made. With
+// --no-mmap, or for files that cannot be mapped (pipes, empty files), it
+// is read into a heap buffer instead. Either way 'chars' is only valid
+// for 'length' characters, there is no '\0' after them.
+typedef struct
+{
+    const char* chars;
+    size_t length;
+    bool isMapped;
+} SourceFile;
+
+// returns false when the file cannot be read, the caller reports it
+bool loadSource(SourceFile* source, const char* path, bool useMmap);
+void freeSource(SourceFile* source);
+
+#endif
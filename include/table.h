@@ -2,6 +2,7 @@
 #define clox_table_h
 
 #include "common.h"
+#include "group.h"
 #include "value.h"
 
 // The ratio of count to capacity is the load factor of the hash table.
@@ -12,20 +13,20 @@ typedef struct
     Value value;
 } Entry;
 
+// Open addressing over control-byte groups, with incremental resizes, see
+// group.h. The slots are Entries.
 typedef struct
 {
-    int count;
-    int capacity;
-    Entry* entries;
+    Groups groups;
 } Table;
 
 void initTable(Table* table);
-void freeTable(Table* table);
-bool tableGet(Table* table, ObjString* key, Value* value);
-bool tableSet(Table* table, ObjString* key, Value value);
-bool tableDelete(Table* table, ObjString* key);
-void tableAddAll(Table* from, Table* to);
+void freeTable(VM* vm, Table* table);
+bool tableGet(VM* vm, Table* table, ObjString* key, Value* value);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
+bool tableDelete(VM* vm, Table* table, ObjString* key);
+void tableAddAll(VM* vm, Table* from, Table* to);
 
-ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
+ObjString* tableFindString(VM* vm, Table* table, const char* chars, int length, uint32_t hash);
 
 #endif
\ No newline at end of file
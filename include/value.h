@@ -1,10 +1,76 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <stdio.h>
+
 #include "common.h"
 
 typedef struct sObj Obj;
 typedef struct sObjString ObjString;
+// the interpreter state (vm.h), everything that allocates is given one
+typedef struct sVM VM;
+
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// Reference : http://www.craftinginterpreters.com/optimization.html#nan-boxing
+//
+// Every double whose exponent bits are all set and whose "quiet" bit is set
+// is a quiet NaN, and the CPU never produces one with any of the remaining
+// mantissa bits set. That leaves 51 bits we can use to stuff non-number
+// values into a 64-bit word :
+//
+// - nil, false and true are three different small tags on top of QNAN
+// - objects set the sign bit, and the pointer lives in the low 48 bits
+//
+// This halves a Value from 16 bytes (tag + padding + union) to 8 bytes.
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL   1 // 01.
+#define TAG_FALSE 2 // 10.
+#define TAG_TRUE  3 // 11.
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value)    (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)     ((value) == NIL_VAL)
+#define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) \
+    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value)    ((value) == TRUE_VAL)
+#define AS_NUMBER(value)  valueToNum(value)
+#define AS_OBJ(value) \
+    ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(num)   numToValue(num)
+#define OBJ_VAL(obj) \
+    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+// type punning through memcpy, the compiler turns it into a plain register
+// move, whereas a union or pointer cast would be undefined behaviour.
+static inline double valueToNum(Value value)
+{
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num)
+{
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
 
 typedef enum
 {
@@ -39,6 +105,8 @@ typedef struct
 #define NUMBER_VAL(value) ((Value){ VAL_NUMBER, { .number = value } })
 #define OBJ_VAL(object)   ((Value){ VAL_OBJ, { .obj = (Obj*)object } })
 
+#endif
+
 typedef struct
 {
     int capacity;
@@ -47,11 +115,16 @@ typedef struct
 } ValueArray;
 
 bool valuesEqual(Value a, Value b);
+// Bitwise identity, unlike valuesEqual() 0 and -0 are different values
+// here and a NaN is identical to itself. This is what hash-consing and
+// deduplication need.
+bool valuesIdentical(Value a, Value b);
+uint32_t hashValue(Value value);
 
 void initValueArray(ValueArray* array);
-void writeValueArray(ValueArray* array, Value value);
-void freeValueArray(ValueArray* array);
+void writeValueArray(VM* vm, ValueArray* array, Value value);
+void freeValueArray(VM* vm, ValueArray* array);
 
-void printValue(Value value);
+void printValue(FILE* out, Value value);
 
 #endif
\ No newline at end of file
@@ -2,6 +2,8 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "intern.h"
+#include "memory.h"
 #include "table.h"
 #include "value.h"
 
@@ -16,45 +18,105 @@
  *  and you expect 3 * P_SIZE to be 3 times of the packet size, you get
  *  3 * H_SIZE + B_SIZE, which leads to a tragedy, based on real events.
  */
-#define STACK_MAX (256)
+#define STACK_INITIAL (64)
+// the most values a VM lets its stack grow to, unless told otherwise with
+// setStackMax() (--stack-max=n)
+#define STACK_DEFAULT_MAX (1024 * 1024)
+// The pushes run() makes past what Chunk.maxStack counts : the constant
+// OP_ADD_CONST pushes to concatenate with, and the string internString()
+// keeps on the stack while the intern set grows.
+#define STACK_SLACK (2)
 
-typedef struct
+// the state of a compile() in progress, see compiler.c
+typedef struct sCompiler Compiler;
+// see shared.h
+typedef struct sSharedStrings SharedStrings;
+
+// Everything an interpreter needs lives in here, there is no global state
+// left : VMs are independent of each other, each one can run on a thread
+// of its own. A VM is not safe to share between threads.
+struct sVM
 {
     Chunk* chunk;
     // instruction pointer
     uint8_t* ip;
     // declare the stack
-    Value stack[STACK_MAX];
+    // 'stackCapacity' values, grown by reserveStack() up to 'stackMax'
+    Value* stack;
+    int stackCapacity;
+    int stackMax;
     // Since the stack grows and shrinks as values are pushed and popped, 
     // we need to track where the top of the stack is in the array
     Value* stackTop;
     // For string interning
-    Table strings;
+    InternSet strings;
 
     // a linked-list of Lox objects, which are allocated on heap
     // garbage collection is needed in order to avoid memory leak
     Obj* objects;
+    // where reallocate() gets its blocks from, see memory.c
+    Heap heap;
+
+    // - garbage collector state, see memory.c
+    GcPhase gcPhase;
+    // the value of Obj.isMarked meaning "black" in the current cycle,
+    // flipping it turns every black object white at once
+    bool markValue;
+    // the object heap size (MEM_STRINGS) at which the next cycle starts
+    size_t nextGC;
+    // marked objects whose references are not traced yet
+    int grayCount;
+    int grayCapacity;
+    Obj** grayStack;
+    // the link the incremental sweep looks at next
+    Obj** sweep;
+    GcStats gcStats;
+    // end of - garbage collector state
+
+    // the compiler running on this VM, NULL outside of compile(), its
+    // objects are roots too
+    Compiler* compiler;
+    // see setOptimizationLevel() and setLexThreads() (compiler.h)
+    int optimizationLevel;
+    int lexThreads;
 
-} VM;
+    // where the results of the scripts and the errors go, stdout and stderr
+    // unless the batch runner (batch.h) collects them
+    FILE* out;
+    FILE* err;
+
+    // the strings shared with the other VMs of the process (shared.h),
+    // NULL for none
+    SharedStrings* sharedStrings;
+};
 
 typedef enum
 {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
+    INTERPRET_RUNTIME_ERROR,
+    // the script ran into a file it could not write, see interpretCached()
+    INTERPRET_IO_ERROR
 } InterpretResult;
 
-extern VM vm;
-
-void initVM();
-void freeVM();
+void initVM(VM* vm);
+void freeVM(VM* vm);
 
-InterpretResult interpret(const char* source);
+InterpretResult interpret(VM* vm, const char* source, size_t length);
+InterpretResult interpretChunk(VM* vm, Chunk* chunk);
 // stack operations
-void push(Value value);
-Value pop();
+// push() checks nothing, whatever pushes makes room first : run() reserves
+// what the chunk needs (Chunk.maxStack) once, before the first instruction
+void push(VM* vm, Value value);
+Value pop(VM* vm);
+// Makes room for 'slots' more values on top of the stack, growing it if
+// needed. Returns false, and leaves the stack as it is, when that would
+// take it past vm->stackMax.
+bool reserveStack(VM* vm, int slots);
+void setStackMax(VM* vm, int stackMax);
 
 // added
+// the source line of the byte at 'offset', -1 when it is outside the code
 int getLine(Chunk* chunk, int offset);
 
 #endif
\ No newline at end of file
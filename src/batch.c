@@ -0,0 +1,316 @@
+// open_memstream() and _SC_NPROCESSORS_ONLN are not part of C11, ask glibc
+// for them explicitly
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "compiler.h"
+#include "memory.h"
+#include "shared.h"
+#include "source.h"
+#include "vm.h"
+
+typedef struct
+{
+    const char* path;
+    // what the script printed and the errors it reported, both
+    // open_memstream() buffers
+    char* out;
+    size_t outLength;
+    char* err;
+    size_t errLength;
+    // the code runFile() would exit with
+    int exitCode;
+    double seconds;
+    bool isDone;
+} BatchFile;
+
+typedef struct sBatch Batch;
+
+typedef struct
+{
+    Batch* batch;
+    int index;
+    VM vm;
+
+    // The files this worker has left, [next, end). The worker takes them
+    // from the front, the others steal from the back, both under 'lock'.
+    pthread_mutex_t lock;
+    int next;
+    int end;
+
+    pthread_t thread;
+    bool hasThread;
+} Worker;
+
+struct sBatch
+{
+    const BatchOptions* options;
+    BatchFile* files;
+    int count;
+    Worker* workers;
+    int workerCount;
+
+    // guards BatchFile.isDone and 'written', the writer waits on 'done'
+    // for the file it is to write next
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int written;
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void* allocateBatch(size_t size)
+{
+    void* block = calloc(1, size);
+    if (block == NULL)
+    {
+        fprintf(stderr, "Not enough memory to run the batch. \n");
+        exit(74);
+    }
+    return block;
+}
+
+// Returns the index of the next file for 'worker', -1 when there is none
+// left anywhere. Only one lock is held at a time : a range stolen from
+// another worker is taken out of its range first and given to this one
+// after.
+static int takeFile(Worker* worker)
+{
+    pthread_mutex_lock(&worker->lock);
+    int index = worker->next < worker->end ? worker->next++ : -1;
+    pthread_mutex_unlock(&worker->lock);
+    if (index >= 0) return index;
+
+    Batch* batch = worker->batch;
+    for (int i = 1; i < batch->workerCount; i++)
+    {
+        Worker* victim = &batch->workers[(worker->index + i) % batch->workerCount];
+
+        pthread_mutex_lock(&victim->lock);
+        int left = victim->end - victim->next;
+        int start = victim->end - (left + 1) / 2;
+        int end = victim->end;
+        if (left > 0) victim->end = start;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (left > 0)
+        {
+            pthread_mutex_lock(&worker->lock);
+            worker->next = start + 1;
+            worker->end = end;
+            pthread_mutex_unlock(&worker->lock);
+            return start;
+        }
+    }
+
+    return -1;
+}
+
+static void runOne(Worker* worker, BatchFile* file)
+{
+    VM* vm = &worker->vm;
+    const BatchOptions* options = worker->batch->options;
+
+    double start = now();
+    FILE* out = open_memstream(&file->out, &file->outLength);
+    FILE* err = open_memstream(&file->err, &file->errLength);
+    if (out == NULL || err == NULL)
+    {
+        fprintf(stderr, "Not enough memory to run \"%s\". \n", file->path);
+        exit(74);
+    }
+    vm->out = out;
+    vm->err = err;
+
+    SourceFile source;
+    if (loadSource(&source, file->path, options->useMmap))
+    {
+        InterpretResult result = options->cacheMode == CACHE_OFF
+            ? interpret(vm, source.chars, source.length)
+            : interpretCached(vm, file->path, source.chars, source.length, options->cacheMode);
+        freeSource(&source);
+
+        if (result == INTERPRET_COMPILE_ERROR) file->exitCode = 65;
+        else if (result == INTERPRET_RUNTIME_ERROR) file->exitCode = 70;
+        else if (result == INTERPRET_IO_ERROR) file->exitCode = 74;
+    }
+    else
+    {
+        fprintf(err, "Could not read file \"%s\". \n", file->path);
+        file->exitCode = 74;
+    }
+
+    fclose(out);
+    fclose(err);
+    vm->out = stdout;
+    vm->err = stderr;
+    file->seconds = now() - start;
+
+    Batch* batch = worker->batch;
+    pthread_mutex_lock(&batch->lock);
+    file->isDone = true;
+    // only the file the writer waits for is worth waking it up
+    if (file == &batch->files[batch->written]) pthread_cond_signal(&batch->done);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void* work(void* argument)
+{
+    Worker* worker = (Worker*)argument;
+    for (int index = takeFile(worker); index >= 0; index = takeFile(worker))
+    {
+        runOne(worker, &worker->batch->files[index]);
+    }
+    return NULL;
+}
+
+// writes the output of every file in order, while the workers still run
+static int writeFiles(Batch* batch)
+{
+    int exitCode = 0;
+    for (int i = 0; i < batch->count; i++)
+    {
+        BatchFile* file = &batch->files[i];
+
+        pthread_mutex_lock(&batch->lock);
+        batch->written = i;
+        while (!file->isDone) pthread_cond_wait(&batch->done, &batch->lock);
+        pthread_mutex_unlock(&batch->lock);
+
+        fwrite(file->out, sizeof(char), file->outLength, stdout);
+        if (file->errLength > 0)
+        {
+            // stderr is not buffered, keep what came before it in front
+            fflush(stdout);
+            fwrite(file->err, sizeof(char), file->errLength, stderr);
+        }
+        free(file->out);
+        free(file->err);
+
+        if (exitCode == 0) exitCode = file->exitCode;
+    }
+    fflush(stdout);
+    return exitCode;
+}
+
+static int compareSeconds(const void* a, const void* b)
+{
+    double left = *(const double*)a;
+    double right = *(const double*)b;
+    return (left > right) - (left < right);
+}
+
+static void printSummary(Batch* batch, double seconds)
+{
+    double* sorted = (double*)allocateBatch(sizeof(double) * batch->count);
+    for (int i = 0; i < batch->count; i++) sorted[i] = batch->files[i].seconds;
+    qsort(sorted, batch->count, sizeof(double), compareSeconds);
+
+    #define PERCENTILE(p) (sorted[(int)((p) * (batch->count - 1))] * 1e6)
+    fprintf(stderr, "batch      %d files on %d workers in %.3f s, %.0f files/s\n",
+        batch->count, batch->workerCount, seconds, batch->count / seconds);
+    fprintf(stderr, "latency    p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+        PERCENTILE(0.5), PERCENTILE(0.9), PERCENTILE(0.99), PERCENTILE(1.0));
+    #undef PERCENTILE
+
+    free(sorted);
+}
+
+int runBatch(const char** paths, int count, const BatchOptions* options)
+{
+    if (count == 0) return 0;
+
+    Batch batch;
+    batch.options = options;
+    batch.count = count;
+    batch.files = (BatchFile*)allocateBatch(sizeof(BatchFile) * count);
+    for (int i = 0; i < count; i++) batch.files[i].path = paths[i];
+
+    int jobs = options->jobs > 0 ? options->jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1) jobs = 1;
+    if (jobs > BATCH_MAX_JOBS) jobs = BATCH_MAX_JOBS;
+    if (jobs > count) jobs = count;
+    batch.workerCount = jobs;
+    batch.workers = (Worker*)allocateBatch(sizeof(Worker) * jobs);
+    SharedStrings* shared = options->sharedStrings ? newSharedStrings() : NULL;
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    batch.written = 0;
+
+    double start = now();
+    for (int i = 0; i < jobs; i++)
+    {
+        Worker* worker = &batch.workers[i];
+        worker->batch = &batch;
+        worker->index = i;
+        initVM(&worker->vm);
+        setOptimizationLevel(&worker->vm, options->optimizationLevel);
+        setLexThreads(&worker->vm, options->lexThreads);
+        setStackMax(&worker->vm, options->stackMax);
+        worker->vm.sharedStrings = shared;
+
+        // contiguous ranges, neighbouring files tend to be alike
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->next = (int)((long)count * i / jobs);
+        worker->end = (int)((long)count * (i + 1) / jobs);
+    }
+
+    // a worker without a thread leaves its files to the others to steal
+    bool anyThread = false;
+    for (int i = 0; i < jobs; i++)
+    {
+        Worker* worker = &batch.workers[i];
+        worker->hasThread = pthread_create(&worker->thread, NULL, work, worker) == 0;
+        anyThread = anyThread || worker->hasThread;
+    }
+    // and without any, this one runs them all before writing them out
+    if (!anyThread) work(&batch.workers[0]);
+
+    int exitCode = writeFiles(&batch);
+
+    for (int i = 0; i < jobs; i++)
+    {
+        if (batch.workers[i].hasThread) pthread_join(batch.workers[i].thread, NULL);
+    }
+    double seconds = now() - start;
+
+    printSummary(&batch, seconds);
+
+    for (int i = 0; i < jobs; i++)
+    {
+        Worker* worker = &batch.workers[i];
+        if (options->memStats)
+        {
+            fprintf(stderr, "worker %d\n", i);
+            printMemoryStats(&worker->vm, stderr);
+        }
+        freeVM(&worker->vm);
+        pthread_mutex_destroy(&worker->lock);
+    }
+
+    // only once every VM that uses them is gone
+    if (shared != NULL)
+    {
+        if (options->memStats) printSharedStringStats(shared, stderr);
+        freeSharedStrings(shared);
+    }
+
+    pthread_cond_destroy(&batch.done);
+    pthread_mutex_destroy(&batch.lock);
+    free(batch.workers);
+    free(batch.files);
+    return exitCode;
+}
@@ -0,0 +1,456 @@
+// fdopen() is POSIX, not C11
+#define _POSIX_C_SOURCE 200809L
+
+#include "cache.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A cache file is laid out as
+//
+//   CacheHeader
+//   code            codeCount bytes
+//   padding         up to the alignment of LineRecord
+//   line records    lineCount LineRecords, exactly as in LineRecordList
+//   constants       constantCount tagged entries, see writeConstantEntry()
+//
+// Everything is stored in host byte order, the file is a cache and not an
+// exchange format. byteOrder still catches a file copied over from a
+// machine where that order differs.
+//
+// Bump CACHE_VERSION whenever the bytecode or this layout changes, e.g.
+// when opcodes are added or renumbered, every old cache is then simply
+// recompiled.
+#define CACHE_MAGIC "LOXC"
+#define CACHE_VERSION (3)
+#define CACHE_BYTE_ORDER (0x01020304)
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t optimizationLevel;
+    uint64_t sourceLength;
+    uint64_t sourceHash;
+    // hash of everything after the header, the VM trusts the bytecode it
+    // runs, so a flipped bit in the file must not make it to run()
+    uint64_t payloadHash;
+    uint32_t codeCount;
+    uint32_t lineCount;
+    uint32_t constantCount;
+    uint32_t linesOffset;
+    uint32_t constantsOffset;
+    uint32_t fileSize;
+} CacheHeader;
+
+typedef enum
+{
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER, // followed by the 8 bytes of the double
+    CONSTANT_STRING, // followed by a uint32_t length and the characters
+} ConstantTag;
+
+// 64 bit FNV-1a, what hashString() uses with FNV_HASH, with 64 bit constants.
+// It only has to tell "this source" from "the source the cache was built
+// from", the length is compared separately.
+//
+// Reference : http://www.isthe.com/chongo/tech/comp/fnv/
+static uint64_t hashBytes(const void* bytes, size_t length)
+{
+    const uint8_t* cursor = (const uint8_t*)bytes;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= cursor[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static size_t alignUp(size_t offset, size_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+static void initHeader(VM* vm, CacheHeader* header, const char* source, size_t length)
+{
+    memset(header, 0, sizeof(CacheHeader));
+    memcpy(header->magic, CACHE_MAGIC, 4);
+    header->version = CACHE_VERSION;
+    header->byteOrder = CACHE_BYTE_ORDER;
+    header->optimizationLevel = getOptimizationLevel(vm);
+    header->sourceLength = length;
+    header->sourceHash = hashBytes(source, length);
+}
+
+// reads one constant starting at '*cursor', returns false when it runs past 'end'
+static bool readConstant(VM* vm, const uint8_t** cursor, const uint8_t* end, Value* value)
+{
+    if (*cursor >= end) return false;
+    uint8_t tag = *(*cursor)++;
+
+    switch (tag)
+    {
+    case CONSTANT_NIL:   *value = NIL_VAL; return true;
+    case CONSTANT_FALSE: *value = BOOL_VAL(false); return true;
+    case CONSTANT_TRUE:  *value = BOOL_VAL(true); return true;
+    case CONSTANT_NUMBER:
+    {
+        double number;
+        if (end - *cursor < (ptrdiff_t)sizeof(double)) return false;
+        memcpy(&number, *cursor, sizeof(double));
+        *cursor += sizeof(double);
+        *value = NUMBER_VAL(number);
+        return true;
+    }
+    case CONSTANT_STRING:
+    {
+        uint32_t length;
+        if (end - *cursor < (ptrdiff_t)sizeof(uint32_t)) return false;
+        memcpy(&length, *cursor, sizeof(uint32_t));
+        *cursor += sizeof(uint32_t);
+        if ((uint64_t)(end - *cursor) < length) return false;
+        // re-intern, the pointer stored at compile time means nothing now
+        *value = OBJ_VAL(copyString(vm, (const char*)*cursor, (int)length));
+        *cursor += length;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// Checks everything the VM trusts the compiler with : the line table
+// covers the code exactly, every instruction fits in the code and every
+// constant operand is inside the pool.
+static bool validateChunk(Chunk* chunk)
+{
+    // runs start at 0 and at strictly increasing offsets inside the code
+    LineRecordList* list = &chunk->lineRecordList;
+    if (list->count == 0 || list->lineRecords[0].startOffset != 0) return false;
+    for (int i = 1; i < list->count; i++)
+    {
+        int start = list->lineRecords[i].startOffset;
+        if (start <= list->lineRecords[i - 1].startOffset || start >= chunk->count) return false;
+    }
+
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        uint8_t instruction = chunk->code[offset];
+        int length = instructionLength(instruction);
+        if (length > chunk->count - offset) return false;
+
+        int constant = -1;
+        switch (instruction)
+        {
+        case OP_CONSTANT:
+        case OP_ADD_CONST:
+        case OP_SUBTRACT_CONST:
+        case OP_MULTIPLY_CONST:
+        case OP_DIVIDE_CONST:
+            constant = chunk->code[offset + 1];
+            break;
+        case OP_CONSTANT_LONG:
+            constant = chunk->code[offset + 1] |
+                       (chunk->code[offset + 2] << 8) |
+                       (chunk->code[offset + 3] << 16);
+            break;
+        default:
+            break;
+        }
+        if (constant >= chunk->constants.count) return false;
+
+        offset += length;
+    }
+
+    // not stored, recomputed from the code the file holds
+    chunk->maxStack = stackDepth(chunk);
+    if (chunk->maxStack < 0) return false;
+
+    // run() only stops at OP_RETURN
+    return chunk->count > 0 && chunk->code[chunk->count - 1] == OP_RETURN;
+}
+
+bool loadCache(VM* vm, const char* cachePath, const char* source, size_t length, CachedChunk* cached)
+{
+    int fd = open(cachePath, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(CacheHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)info.st_size;
+    // the mapping stays valid after the descriptor is closed
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+
+    CacheHeader expected;
+    initHeader(vm, &expected, source, length);
+
+    const CacheHeader* header = (const CacheHeader*)mapping;
+    const uint8_t* base = (const uint8_t*)mapping;
+
+    if (memcmp(header->magic, expected.magic, 4) != 0 ||
+        header->version != expected.version ||
+        header->byteOrder != expected.byteOrder ||
+        header->optimizationLevel != expected.optimizationLevel ||
+        header->sourceLength != expected.sourceLength ||
+        header->sourceHash != expected.sourceHash ||
+        header->fileSize != size ||
+        header->payloadHash != hashBytes(base + sizeof(CacheHeader), size - sizeof(CacheHeader)) ||
+        header->linesOffset % _Alignof(LineRecord) != 0 ||
+        header->linesOffset < sizeof(CacheHeader) + (size_t)header->codeCount ||
+        header->constantsOffset < header->linesOffset + (size_t)header->lineCount * sizeof(LineRecord) ||
+        header->constantsOffset > size ||
+        header->codeCount > INT32_MAX || header->lineCount > INT32_MAX)
+    {
+        munmap(mapping, size);
+        return false;
+    }
+
+    Chunk* chunk = &cached->chunk;
+    initChunk(chunk);
+
+    // code and lines are used straight from the mapping, no copy is made
+    chunk->count = chunk->capacity = (int)header->codeCount;
+    chunk->code = (uint8_t*)(base + sizeof(CacheHeader));
+    chunk->lineRecordList.count = chunk->lineRecordList.capacity = (int)header->lineCount;
+    chunk->lineRecordList.lineRecords = (LineRecord*)(base + header->linesOffset);
+
+    // this is the chunk about to run, its constants are roots from now on
+    // as the strings they hold are made
+    vm->chunk = chunk;
+
+    const uint8_t* cursor = base + header->constantsOffset;
+    const uint8_t* end = base + size;
+    for (uint32_t i = 0; i < header->constantCount; i++)
+    {
+        Value value;
+        if (!readConstant(vm, &cursor, end, &value))
+        {
+            vm->chunk = NULL;
+            freeValueArray(vm, &chunk->constants);
+            munmap(mapping, size);
+            return false;
+        }
+
+        // not in the pool yet while the pool grows
+        push(vm, value);
+        writeValueArray(vm, &chunk->constants, value);
+        pop(vm);
+    }
+
+    if (!validateChunk(chunk))
+    {
+        vm->chunk = NULL;
+        freeValueArray(vm, &chunk->constants);
+        munmap(mapping, size);
+        return false;
+    }
+
+    cached->mapping = mapping;
+    cached->mappingSize = size;
+    return true;
+}
+
+void freeCachedChunk(VM* vm, CachedChunk* cached)
+{
+    // only the constants were allocated, the rest belongs to the mapping
+    if (vm->chunk == &cached->chunk) vm->chunk = NULL;
+    freeValueArray(vm, &cached->chunk.constants);
+    munmap(cached->mapping, cached->mappingSize);
+    initChunk(&cached->chunk);
+    cached->mapping = NULL;
+    cached->mappingSize = 0;
+}
+
+static void writeConstantEntry(FILE* file, Value value)
+{
+    uint8_t tag;
+    if (IS_NIL(value))
+    {
+        tag = CONSTANT_NIL;
+        fwrite(&tag, 1, 1, file);
+    }
+    else if (IS_BOOL(value))
+    {
+        tag = AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE;
+        fwrite(&tag, 1, 1, file);
+    }
+    else if (IS_NUMBER(value))
+    {
+        double number = AS_NUMBER(value);
+        tag = CONSTANT_NUMBER;
+        fwrite(&tag, 1, 1, file);
+        fwrite(&number, sizeof(double), 1, file);
+    }
+    else
+    {
+        ObjString* string = AS_STRING(value);
+        uint32_t length = (uint32_t)string->length;
+        tag = CONSTANT_STRING;
+        fwrite(&tag, 1, 1, file);
+        fwrite(&length, sizeof(uint32_t), 1, file);
+        fwrite(string->chars, 1, length, file);
+    }
+}
+
+// hashes the payload back from the file, which saves building it in memory
+static bool hashPayload(VM* vm, FILE* file, long fileSize, uint64_t* hash)
+{
+    size_t length = (size_t)fileSize - sizeof(CacheHeader);
+    uint8_t* payload = ALLOCATE(vm, uint8_t, length, MEM_OTHER);
+
+    bool succeeded = fseek(file, (long)sizeof(CacheHeader), SEEK_SET) == 0 &&
+                     fread(payload, 1, length, file) == length;
+    if (succeeded) *hash = hashBytes(payload, length);
+
+    FREE_ARRAY(vm, uint8_t, payload, length, MEM_OTHER);
+    return succeeded;
+}
+
+bool writeCache(VM* vm, const char* cachePath, const char* source, size_t length, Chunk* chunk)
+{
+    CacheHeader header;
+    initHeader(vm, &header, source, length);
+
+    size_t linesOffset = alignUp(sizeof(CacheHeader) + chunk->count, _Alignof(LineRecord));
+    size_t constantsOffset = linesOffset + chunk->lineRecordList.count * sizeof(LineRecord);
+
+    header.codeCount = chunk->count;
+    header.lineCount = chunk->lineRecordList.count;
+    header.constantCount = chunk->constants.count;
+    header.linesOffset = (uint32_t)linesOffset;
+    header.constantsOffset = (uint32_t)constantsOffset;
+
+    // Write next to the cache and rename over it, so that a crash or a
+    // second interpreter running the same script never sees half a file.
+    // The name is unique to this process and this write, two writers of
+    // the same cache (two batch workers given the same path) each get
+    // their own file and the last rename wins.
+    static atomic_uint writeCount = 0;
+    size_t tempSize = strlen(cachePath) + 32;
+    char* tempPath = ALLOCATE(vm, char, tempSize, MEM_OTHER);
+    snprintf(tempPath, tempSize, "%s.%ld.%u.tmp", cachePath, (long)getpid(),
+        atomic_fetch_add(&writeCount, 1));
+
+    int fd = open(tempPath, O_RDWR | O_CREAT | O_EXCL, 0666);
+    FILE* file = fd < 0 ? NULL : fdopen(fd, "w+b");
+    if (file == NULL)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            remove(tempPath);
+        }
+        FREE_ARRAY(vm, char, tempPath, tempSize, MEM_OTHER);
+        return false;
+    }
+
+    // the real header goes in last, once the size is known
+    fwrite(&header, sizeof(CacheHeader), 1, file);
+    fwrite(chunk->code, 1, chunk->count, file);
+
+    static const uint8_t padding[_Alignof(LineRecord)] = { 0 };
+    fwrite(padding, 1, linesOffset - sizeof(CacheHeader) - chunk->count, file);
+    fwrite(chunk->lineRecordList.lineRecords, sizeof(LineRecord), chunk->lineRecordList.count, file);
+
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        writeConstantEntry(file, chunk->constants.values[i]);
+    }
+
+    long fileSize = ftell(file);
+    bool succeeded = fileSize > 0 && fileSize <= UINT32_MAX;
+    if (succeeded)
+    {
+        header.fileSize = (uint32_t)fileSize;
+        succeeded = fflush(file) == 0 && hashPayload(vm, file, fileSize, &header.payloadHash) &&
+                    fseek(file, 0L, SEEK_SET) == 0 &&
+                    fwrite(&header, sizeof(CacheHeader), 1, file) == 1;
+    }
+
+    // fclose() flushes, so it is the one reporting a full disk
+    succeeded = fclose(file) == 0 && succeeded;
+    succeeded = succeeded && rename(tempPath, cachePath) == 0;
+    if (!succeeded) remove(tempPath);
+
+    FREE_ARRAY(vm, char, tempPath, tempSize, MEM_OTHER);
+    return succeeded;
+}
+
+InterpretResult interpretCached(VM* vm, const char* path, const char* source, size_t length, CacheMode mode)
+{
+    // "script.lox" is cached in "script.loxc"
+    size_t pathLength = strlen(path);
+    char* cachePath = (char*)malloc(pathLength + 2);
+    if (cachePath == NULL)
+    {
+        fprintf(vm->err, "Not enough memory to cache \"%s\". \n", path);
+        return INTERPRET_IO_ERROR;
+    }
+    memcpy(cachePath, path, pathLength);
+    memcpy(cachePath + pathLength, "c", 2);
+
+    if (mode == CACHE_READ || mode == CACHE_AUTO)
+    {
+        CachedChunk cached;
+        if (loadCache(vm, cachePath, source, length, &cached))
+        {
+            free(cachePath);
+            InterpretResult result = interpretChunk(vm, &cached.chunk);
+            freeCachedChunk(vm, &cached);
+            return result;
+        }
+    }
+
+    Chunk chunk;
+    initChunk(&chunk);
+
+    if (!compile(vm, source, length, &chunk))
+    {
+        free(cachePath);
+        freeChunk(vm, &chunk);
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    // writing the cache allocates, keep the constants alive through it
+    vm->chunk = &chunk;
+
+    // a cache we cannot write, e.g. in a read-only directory, only costs
+    // the next run a compile, unless writing it was the whole point
+    if (mode != CACHE_READ && !writeCache(vm, cachePath, source, length, &chunk) &&
+        mode == CACHE_EMIT)
+    {
+        fprintf(vm->err, "Could not write cache \"%s\". \n", cachePath);
+        free(cachePath);
+        freeChunk(vm, &chunk);
+        return INTERPRET_IO_ERROR;
+    }
+    free(cachePath);
+
+    InterpretResult result = INTERPRET_OK;
+    if (mode != CACHE_EMIT) result = interpretChunk(vm, &chunk);
+
+    freeChunk(vm, &chunk);
+    return result;
+}
@@ -1,6 +1,7 @@
 #include "chunk.h"
 #include "memory.h"
 #include "value.h"
+#include "vm.h"
 
 #include <stdio.h>
 
@@ -16,88 +17,257 @@ void initChunk(Chunk* chunk)
     // initialize the constants in a chunk, this will point the constants
     // to a null pointer.
     initValueArray(&(chunk->constants));
+
+    chunk->constantIndexCount = 0;
+    chunk->constantIndexCapacity = 0;
+    chunk->constantIndex = NULL;
+
+    chunk->maxStack = 0;
 }
 
-void freeChunk(Chunk* chunk)
+void freeChunk(VM* vm, Chunk* chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(LineRecord, chunk->lineRecordList.lineRecords, chunk->lineRecordList.capacity);
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity, MEM_CODE);
+    FREE_ARRAY(vm, LineRecord, chunk->lineRecordList.lineRecords, chunk->lineRecordList.capacity, MEM_LINES);
 
-    freeValueArray(&(chunk->constants));
+    freeValueArray(vm, &(chunk->constants));
+    FREE_ARRAY(vm, int, chunk->constantIndex, chunk->constantIndexCapacity, MEM_CONSTANTS);
+    // its constants are no GC roots any more
+    if (vm->chunk == chunk) vm->chunk = NULL;
     // we need to do it last
     initChunk(chunk);
 }
 
-void writeChunk(Chunk* chunk, uint8_t byte, int line)
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line)
 {
     if(chunk->capacity < chunk->count + 1)
     {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(chunk->code, uint8_t, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, chunk->code, uint8_t, oldCapacity, chunk->capacity, MEM_CODE);
     }
 
-    if(chunk->lineRecordList.capacity < chunk->lineRecordList.count + 1)
+    // using RLE (run-length encoding)
+    // a byte on the same line as the previous one just extends the last
+    // run, which needs no record at all. Only a new line starts a new run,
+    // so the list grows with the number of runs, not with the code.
+    LineRecordList* list = &chunk->lineRecordList;
+    if(list->count == 0 || list->lineRecords[list->count - 1].lineNumber != line)
     {
-        int oldCapacity = chunk->lineRecordList.capacity;
-        chunk->lineRecordList.capacity = GROW_CAPACITY(oldCapacity);
-        chunk->lineRecordList.lineRecords = GROW_ARRAY(chunk->lineRecordList.lineRecords, LineRecord, oldCapacity, chunk->lineRecordList.capacity);
+        if(list->capacity < list->count + 1)
+        {
+            int oldCapacity = list->capacity;
+            list->capacity = GROW_CAPACITY(oldCapacity);
+            list->lineRecords = GROW_ARRAY(vm, list->lineRecords, LineRecord, oldCapacity, list->capacity, MEM_LINES);
+        }
+
+        list->lineRecords[list->count].lineNumber = line;
+        list->lineRecords[list->count].startOffset = chunk->count;
+        list->count++;
     }
 
     chunk->code[chunk->count] = byte;
     chunk->count++;
-    
-    // using RLE (run-length encoding)
-    // if record list is empty, put a new element in it
-    // if it's not empty, compare the incoming 'line' with the last element
-    // -> if they're the same, increase the count
-    // -> else, put a new element in it
+}
+
+void truncateChunk(Chunk* chunk, int count)
+{
+    chunk->count = count;
 
-    if(chunk->lineRecordList.count == 0)
+    // drop the runs starting in the removed bytes, the one before them
+    // simply ends earlier now
+    LineRecordList* list = &chunk->lineRecordList;
+    while (list->count > 0 && list->lineRecords[list->count - 1].startOffset >= count)
     {
-        chunk->lineRecordList.lineRecords[0].lineNumber = line;
-        chunk->lineRecordList.lineRecords[0].offsetPerLine = 0;
-        chunk->lineRecordList.count++;
+        list->count--;
     }
-    
-    if(line == chunk->lineRecordList.lineRecords[chunk->lineRecordList.count - 1].lineNumber)
+}
+
+// use parenthesis to group the constant value, just to avoid any shenanigans
+#define CONSTANT_INDEX_MAX_LOAD (0.5)
+
+// returns the slot holding 'value', or the empty slot where it belongs
+static int* findConstantSlot(Chunk* chunk, int* slots, int capacity, Value value)
+{
+    // capacity is a power of two
+    uint32_t index = hashValue(value) & (capacity - 1);
+
+    for (;;)
     {
-        chunk->lineRecordList.lineRecords[chunk->lineRecordList.count - 1].offsetPerLine++;
+        int* slot = &slots[index];
+        if (*slot == -1) return slot;
+
+        // stale slots point past the end of the pool, or at a slot that
+        // was given back and reused for another value
+        if (*slot < chunk->constants.count &&
+            valuesIdentical(chunk->constants.values[*slot], value))
+        {
+            return slot;
+        }
+
+        index = (index + 1) & (capacity - 1);
     }
-    else
+}
+
+static void growConstantIndex(VM* vm, Chunk* chunk)
+{
+    int capacity = chunk->constantIndexCapacity < 16 ? 16 : chunk->constantIndexCapacity * 2;
+    int* slots = ALLOCATE(vm, int, capacity, MEM_CONSTANTS);
+    for (int i = 0; i < capacity; i++) slots[i] = -1;
+
+    // rebuilding from the pool itself also drops the stale slots
+    chunk->constantIndexCount = 0;
+    for (int i = 0; i < chunk->constants.count; i++)
     {
-        int index = chunk->lineRecordList.count;
-        chunk->lineRecordList.lineRecords[index].lineNumber = line;
-        chunk->lineRecordList.lineRecords[index].offsetPerLine = 1;
-        chunk->lineRecordList.count++;
+        *findConstantSlot(chunk, slots, capacity, chunk->constants.values[i]) = i;
+        chunk->constantIndexCount++;
     }
+
+    FREE_ARRAY(vm, int, chunk->constantIndex, chunk->constantIndexCapacity, MEM_CONSTANTS);
+    chunk->constantIndex = slots;
+    chunk->constantIndexCapacity = capacity;
 }
 
 /**
- * return the index where it was appended
+ * return the index of the value in the constant pool
  */
-int addConstant(Chunk* chunk, Value value)
+int addConstant(VM* vm, Chunk* chunk, Value value)
 {
-    writeValueArray(&(chunk->constants), value);
+    // 'value' may be a string nothing references yet, and both the index
+    // and the pool can grow here, which may run the collector
+    push(vm, value);
+
+    if (chunk->constantIndexCount + 1 > chunk->constantIndexCapacity * CONSTANT_INDEX_MAX_LOAD)
+    {
+        growConstantIndex(vm, chunk);
+    }
+
+    // Numbers are keyed on their bits and strings on their address, which
+    // is enough since strings are interned. The same literal showing up
+    // ten thousand times takes one slot.
+    int* slot = findConstantSlot(chunk, chunk->constantIndex, chunk->constantIndexCapacity, value);
+    if (*slot != -1)
+    {
+        pop(vm);
+        return *slot;
+    }
+
+    writeValueArray(vm, &(chunk->constants), value);
     // returns the index where it was appended,
     // so that we can locate that same constant later
+    *slot = chunk->constants.count - 1;
+    chunk->constantIndexCount++;
+    pop(vm);
     return chunk->constants.count - 1;
 }
 
-void writeConstant(Chunk* chunk, Value value, int line)
+void removeLastConstant(Chunk* chunk)
+{
+    // its index slot goes stale, see findConstantSlot()
+    chunk->constants.count--;
+}
+
+void writeConstant(VM* vm, Chunk* chunk, Value value, int line)
 {
-    int index = addConstant(chunk, value);
+    int index = addConstant(vm, chunk, value);
     
     if(index < 256)
     {
-        writeChunk(chunk, OP_CONSTANT, line);
-        writeChunk(chunk, index, line);
+        writeChunk(vm, chunk, OP_CONSTANT, line);
+        writeChunk(vm, chunk, index, line);
     }
     else
     {
-        writeChunk(chunk, OP_CONSTANT_LONG, line);
-        writeChunk(chunk, index & 0xff, line);
-        writeChunk(chunk, (index >>  8) & 0xff, line);
-        writeChunk(chunk, (index >> 16) & 0xff, line);
+        writeChunk(vm, chunk, OP_CONSTANT_LONG, line);
+        writeChunk(vm, chunk, index & 0xff, line);
+        writeChunk(vm, chunk, (index >>  8) & 0xff, line);
+        writeChunk(vm, chunk, (index >> 16) & 0xff, line);
+    }
+}
+
+int instructionLength(uint8_t instruction)
+{
+    switch (instruction)
+    {
+        case OP_CONSTANT:
+        case OP_GET_TEMP:
+        case OP_SET_TEMP:
+        case OP_ADD_CONST:
+        case OP_SUBTRACT_CONST:
+        case OP_MULTIPLY_CONST:
+        case OP_DIVIDE_CONST:
+            return 2;
+        case OP_CONSTANT_LONG:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+int stackDepth(Chunk* chunk)
+{
+    int depth = 0;
+    int maxDepth = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset]))
+    {
+        // what the instruction pops, and then pushes
+        int pops = 0;
+        int pushes = 0;
+        switch (chunk->code[offset])
+        {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                pushes = 1;
+                break;
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_NOT_EQUAL:
+            case OP_GREATER_EQUAL:
+            case OP_LESS_EQUAL:
+                pops = 2;
+                pushes = 1;
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_ADD_CONST:
+            case OP_SUBTRACT_CONST:
+            case OP_MULTIPLY_CONST:
+            case OP_DIVIDE_CONST:
+                pops = 1;
+                pushes = 1;
+                break;
+            case OP_RETURN:
+                pops = 1;
+                break;
+            case OP_DUP:
+                pops = 1;
+                pushes = 2;
+                break;
+            case OP_GET_TEMP:
+                // the slot has to be one of the values already there
+                if (offset + 1 >= chunk->count || chunk->code[offset + 1] >= depth) return -1;
+                pushes = 1;
+                break;
+            case OP_SET_TEMP:
+                if (offset + 1 >= chunk->count || chunk->code[offset + 1] >= depth) return -1;
+                pops = 1;
+                pushes = 1;
+                break;
+            default:
+                break;
+        }
+
+        if (pops > depth) return -1;
+        depth += pushes - pops;
+        if (depth > maxDepth) maxDepth = depth;
     }
+    return maxDepth;
 }
\ No newline at end of file
@@ -1,8 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "ir.h"
+#include "lexer.h"
+#include "memory.h"
+#include "peephole.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -13,6 +18,9 @@ typedef struct
 {
     Token current;
     Token previous;
+    // the interned string of a TOKEN_STRING, NULL for any other token
+    ObjString* currentString;
+    ObjString* previousString;
 
     bool hadError;
     bool isInPanicMode;
@@ -36,7 +44,7 @@ typedef enum
 } Precedence;
 
 // typedef a ParseFn as function type
-typedef void (*ParseFn)();
+typedef void (*ParseFn)(Compiler* compiler);
 
 typedef struct
 {
@@ -45,26 +53,89 @@ typedef struct
     Precedence precedence;
 } ParseRule;
 
-Parser parser;
+// Constant folding state.
+//
+// Every expression that isn't a single literal ends with the instruction
+// of its outermost operator. So if the last instruction emitted is a
+// constant load, the operand we just finished compiling *is* that constant,
+// and an operator applied to it can be evaluated right here instead of on
+// every run.
+typedef struct
+{
+    bool isConstant;
+    Value value;
+    // offset of the constant load, truncating the chunk back to it
+    // removes the operand
+    int start;
+    // the constant pool slot the load added, -1 for nil, true, false and
+    // literals sharing the slot of an earlier one
+    int poolIndex;
+} LastConstant;
+
+// The parser does not take tokens from the scanner one at a time, but from
+// a batch scanned ahead. The string literals of a batch are interned all at
+// once with copyStrings(), which hides the cache misses of the lookups
+// behind each other.
+#define TOKEN_BATCH_SIZE (256)
 
-Chunk* compilingChunk;
+typedef struct
+{
+    Token tokens[TOKEN_BATCH_SIZE];
+    // the interned string of each TOKEN_STRING, NULL for the others
+    ObjString* strings[TOKEN_BATCH_SIZE];
+    int count;
+    // the token advance() takes next
+    int next;
+
+    // the same strings in the order of the literals, see markCompilerRoots()
+    ObjString* literals[TOKEN_BATCH_SIZE];
+    int literalCount;
+} TokenBatch;
+
+// Everything one compile() works with. It lives on the stack of compile(),
+// every function below is handed it, and VM.compiler points at it for as
+// long as it runs, see markCompilerRoots().
+struct sCompiler
+{
+    VM* vm;
+    Parser parser;
+    // the chunk being written
+    Chunk* chunk;
+    TokenBatch batch;
+    LastConstant lastConstant;
+    // read from the VM once, when compile() starts
+    int optimizationLevel;
+
+    // With VM.lexThreads at 0, the parser pulls the tokens from the
+    // scanner as it goes. Otherwise the whole source is scanned up front,
+    // and the batches are filled from 'lexed'.
+    Scanner scanner;
+    TokenArray lexed;
+    int lexedNext;
+
+    // At -O2 the expression is built as IR instead of being emitted right
+    // away. lastNode is the node of the expression compiled last, it plays
+    // the part the end of the chunk plays for bytecode.
+    IrGraph ir;
+    IrRef lastNode;
+};
 
-static Chunk* currentChunk()
+static Chunk* currentChunk(Compiler* compiler)
 {
-    return compilingChunk;
+    return compiler->chunk;
 }
 
-static void errorAt(Token* token, const char* message)
+static void errorAt(Compiler* compiler, Token* token, const char* message)
 {
     // suppress other errors while in panic mode
-    if(parser.isInPanicMode) return;
-    parser.isInPanicMode = true;
+    if(compiler->parser.isInPanicMode) return;
+    compiler->parser.isInPanicMode = true;
 
-    fprintf(stderr, "[line %d] Error", token->line);
+    fprintf(compiler->vm->err, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF)
     {
-        fprintf(stderr, " at end");
+        fprintf(compiler->vm->err, " at end");
     }
     else if (token->type == TOKEN_ERROR)
     {
@@ -72,133 +143,434 @@ static void errorAt(Token* token, const char* message)
     }
     else
     {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(compiler->vm->err, " at '%.*s'", token->length, token->start);
     }
 
-    fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    fprintf(compiler->vm->err, ": %s\n", message);
+    compiler->parser.hadError = true;
 }
 
-static void error(const char* message)
+static void error(Compiler* compiler, const char* message)
 {
-    errorAt(&parser.previous, message);
+    errorAt(compiler, &compiler->parser.previous, message);
 }
 
-static void errorAtCurrent(const char* message)
+static void errorAtCurrent(Compiler* compiler, const char* message)
 {
-    errorAt(&parser.current, message);
+    errorAt(compiler, &compiler->parser.current, message);
+}
+
+static Token nextToken(Compiler* compiler)
+{
+    if (compiler->lexed.tokens == NULL) return scanToken(&compiler->scanner);
+
+    // past the end it is TOKEN_EOF again, as with scanToken()
+    Token token = compiler->lexed.tokens[compiler->lexedNext];
+    if (compiler->lexedNext + 1 < compiler->lexed.count) compiler->lexedNext++;
+    return token;
 }
 
-static void advance()
+static void fillBatch(Compiler* compiler)
 {
-    parser.previous = parser.current;
+    StringRef literals[TOKEN_BATCH_SIZE];
+    int slots[TOKEN_BATCH_SIZE];
+    int literalCount = 0;
+
+    // none of them are made yet, the collector may run from here on
+    compiler->batch.literalCount = 0;
+
+    compiler->batch.count = 0;
+    compiler->batch.next = 0;
+    while (compiler->batch.count < TOKEN_BATCH_SIZE)
+    {
+        Token token = nextToken(compiler);
+        compiler->batch.strings[compiler->batch.count] = NULL;
+        compiler->batch.tokens[compiler->batch.count++] = token;
+
+        if (token.type == TOKEN_STRING)
+        {
+            // The + 1 and - 2 parts trim the leading and trailing quotation
+            // marks.
+            //
+            // "Hello, world!"
+            // ^             ^
+            // start + 0     start + (length - 1)
+            literals[literalCount].chars = token.start + 1;
+            literals[literalCount].length = token.length - 2;
+            slots[literalCount++] = compiler->batch.count - 1;
+        }
+        if (token.type == TOKEN_EOF) break;
+    }
+
+    // NULL until made, markCompilerRoots() marks them as they come in
+    memset(compiler->batch.literals, 0, sizeof(ObjString*) * literalCount);
+    compiler->batch.literalCount = literalCount;
+    copyStrings(compiler->vm, literals, literalCount, compiler->batch.literals);
+
+    for (int i = 0; i < literalCount; i++)
+    {
+        compiler->batch.strings[slots[i]] = compiler->batch.literals[i];
+    }
+}
+
+static void advance(Compiler* compiler)
+{
+    compiler->parser.previous = compiler->parser.current;
+    compiler->parser.previousString = compiler->parser.currentString;
 
     for(;;)
     {
-        parser.current = scanToken();
-        if(parser.current.type != TOKEN_ERROR) break;
+        if (compiler->batch.next == compiler->batch.count) fillBatch(compiler);
+        compiler->parser.currentString = compiler->batch.strings[compiler->batch.next];
+        compiler->parser.current = compiler->batch.tokens[compiler->batch.next++];
+        if(compiler->parser.current.type != TOKEN_ERROR) break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(compiler, compiler->parser.current.start);
     }
 }
 
-static void consume(TokenType type, const char* message)
+static void consume(Compiler* compiler, TokenType type, const char* message)
 {
-    if (parser.current.type == type)
+    if (compiler->parser.current.type == type)
     {
-        advance();
+        advance(compiler);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(compiler, message);
 }
 
-static void emitByte(uint8_t byte)
+static void emitByte(Compiler* compiler, uint8_t byte)
 {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    writeChunk(compiler->vm, currentChunk(compiler), byte, compiler->parser.previous.line);
+    // whatever was emitted, the chunk no longer ends in a constant load,
+    // emitConstant() sets it back right after
+    compiler->lastConstant.isConstant = false;
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2)
+static void emitBytes(Compiler* compiler, uint8_t byte1, uint8_t byte2)
 {
-    emitByte(byte1);
-    emitByte(byte2);
+    emitByte(compiler, byte1);
+    emitByte(compiler, byte2);
 }
 
-static void emitReturn()
+static void emitReturn(Compiler* compiler)
 {
-    emitByte(OP_RETURN);
+    emitByte(compiler, OP_RETURN);
 }
 
-// TODO : following functions should be supporting OP_CONSTANT_LONG
+// OP_CONSTANT_LONG has a 24 bits operand
+#define MAX_CONSTANTS (1 << 24)
 
-static uint8_t makeConstant(Value value)
+static int makeConstant(Compiler* compiler, Value value)
 {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX)
+    int constant = addConstant(compiler->vm, currentChunk(compiler), value);
+    if (constant >= MAX_CONSTANTS)
     {
-        error("Too many constants in one chunk.");
+        error(compiler, "Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
 }
 
-static void emitConstant(Value value)
+static void emitConstant(Compiler* compiler, Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    if (compiler->optimizationLevel >= 2)
+    {
+        compiler->lastNode = irConstant(compiler->vm, &compiler->ir, value, compiler->parser.previous.line);
+        return;
+    }
+
+    int start = currentChunk(compiler)->count;
+    int poolIndex = -1;
+
+    // nil, true and false have their own instructions
+    if (IS_NIL(value))
+    {
+        emitByte(compiler, OP_NIL);
+    }
+    else if (IS_BOOL(value))
+    {
+        emitByte(compiler, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    }
+    else
+    {
+        int poolCount = currentChunk(compiler)->constants.count;
+        int constant = makeConstant(compiler, value);
+
+        if (constant <= UINT8_MAX)
+        {
+            emitBytes(compiler, OP_CONSTANT, (uint8_t)constant);
+        }
+        else
+        {
+            emitByte(compiler, OP_CONSTANT_LONG);
+            emitBytes(compiler, constant & 0xff, (constant >> 8) & 0xff);
+            emitByte(compiler, (constant >> 16) & 0xff);
+        }
+
+        // a literal seen before reuses its slot, which is not ours to give back
+        if (currentChunk(compiler)->constants.count > poolCount) poolIndex = constant;
+    }
+
+    compiler->lastConstant.isConstant = true;
+    compiler->lastConstant.value = value;
+    compiler->lastConstant.start = start;
+    compiler->lastConstant.poolIndex = poolIndex;
 }
 
-static void endCompiler()
+// A folded operand is gone from the code, give its constant pool slot back
+// too when nothing was added after it. Otherwise every intermediate result
+// would take a slot of its own.
+//
+// Only slots the load itself added are given back : any other load of that
+// slot comes after it in the code, so it is part of the operands being
+// folded away too.
+static void dropConstant(Compiler* compiler, LastConstant* constant)
 {
-    emitReturn();
+    Chunk* chunk = currentChunk(compiler);
+    if (constant->poolIndex != -1 && constant->poolIndex == chunk->constants.count - 1)
+    {
+        removeLastConstant(chunk);
+    }
+}
+
+static bool isFalsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Evaluate "a operator b" at compile time. Returns false when the operation
+// would fail at runtime, those are left to the VM so the error is reported
+// the usual way, at the line of the operator.
+static bool foldBinary(Compiler* compiler, TokenType operatorType, Value a, Value b, Value* result)
+{
+    switch (operatorType)
+    {
+        case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(valuesEqual(a, b)); return true;
+        case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+        default:
+            break;
+    }
+
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+
+        switch (operatorType)
+        {
+            // >= and <= have to match the !(x < y) and !(x > y) the VM
+            // computes, they differ from x >= y when a NaN is involved
+            case TOKEN_GREATER:       *result = BOOL_VAL(x > y); return true;
+            case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+            case TOKEN_LESS:          *result = BOOL_VAL(x < y); return true;
+            case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y)); return true;
+
+            case TOKEN_PLUS:          *result = NUMBER_VAL(x + y); return true;
+            case TOKEN_MINUS:         *result = NUMBER_VAL(x - y); return true;
+            case TOKEN_STAR:          *result = NUMBER_VAL(x * y); return true;
+            case TOKEN_SLASH:         *result = NUMBER_VAL(x / y); return true;
+            default:
+                return false;
+        }
+    }
+
+    if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b))
+    {
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+
+        // Folding "a" + "b" + "c" + ... copies the whole prefix once per
+        // operand. Past the point where the VM would make a rope of it,
+        // leave the rest to the VM, which does it in linear time.
+        int length = left->length + right->length;
+        if (length >= ROPE_MIN_LENGTH) return false;
+
+        ObjString* string = reserveString(compiler->vm, length);
+        memcpy(string->chars, left->chars, left->length);
+        memcpy(string->chars + left->length, right->chars, right->length);
+
+        // interned like any other string, so equality stays a pointer check
+        *result = OBJ_VAL(finishString(compiler->vm, string));
+        return true;
+    }
+
+    return false;
+}
+
+static bool foldUnary(TokenType operatorType, Value operand, Value* result)
+{
+    switch (operatorType)
+    {
+        case TOKEN_BANG:
+            *result = BOOL_VAL(isFalsey(operand));
+            return true;
+        case TOKEN_MINUS:
+            // -"str" is a runtime error, leave it to the VM
+            if (!IS_NUMBER(operand)) return false;
+            *result = NUMBER_VAL(-AS_NUMBER(operand));
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void endCompiler(Compiler* compiler)
+{
+    emitReturn(compiler);
+
+    if (!compiler->parser.hadError && compiler->optimizationLevel >= 1)
+    {
+        peepholeOptimize(compiler->vm, currentChunk(compiler));
+    }
+    // on the final code, what interpretChunk() reserves
+    currentChunk(compiler)->maxStack = stackDepth(currentChunk(compiler));
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError)
+    if (!compiler->parser.hadError)
     {
-        disassembleChunk(currentChunk(), "code");
+        disassembleChunk(compiler->vm->out, currentChunk(compiler), "code");
     }
 #endif
 }
 
-static void expression();
+static void expression(Compiler* compiler);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Compiler* compiler, Precedence precedence);
+
+// -O2 counterpart of the end of binary(), builds the node instead of
+// emitting the operator
+static void binaryNode(Compiler* compiler, TokenType operatorType, IrRef left, IrRef right)
+{
+    // an operand is missing after a syntax error
+    if (left == IR_NONE || right == IR_NONE)
+    {
+        compiler->lastNode = IR_NONE;
+        return;
+    }
+
+    int line = compiler->parser.previous.line;
+
+    Value folded;
+    if (irIsConstant(&compiler->ir, left) && irIsConstant(&compiler->ir, right) &&
+        foldBinary(compiler, operatorType, compiler->ir.nodes[left].value, compiler->ir.nodes[right].value, &folded))
+    {
+        compiler->lastNode = irConstant(compiler->vm, &compiler->ir, folded, line);
+        return;
+    }
+
+    // the same shapes binary() emits, != is !(a == b) and so on
+    switch(operatorType)
+    {
+        case TOKEN_BANG_EQUAL:
+            compiler->lastNode = irUnary(compiler->vm, &compiler->ir, OP_NOT, irBinary(compiler->vm, &compiler->ir, OP_EQUAL, left, right, line), line);
+            break;
+        case TOKEN_EQUAL_EQUAL:   compiler->lastNode = irBinary(compiler->vm, &compiler->ir, OP_EQUAL, left, right, line); break;
+        case TOKEN_GREATER:       compiler->lastNode = irBinary(compiler->vm, &compiler->ir, OP_GREATER, left, right, line); break;
+        case TOKEN_GREATER_EQUAL:
+            compiler->lastNode = irUnary(compiler->vm, &compiler->ir, OP_NOT, irBinary(compiler->vm, &compiler->ir, OP_LESS, left, right, line), line);
+            break;
+        case TOKEN_LESS:          compiler->lastNode = irBinary(compiler->vm, &compiler->ir, OP_LESS, left, right, line); break;
+        case TOKEN_LESS_EQUAL:
+            compiler->lastNode = irUnary(compiler->vm, &compiler->ir, OP_NOT, irBinary(compiler->vm, &compiler->ir, OP_GREATER, left, right, line), line);
+            break;
+
+        case TOKEN_PLUS:          compiler->lastNode = irBinary(compiler->vm, &compiler->ir, OP_ADD, left, right, line); break;
+        case TOKEN_MINUS:         compiler->lastNode = irBinary(compiler->vm, &compiler->ir, OP_SUBTRACT, left, right, line); break;
+        case TOKEN_STAR:          compiler->lastNode = irBinary(compiler->vm, &compiler->ir, OP_MULTIPLY, left, right, line); break;
+        case TOKEN_SLASH:         compiler->lastNode = irBinary(compiler->vm, &compiler->ir, OP_DIVIDE, left, right, line); break;
+        default:
+            return; // unreachable
+    }
+}
 
-static void binary()
+// -O2 counterpart of the end of unary()
+static void unaryNode(Compiler* compiler, TokenType operatorType, IrRef operand)
 {
-    TokenType operatorType = parser.previous.type;
+    if (operand == IR_NONE) return;
+
+    int line = compiler->parser.previous.line;
+
+    Value folded;
+    if (irIsConstant(&compiler->ir, operand) &&
+        foldUnary(operatorType, compiler->ir.nodes[operand].value, &folded))
+    {
+        compiler->lastNode = irConstant(compiler->vm, &compiler->ir, folded, line);
+        return;
+    }
+
+    switch (operatorType)
+    {
+        case TOKEN_BANG: compiler->lastNode = irUnary(compiler->vm, &compiler->ir, OP_NOT, operand, line); break;
+        case TOKEN_MINUS: compiler->lastNode = irUnary(compiler->vm, &compiler->ir, OP_NEGATE, operand, line); break;
+        default:
+            return; // should never reach here
+    }
+}
+
+static void binary(Compiler* compiler)
+{
+    TokenType operatorType = compiler->parser.previous.type;
+
+    // the left operand is already compiled, and it is a constant if the
+    // chunk ends with a constant load right now
+    LastConstant left = compiler->lastConstant;
+    IrRef leftNode = compiler->lastNode;
 
     // compile the right operand
     ParseRule* rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    parsePrecedence(compiler, (Precedence)(rule->precedence + 1));
+
+    if (compiler->optimizationLevel >= 2)
+    {
+        binaryNode(compiler, operatorType, leftNode, compiler->lastNode);
+        return;
+    }
+
+    Value folded;
+    if (compiler->optimizationLevel >= 1 && left.isConstant && compiler->lastConstant.isConstant &&
+        foldBinary(compiler, operatorType, left.value, compiler->lastConstant.value, &folded))
+    {
+        // both operands are loads sitting at the end of the chunk,
+        // replace them with the result
+        truncateChunk(currentChunk(compiler), left.start);
+        dropConstant(compiler, &compiler->lastConstant);
+        dropConstant(compiler, &left);
+        emitConstant(compiler, folded);
+        return;
+    }
 
     // Emit the operator instruction
     // : Transfer operator token to an OpCode
     switch(operatorType)
     {
-        case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:          emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-
-        case TOKEN_PLUS:          emitByte(OP_ADD); break;
-        case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
+        case TOKEN_BANG_EQUAL:    emitBytes(compiler, OP_EQUAL, OP_NOT); break;
+        case TOKEN_EQUAL_EQUAL:   emitByte(compiler, OP_EQUAL); break;
+        case TOKEN_GREATER:       emitByte(compiler, OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL: emitBytes(compiler, OP_LESS, OP_NOT); break;
+        case TOKEN_LESS:          emitByte(compiler, OP_LESS); break;
+        case TOKEN_LESS_EQUAL:    emitBytes(compiler, OP_GREATER, OP_NOT); break;
+
+        case TOKEN_PLUS:          emitByte(compiler, OP_ADD); break;
+        case TOKEN_MINUS:         emitByte(compiler, OP_SUBTRACT); break;
+        case TOKEN_STAR:          emitByte(compiler, OP_MULTIPLY); break;
+        case TOKEN_SLASH:         emitByte(compiler, OP_DIVIDE); break;
         default:
             return; // unreachable
     }
 }
 
-static void literal()
+static void literal(Compiler* compiler)
 {
-    switch(parser.previous.type)
+    // still emits OP_FALSE, OP_NIL and OP_TRUE, going through emitConstant()
+    // only makes them visible to constant folding
+    switch(compiler->parser.previous.type)
     {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
+        case TOKEN_FALSE: emitConstant(compiler, BOOL_VAL(false)); break;
+        case TOKEN_NIL: emitConstant(compiler, NIL_VAL); break;
+        case TOKEN_TRUE: emitConstant(compiler, BOOL_VAL(true)); break;
         default:
             return;
     }
@@ -212,33 +584,38 @@ static void literal()
  *  any bytecode. The inner call to expression() takes care of generating 
  *  bytecode for the expression inside the parentheses.
  */
-static void grouping()
+static void grouping(Compiler* compiler)
 {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    expression(compiler);
+    consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number()
+static void number(Compiler* compiler)
 {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    // The source is not '\0' terminated (see initScanner()), and strtod()
+    // would happily read past the end of it. The scanner already made sure
+    // the lexeme is a number, so it is enough to hand strtod() a copy.
+    char buffer[64];
+    int length = compiler->parser.previous.length;
+    char* lexeme = length < (int)sizeof(buffer) ? buffer : ALLOCATE(compiler->vm, char, length + 1, MEM_OTHER);
+    memcpy(lexeme, compiler->parser.previous.start, length);
+    lexeme[length] = '\0';
+
+    double value = strtod(lexeme, NULL);
+    if (lexeme != buffer) FREE_ARRAY(compiler->vm, char, lexeme, length + 1, MEM_OTHER);
+
+    emitConstant(compiler, NUMBER_VAL(value));
 }
 
-static void string()
+static void string(Compiler* compiler)
 {
-    // The + 1 and - 2 parts trim the leading and trailing quotation marks.
-    //
-    // "Hello, world!"
-    // ^             ^
-    // start + 0     start + (length - 1)
-    emitConstant(OBJ_VAL(copyString(
-        parser.previous.start + 1, 
-        parser.previous.length - 2)));
+    // interned along with the rest of its batch, see fillBatch()
+    emitConstant(compiler, OBJ_VAL(compiler->parser.previousString));
 }
 
-static void unary()
+static void unary(Compiler* compiler)
 {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = compiler->parser.previous.type;
 
     // compile the operand
     // by calling this instead of expression(), we disallow expressions
@@ -248,13 +625,29 @@ static void unary()
     // - 5 + 3 becomes - (5 + 3)
     // instead we take precedence into account, and obtain the expression "5"
     // at level PREC_PRIMARY.
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(compiler, PREC_UNARY);
+
+    if (compiler->optimizationLevel >= 2)
+    {
+        unaryNode(compiler, operatorType, compiler->lastNode);
+        return;
+    }
+
+    Value folded;
+    if (compiler->optimizationLevel >= 1 && compiler->lastConstant.isConstant &&
+        foldUnary(operatorType, compiler->lastConstant.value, &folded))
+    {
+        truncateChunk(currentChunk(compiler), compiler->lastConstant.start);
+        dropConstant(compiler, &compiler->lastConstant);
+        emitConstant(compiler, folded);
+        return;
+    }
 
     // Emit the operator instruction.
     switch (operatorType)
     {
-        case TOKEN_BANG: emitByte(OP_NOT); break;
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_BANG: emitByte(compiler, OP_NOT); break;
+        case TOKEN_MINUS: emitByte(compiler, OP_NEGATE); break;
     
         default:
             return; // should never reach here
@@ -317,25 +710,25 @@ ParseRule rules[] =
     { NULL,     NULL,    PREC_NONE },       // TOKEN_EOF
 };
 
-static void parsePrecedence(Precedence precedence)
+static void parsePrecedence(Compiler* compiler, Precedence precedence)
 {
     // ook up a prefix parser for the current token
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    advance(compiler);
+    ParseFn prefixRule = getRule(compiler->parser.previous.type)->prefix;
     if(prefixRule == NULL)
     {
-        printf("parser.previous.type = %d \n", parser.previous.type);
-        error("Expect expression");
+        error(compiler, "Expect expression");
+        compiler->lastNode = IR_NONE;
         return;
     }
-    prefixRule();
+    prefixRule(compiler);
 
     // infix expression
-    while(precedence <= getRule(parser.current.type)->precedence)
+    while(precedence <= getRule(compiler->parser.current.type)->precedence)
     {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule();
+        advance(compiler);
+        ParseFn infixRule = getRule(compiler->parser.previous.type)->infix;
+        infixRule(compiler);
     }
 }
 
@@ -344,30 +737,113 @@ static ParseRule* getRule(TokenType type)
     return &rules[type];
 }
 
-void expression()
+void expression(Compiler* compiler)
+{
+    parsePrecedence(compiler, PREC_ASSIGNMENT);
+}
+
+void setOptimizationLevel(VM* vm, int level)
+{
+    vm->optimizationLevel = level;
+}
+
+int getOptimizationLevel(VM* vm)
+{
+    return vm->optimizationLevel;
+}
+
+void setLexThreads(VM* vm, int threads)
 {
-    parsePrecedence(PREC_ASSIGNMENT);
+    vm->lexThreads = threads;
 }
 
 /**
  *  We pass in the chunk where the compiler will write the code, 
  *  and then compile() returns whether or not compilation succeeded.
  */
-bool compile(const char* source, Chunk* chunk)
+bool compile(VM* vm, const char* source, size_t length, Chunk* chunk)
 {
-    initScanner(source);
-    compilingChunk = chunk;
+    Compiler state;
+    Compiler* compiler = &state;
+    compiler->vm = vm;
+    compiler->optimizationLevel = vm->optimizationLevel;
+
+    compiler->lexed.tokens = NULL;
+    compiler->lexed.count = 0;
+    if (vm->lexThreads > 0)
+    {
+        scanTokens(&compiler->lexed, source, length, vm->lexThreads);
+        compiler->lexedNext = 0;
+    }
+    else
+    {
+        initScanner(&compiler->scanner, source, length);
+    }
+    compiler->chunk = chunk;
+    compiler->batch.count = 0;
+    compiler->batch.next = 0;
+    compiler->batch.literalCount = 0;
+    compiler->parser.currentString = NULL;
+    compiler->parser.previousString = NULL;
+
+    compiler->parser.hadError = false;
+    compiler->parser.isInPanicMode = false;
+
+    compiler->lastConstant.isConstant = false;
+    compiler->lastNode = IR_NONE;
+    // stays empty below -O2, markCompilerRoots() walks it all the same
+    initIr(&compiler->ir);
+
+    // its objects are roots from here on
+    vm->compiler = compiler;
+
+    advance(compiler);
+    expression(compiler);
+    consume(compiler, TOKEN_EOF, "Expect end of expression");
+
+    if (compiler->optimizationLevel >= 2)
+    {
+        if (!compiler->parser.hadError && compiler->lastNode != IR_NONE)
+        {
+            IrRef root = irOptimize(vm, &compiler->ir, compiler->lastNode);
+            irEmit(vm, &compiler->ir, root, currentChunk(compiler));
+        }
+        freeIr(vm, &compiler->ir);
+    }
+
+    endCompiler(compiler);
+    // from here on the caller owns the chunk, see markCompilerRoots()
+    vm->compiler = NULL;
+    if (compiler->lexed.tokens != NULL) freeTokenArray(&compiler->lexed);
 
-    parser.hadError = false;
-    parser.isInPanicMode = false;
+    return !compiler->parser.hadError;
+}
 
-    advance();
-    expression();
-    consume(TOKEN_EOF, "Expect end of expression");
+void markCompilerRoots(VM* vm)
+{
+    Compiler* compiler = vm->compiler;
+    if (compiler == NULL) return;
 
-    endCompiler();
+    // the chunk is not vm->chunk yet, nothing else marks its constants
+    for (int i = 0; i < compiler->chunk->constants.count; i++)
+    {
+        markValue(vm, compiler->chunk->constants.values[i]);
+    }
 
-    return !parser.hadError;
+    // literals scanned ahead, and the ones the parser is looking at, which
+    // may be left from the batch before
+    for (int i = 0; i < compiler->batch.literalCount; i++)
+    {
+        markObject(vm, (Obj*)compiler->batch.literals[i]);
+    }
+    markObject(vm, (Obj*)compiler->parser.currentString);
+    markObject(vm, (Obj*)compiler->parser.previousString);
+
+    // at -O2 constants sit in the IR until it is emitted
+    for (int i = 0; i < compiler->ir.count; i++)
+    {
+        if (compiler->ir.nodes[i].op == OP_CONSTANT) markValue(vm, compiler->ir.nodes[i].value);
+    }
 }
 
 
@@ -4,9 +4,9 @@
 #include "value.h"
 #include "vm.h"
 
-void disassembleChunk(Chunk* chunk, const char* name)
+void disassembleChunk(FILE* out, Chunk* chunk, const char* name)
 {
-    printf("== %s ==\n", name);
+    fprintf(out, "== %s ==\n", name);
     
     for(int offset = 0; offset < chunk->count;)
     {
@@ -14,16 +14,16 @@ void disassembleChunk(Chunk* chunk, const char* name)
             Instead of incrementing offset in the loop, 
             we let disassembleInstruction() do it for us.
         */
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(out, chunk, offset);
     }
 }
 
-static int constantInstruction(const char* name, Chunk* chunk, int offset)
+static int constantInstruction(FILE* out, const char* name, Chunk* chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
-    printf("%-16s %4d '", name, constant);
-    printValue(chunk->constants.values[constant]);
-    printf("'\n");
+    fprintf(out, "%-16s %4d '", name, constant);
+    printValue(out, chunk->constants.values[constant]);
+    fprintf(out, "'\n");
 
     // here the +2 means the size of this instruction is 2 bytes
     // or, in other word, 2 * sizeof(uint8_t).
@@ -33,82 +33,111 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
-static int constantLongInstruction(const char* name, Chunk* chunk, int offset)
+static int constantLongInstruction(FILE* out, const char* name, Chunk* chunk, int offset)
 {
     uint32_t constant = (chunk->code[offset + 1]) |
                         (chunk->code[offset + 2] << 8) |
                         (chunk->code[offset + 3] << 16);
                         
-    printf("%-16s %4d '", name, constant);
-    printValue(chunk->constants.values[constant]);
-    printf("'\n");
+    fprintf(out, "%-16s %4d '", name, constant);
+    printValue(out, chunk->constants.values[constant]);
+    fprintf(out, "'\n");
 
     return offset + 4;
 }
 
-static int simpleInstruction(const char* name, int offset)
+static int byteInstruction(FILE* out, const char* name, Chunk* chunk, int offset)
 {
-    printf("%s\n", name);
+    uint8_t slot = chunk->code[offset + 1];
+    fprintf(out, "%-16s %4d\n", name, slot);
+    return offset + 2;
+}
+
+static int simpleInstruction(FILE* out, const char* name, int offset)
+{
+    fprintf(out, "%s\n", name);
     return offset + 1;
 }
 
-int disassembleInstruction(Chunk* chunk, int offset)
+int disassembleInstruction(FILE* out, Chunk* chunk, int offset)
 {
-    printf("%04d ", offset);
+    fprintf(out, "%04d ", offset);
 
     int lineNumber = getLine(chunk, offset);
 
     // if this instcution and the previous instruction shares same line number
     if(offset > 0 && lineNumber == getLine(chunk, offset - 1))
     {
-        printf("   | ");
+        fprintf(out, "   | ");
     }
     else
     {
-        printf("%4d ", lineNumber);
+        fprintf(out, "%4d ", lineNumber);
     }
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction)
     {
     case OP_CONSTANT:
-        return constantInstruction("OP_CONSTANT", chunk, offset);
+        return constantInstruction(out, "OP_CONSTANT", chunk, offset);
     case OP_CONSTANT_LONG:
-        return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+        return constantLongInstruction(out, "OP_CONSTANT_LONG", chunk, offset);
     
     case OP_NIL:
-            return simpleInstruction("OP_NIL", offset);
+            return simpleInstruction(out, "OP_NIL", offset);
     case OP_TRUE:
-            return simpleInstruction("OP_TRUE", offset);
+            return simpleInstruction(out, "OP_TRUE", offset);
     case OP_FALSE:
-            return simpleInstruction("OP_FALSE", offset);
+            return simpleInstruction(out, "OP_FALSE", offset);
 
     case OP_EQUAL:
-      return simpleInstruction("OP_EQUAL", offset);
+      return simpleInstruction(out, "OP_EQUAL", offset);
     case OP_GREATER:
-      return simpleInstruction("OP_GREATER", offset);
+      return simpleInstruction(out, "OP_GREATER", offset);
     case OP_LESS:
-      return simpleInstruction("OP_LESS", offset);
+      return simpleInstruction(out, "OP_LESS", offset);
 
     case OP_ADD:
-        return simpleInstruction("OP_ADD", offset);
+        return simpleInstruction(out, "OP_ADD", offset);
     case OP_SUBTRACT:
-        return simpleInstruction("OP_SUBTRACT", offset);
+        return simpleInstruction(out, "OP_SUBTRACT", offset);
     case OP_MULTIPLY:
-        return simpleInstruction("OP_MULTIPLY", offset);
+        return simpleInstruction(out, "OP_MULTIPLY", offset);
     case OP_DIVIDE:
-        return simpleInstruction("OP_DIVIDE", offset);
+        return simpleInstruction(out, "OP_DIVIDE", offset);
 
     case OP_NOT:                                    
-      return simpleInstruction("OP_NOT", offset);
+      return simpleInstruction(out, "OP_NOT", offset);
 
     case OP_NEGATE:
-      return simpleInstruction("OP_NEGATE", offset);
+      return simpleInstruction(out, "OP_NEGATE", offset);
     case OP_RETURN:
-        return simpleInstruction("OP_RETURN", offset);
+        return simpleInstruction(out, "OP_RETURN", offset);
+
+    case OP_DUP:
+        return simpleInstruction(out, "OP_DUP", offset);
+    case OP_GET_TEMP:
+        return byteInstruction(out, "OP_GET_TEMP", chunk, offset);
+    case OP_SET_TEMP:
+        return byteInstruction(out, "OP_SET_TEMP", chunk, offset);
+
+    case OP_NOT_EQUAL:
+        return simpleInstruction(out, "OP_NOT_EQUAL", offset);
+    case OP_GREATER_EQUAL:
+        return simpleInstruction(out, "OP_GREATER_EQUAL", offset);
+    case OP_LESS_EQUAL:
+        return simpleInstruction(out, "OP_LESS_EQUAL", offset);
+    case OP_ADD_CONST:
+        return constantInstruction(out, "OP_ADD_CONST", chunk, offset);
+    case OP_SUBTRACT_CONST:
+        return constantInstruction(out, "OP_SUBTRACT_CONST", chunk, offset);
+    case OP_MULTIPLY_CONST:
+        return constantInstruction(out, "OP_MULTIPLY_CONST", chunk, offset);
+    case OP_DIVIDE_CONST:
+        return constantInstruction(out, "OP_DIVIDE_CONST", chunk, offset);
     
     default:
-        printf("Unknown opcode %d\n", instruction);
+        fprintf(out, "Unknown opcode %d\n", instruction);
         return offset + 1;
     }
 }
\ No newline at end of file
@@ -0,0 +1,174 @@
+#include <string.h>
+
+#include "group.h"
+#include "memory.h"
+
+// use parenthesis to group the constant value, just to avoid any shenanigans
+//
+// A probe stops at the first group with an empty slot in it, with 16 slots
+// per group that still comes quickly at 7/8 full.
+#define GROUP_MAX_LOAD (0.875)
+
+// GROUP_MIGRATE_SLOTS (group.h) is enough to be done in time : a resize
+// starts with at most 7/16 of the new capacity taken (see
+// resizedCapacity()), and the old arrays are gone after oldCapacity / 64
+// operations, which can't add more than 1/64 of it. So the new arrays
+// never fill up before the move is done.
+
+void initGroups(Groups* groups)
+{
+    groups->count = 0;
+    groups->keys = 0;
+    groups->capacity = 0;
+    groups->control = NULL;
+    groups->slots = NULL;
+
+    groups->oldCapacity = 0;
+    groups->oldControl = NULL;
+    groups->oldSlots = NULL;
+    groups->migrated = 0;
+    groups->isIncremental = true;
+}
+
+static void freeOldArrays(VM* vm, Groups* groups, const GroupLayout* layout)
+{
+    FREE_ARRAY(vm, uint8_t, groups->oldControl, groups->oldCapacity, MEM_TABLE);
+    reallocate(vm, groups->oldSlots, layout->slotSize * groups->oldCapacity, 0, MEM_TABLE);
+    groups->oldCapacity = 0;
+    groups->oldControl = NULL;
+    groups->oldSlots = NULL;
+    groups->migrated = 0;
+}
+
+void freeGroups(VM* vm, Groups* groups, const GroupLayout* layout)
+{
+    freeOldArrays(vm, groups, layout);
+    FREE_ARRAY(vm, uint8_t, groups->control, groups->capacity, MEM_TABLE);
+    reallocate(vm, groups->slots, layout->slotSize * groups->capacity, 0, MEM_TABLE);
+
+    bool isIncremental = groups->isIncremental;
+    initGroups(groups);
+    groups->isIncremental = isIncremental;
+}
+
+// Move up to 'slots' slots of the old arrays over to the new ones. A moved
+// slot is left as it was : probes of the old arrays still have to go past
+// it, lookups just don't take a match below 'migrated'.
+//
+// Moving frees at most, it never allocates : internRemove() runs from the
+// sweep, where a collection step must not start.
+void migrateGroups(VM* vm, Groups* groups, const GroupLayout* layout, int slots)
+{
+    if (groups->oldControl == NULL) return;
+
+    int end = groups->migrated + slots;
+    if (end > groups->oldCapacity) end = groups->oldCapacity;
+
+    for (int i = groups->migrated; i < end; i++)
+    {
+        if (!isFullControl(groups->oldControl[i])) continue;
+
+        // the keys are distinct, so they go straight to a free slot
+        void* from = slotAt(groups->oldSlots, layout, i);
+        int slot = findFreeSlot(groups->control, groups->capacity, layout->hashOf(from));
+        groups->control[slot] = groups->oldControl[i];
+        memcpy(slotAt(groups->slots, layout, slot), from, layout->slotSize);
+        groups->count++;
+    }
+    groups->migrated = end;
+
+    if (groups->migrated == groups->oldCapacity) freeOldArrays(vm, groups, layout);
+}
+
+static void startResize(VM* vm, Groups* groups, const GroupLayout* layout, int capacity)
+{
+    // allocating may run a collection step, and the sweep may remove
+    // strings from vm.strings, the arrays have to be whole until the new
+    // ones are in
+    uint8_t* control = ALLOCATE(vm, uint8_t, capacity, MEM_TABLE);
+    void* slots = reallocate(vm, NULL, 0, layout->slotSize * capacity, MEM_TABLE);
+    memset(control, CONTROL_EMPTY, capacity);
+
+    groups->oldCapacity = groups->control != NULL ? groups->capacity : 0;
+    groups->oldControl = groups->control;
+    groups->oldSlots = groups->slots;
+    groups->migrated = 0;
+
+    groups->count = 0;
+    groups->capacity = capacity;
+    groups->control = control;
+    groups->slots = slots;
+
+    if (!groups->isIncremental) migrateGroups(vm, groups, layout, groups->oldCapacity);
+}
+
+// Resize policy, for a table about to take one more key. 'used' counts the
+// slots in use, tombstones included, 'keys' only the live ones. Returns the
+// capacity to resize to, or 0 when the table is fine as it is.
+//
+// - Past GROUP_MAX_LOAD it doubles, unless the keys alone fill less than
+//   half of it : then tombstones are the problem, and rebuilding at the
+//   same size drops them (a weak table like vm.strings can be mostly
+//   tombstones after a collection, growing it would never stop).
+// - Once the keys fill less than 1/8 of what it could hold, it halves.
+//   Either way it ends up between the two thresholds, so it does not go
+//   back and forth.
+static int resizedCapacity(int capacity, int used, int keys)
+{
+    if (capacity == 0) return GROUP_SIZE;
+
+    if (used + 1 > capacity * GROUP_MAX_LOAD)
+    {
+        return keys + 1 > capacity * GROUP_MAX_LOAD / 2 ? capacity * 2 : capacity;
+    }
+    if (capacity > GROUP_SIZE && keys < capacity * GROUP_MAX_LOAD / 8)
+    {
+        return capacity / 2;
+    }
+    return 0;
+}
+
+// make room for one more key
+static void reserveSlot(VM* vm, Groups* groups, const GroupLayout* layout)
+{
+    if (groups->oldControl != NULL)
+    {
+        // One resize at a time, the counts are only meaningful once the
+        // move is done. GROUP_MIGRATE_SLOTS is there to make sure the new
+        // arrays have room until then, finishing early is for safety.
+        if (groups->count + 1 <= groups->capacity * GROUP_MAX_LOAD) return;
+        migrateGroups(vm, groups, layout, groups->oldCapacity);
+    }
+
+    int capacity = resizedCapacity(groups->capacity, groups->count, groups->keys);
+    if (capacity != 0) startResize(vm, groups, layout, capacity);
+}
+
+int claimGroupSlot(VM* vm, Groups* groups, const GroupLayout* layout, uint32_t hash)
+{
+    reserveSlot(vm, groups, layout);
+
+    int slot = findFreeSlot(groups->control, groups->capacity, hash);
+    if (groups->control[slot] == CONTROL_EMPTY) groups->count++;
+    groups->keys++;
+
+    groups->control[slot] = controlHash(hash);
+    return slot;
+}
+
+void removeGroupSlot(Groups* groups, GroupSlot found)
+{
+    if (found.isOld)
+    {
+        // nothing is inserted into the old arrays any more, a tombstone it is
+        groups->oldControl[found.index] = CONTROL_DELETED;
+    }
+    else
+    {
+        // a tombstone, or nothing at all when it is not needed to keep
+        // other keys findable
+        groups->control[found.index] = deletedControl(groups->control, found.index);
+        if (groups->control[found.index] == CONTROL_EMPTY) groups->count--;
+    }
+    groups->keys--;
+}
@@ -0,0 +1,88 @@
+#include <string.h>
+
+#include "group.h"
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+
+static uint32_t internHash(const void* slot)
+{
+    // the hash is in the slot, moving never touches the strings
+    return ((const InternSlot*)slot)->hash;
+}
+
+static const GroupLayout internLayout = { sizeof(InternSlot), internHash };
+
+void initInternSet(InternSet* set)
+{
+    initGroups(&set->groups);
+}
+
+void freeInternSet(VM* vm, InternSet* set)
+{
+    freeGroups(vm, &set->groups, &internLayout);
+}
+
+void internPrefetch(InternSet* set, uint32_t hash)
+{
+    if (set->groups.capacity == 0) return;
+
+    Probe probe = startProbe(set->groups.capacity, hash);
+    __builtin_prefetch(&set->groups.control[probe.group * GROUP_SIZE]);
+}
+
+// the characters internFind() is after
+typedef struct
+{
+    const char* chars;
+    int length;
+    uint32_t hash;
+} InternKey;
+
+static bool matchesChars(const void* slot, const void* key)
+{
+    const InternSlot* intern = slot;
+    const InternKey* wanted = key;
+    // only a string with the same hash and length is worth a look
+    return intern->hash == wanted->hash && intern->length == wanted->length &&
+        memcmp(intern->string->chars, wanted->chars, wanted->length) == 0;
+}
+
+ObjString* internFind(VM* vm, InternSet* set, const char* chars, int length, uint32_t hash)
+{
+    stepResize(vm, &set->groups, &internLayout);
+
+    InternKey key = { chars, length, hash };
+    GroupSlot found = findGroups(&set->groups, &internLayout, hash, matchesChars, &key);
+    if (found.index < 0) return NULL;
+
+    return ((InternSlot*)foundSlot(&set->groups, &internLayout, found))->string;
+}
+
+void internAdd(VM* vm, InternSet* set, ObjString* string)
+{
+    stepResize(vm, &set->groups, &internLayout);
+
+    int index = claimGroupSlot(vm, &set->groups, &internLayout, string->hash);
+    InternSlot* slot = slotAt(set->groups.slots, &internLayout, index);
+    slot->hash = string->hash;
+    slot->length = string->length;
+    slot->string = string;
+}
+
+static bool matchesString(const void* slot, const void* string)
+{
+    return ((const InternSlot*)slot)->string == string;
+}
+
+bool internRemove(VM* vm, InternSet* set, ObjString* string)
+{
+    stepResize(vm, &set->groups, &internLayout);
+
+    GroupSlot found = findGroups(&set->groups, &internLayout, string->hash, matchesString, string);
+    if (found.index < 0) return false;
+
+    removeGroupSlot(&set->groups, found);
+    ((InternSlot*)foundSlot(&set->groups, &internLayout, found))->string = NULL;
+    return true;
+}
@@ -0,0 +1,486 @@
+#include <string.h>
+
+#include "chunk.h"
+#include "ir.h"
+#include "memory.h"
+#include "vm.h"
+
+// use parenthesis to group the constant value, just to avoid any shenanigans
+#define IR_SET_MAX_LOAD (0.75)
+
+// Temporaries are stack slots reserved below the expression, keep them few
+// so they can't eat the fixed size VM stack. A shared node that doesn't get
+// a slot is simply computed again, which is correct since expressions have
+// no side effects.
+#define IR_MAX_TEMPS (64)
+
+void initIr(IrGraph* ir)
+{
+    ir->count = 0;
+    ir->capacity = 0;
+    ir->nodes = NULL;
+    ir->setCapacity = 0;
+    ir->set = NULL;
+}
+
+void freeIr(VM* vm, IrGraph* ir)
+{
+    FREE_ARRAY(vm, IrNode, ir->nodes, ir->capacity, MEM_IR);
+    FREE_ARRAY(vm, IrRef, ir->set, ir->setCapacity, MEM_IR);
+    initIr(ir);
+}
+
+// - hash-consing
+
+static uint32_t hashNode(IrNode* node)
+{
+    if (node->op == OP_CONSTANT) return hashValue(node->value);
+
+    uint32_t hash = node->op * 0x9e3779b1u;
+    hash ^= (uint32_t)node->left * 0x85ebca77u;
+    hash ^= (uint32_t)node->right * 0xc2b2ae3du;
+    return hash ^ (hash >> 15);
+}
+
+static bool sameNode(IrNode* a, IrNode* b)
+{
+    if (a->op != b->op) return false;
+    // the line is not part of the identity, the same subexpression on two
+    // lines is still the same subexpression
+    if (a->op == OP_CONSTANT) return valuesIdentical(a->value, b->value);
+    return a->left == b->left && a->right == b->right;
+}
+
+// returns the slot holding 'node', or the empty slot where it belongs
+static IrRef* findSlot(IrGraph* ir, IrRef* set, int capacity, IrNode* node)
+{
+    // capacity is a power of two, masking is a cheap modulo
+    uint32_t index = hashNode(node) & (capacity - 1);
+
+    for (;;)
+    {
+        IrRef* slot = &set[index];
+        if (*slot == IR_NONE || sameNode(&ir->nodes[*slot], node)) return slot;
+
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void growSet(VM* vm, IrGraph* ir)
+{
+    int capacity = ir->setCapacity < 64 ? 64 : ir->setCapacity * 2;
+    IrRef* set = ALLOCATE(vm, IrRef, capacity, MEM_IR);
+    for (int i = 0; i < capacity; i++) set[i] = IR_NONE;
+
+    // every node is in the set, re-insert them all
+    for (IrRef ref = 0; ref < ir->count; ref++)
+    {
+        *findSlot(ir, set, capacity, &ir->nodes[ref]) = ref;
+    }
+
+    FREE_ARRAY(vm, IrRef, ir->set, ir->setCapacity, MEM_IR);
+    ir->set = set;
+    ir->setCapacity = capacity;
+}
+
+static bool computeIsNumeric(IrGraph* ir, IrNode* node)
+{
+    switch (node->op)
+    {
+        case OP_CONSTANT: return IS_NUMBER(node->value);
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:
+            return true;
+        // + of two strings is a string
+        case OP_ADD:
+            return ir->nodes[node->left].isNumeric && ir->nodes[node->right].isNumeric;
+        default:
+            return false;
+    }
+}
+
+static IrRef addNode(VM* vm, IrGraph* ir, IrNode* node)
+{
+    if (ir->count + 1 > ir->setCapacity * IR_SET_MAX_LOAD) growSet(vm, ir);
+
+    IrRef* slot = findSlot(ir, ir->set, ir->setCapacity, node);
+    if (*slot != IR_NONE) return *slot;
+
+    if (ir->capacity < ir->count + 1)
+    {
+        int oldCapacity = ir->capacity;
+        ir->capacity = GROW_CAPACITY(oldCapacity);
+        ir->nodes = GROW_ARRAY(vm, ir->nodes, IrNode, oldCapacity, ir->capacity, MEM_IR);
+    }
+
+    node->isNumeric = computeIsNumeric(ir, node);
+    ir->nodes[ir->count] = *node;
+    *slot = ir->count;
+    return ir->count++;
+}
+
+IrRef irConstant(VM* vm, IrGraph* ir, Value value, int line)
+{
+    IrNode node;
+    node.op = OP_CONSTANT;
+    node.line = line;
+    node.left = IR_NONE;
+    node.right = IR_NONE;
+    node.value = value;
+
+    // until the node is in the arena nothing references 'value', and
+    // growing the arena may run the collector
+    push(vm, value);
+    IrRef ref = addNode(vm, ir, &node);
+    pop(vm);
+    return ref;
+}
+
+IrRef irUnary(VM* vm, IrGraph* ir, OpCode op, IrRef operand, int line)
+{
+    IrNode node;
+    node.op = op;
+    node.line = line;
+    node.left = operand;
+    node.right = IR_NONE;
+    node.value = NIL_VAL;
+    return addNode(vm, ir, &node);
+}
+
+IrRef irBinary(VM* vm, IrGraph* ir, OpCode op, IrRef left, IrRef right, int line)
+{
+    IrNode node;
+    node.op = op;
+    node.line = line;
+    node.left = left;
+    node.right = right;
+    node.value = NIL_VAL;
+    return addNode(vm, ir, &node);
+}
+
+// - optimization passes
+
+static bool isNumberConstant(IrGraph* ir, IrRef ref)
+{
+    return irIsConstant(ir, ref) && IS_NUMBER(ir->nodes[ref].value);
+}
+
+static double numberOf(IrGraph* ir, IrRef ref)
+{
+    return AS_NUMBER(ir->nodes[ref].value);
+}
+
+// true if c is a power of two whose reciprocal is a normal double, then
+// x / c and x * (1 / c) round the exact same real number and are equal
+// bit for bit
+static bool hasExactReciprocal(double c)
+{
+    uint64_t bits;
+    memcpy(&bits, &c, sizeof(double));
+
+    uint64_t mantissa = bits & 0xfffffffffffffu;
+    int exponent = (int)((bits >> 52) & 0x7ff);
+    // 1 / 2^e has the biased exponent 2046 - e
+    return mantissa == 0 && exponent >= 1 && exponent <= 2045;
+}
+
+static bool foldNumbers(uint8_t op, double a, double b, Value* result)
+{
+    switch (op)
+    {
+        case OP_ADD:      *result = NUMBER_VAL(a + b); return true;
+        case OP_SUBTRACT: *result = NUMBER_VAL(a - b); return true;
+        case OP_MULTIPLY: *result = NUMBER_VAL(a * b); return true;
+        case OP_DIVIDE:   *result = NUMBER_VAL(a / b); return true;
+        case OP_EQUAL:    *result = BOOL_VAL(a == b); return true;
+        case OP_GREATER:  *result = BOOL_VAL(a > b); return true;
+        case OP_LESS:     *result = BOOL_VAL(a < b); return true;
+        default:
+            return false;
+    }
+}
+
+// Rebuild "left op right" from already simplified operands. Every rewrite
+// below keeps the runtime error an expression raises, message included,
+// which is why some of them only apply to operands known to be numbers.
+static IrRef simplify(VM* vm, IrGraph* ir, uint8_t op, IrRef left, IrRef right, int line)
+{
+    if (right == IR_NONE)
+    {
+        if (op == OP_NEGATE && isNumberConstant(ir, left))
+        {
+            return irConstant(vm, ir, NUMBER_VAL(-numberOf(ir, left)), line);
+        }
+        return irUnary(vm, ir, op, left, line);
+    }
+
+    // reassociation can bring two constants together
+    Value folded;
+    if (isNumberConstant(ir, left) && isNumberConstant(ir, right) &&
+        foldNumbers(op, numberOf(ir, left), numberOf(ir, right), &folded))
+    {
+        return irConstant(vm, ir, folded, line);
+    }
+
+    // Canonical form : constant on the right. For + this is only done with
+    // a number, "a" + x and x + "a" are different strings.
+    if ((op == OP_MULTIPLY || op == OP_ADD) &&
+        isNumberConstant(ir, left) && !irIsConstant(ir, right))
+    {
+        IrRef swap = left;
+        left = right;
+        right = swap;
+    }
+
+    if (!isNumberConstant(ir, right)) return irBinary(vm, ir, op, left, right, line);
+
+    double c = numberOf(ir, right);
+    // copy, adding nodes may move the arena
+    IrNode inner = ir->nodes[left];
+
+    // Reassociation : (x + c1) + c2 -> x + (c1 + c2), and the same with
+    // any mix of + and -. This changes the rounding of the result, like
+    // -ffast-math would. Mixing in - turns the outer operator into +, so
+    // that is only done when x is a number (the error message differs).
+    // The merged node keeps the line of the inner operator, the one a
+    // non-number x makes fail first.
+    if ((op == OP_ADD || op == OP_SUBTRACT) &&
+        (inner.op == OP_ADD || inner.op == OP_SUBTRACT) &&
+        isNumberConstant(ir, inner.right) &&
+        ((op == OP_ADD && inner.op == OP_ADD) || ir->nodes[inner.left].isNumeric))
+    {
+        double c1 = numberOf(ir, inner.right);
+        double total = (inner.op == OP_ADD ? c1 : -c1) + (op == OP_ADD ? c : -c);
+        return irBinary(vm, ir, OP_ADD, inner.left,
+            irConstant(vm, ir, NUMBER_VAL(total), inner.line), inner.line);
+    }
+
+    // (x * c1) * c2 -> x * (c1 * c2)
+    if (op == OP_MULTIPLY && inner.op == OP_MULTIPLY &&
+        isNumberConstant(ir, inner.right))
+    {
+        double c1 = numberOf(ir, inner.right);
+        return irBinary(vm, ir, OP_MULTIPLY, inner.left,
+            irConstant(vm, ir, NUMBER_VAL(c1 * c), inner.line), inner.line);
+    }
+
+    // Strength reduction : x / 2^k -> x * 2^-k, a multiply is several
+    // times cheaper than a divide and the result is exactly the same
+    if (op == OP_DIVIDE && hasExactReciprocal(c))
+    {
+        IrRef reciprocal = irConstant(vm, ir, NUMBER_VAL(1.0 / c), line);
+        return simplify(vm, ir, OP_MULTIPLY, left, reciprocal, line);
+    }
+
+    // x * 2 -> x + x, "a" * 2 is an error but "a" + "a" is not, so only
+    // for numbers
+    if (op == OP_MULTIPLY && c == 2.0 && ir->nodes[left].isNumeric)
+    {
+        return irBinary(vm, ir, OP_ADD, left, left, line);
+    }
+
+    return irBinary(vm, ir, op, left, right, line);
+}
+
+IrRef irOptimize(VM* vm, IrGraph* ir, IrRef root)
+{
+    // Operands always come before their users in the arena, so a single
+    // sweep in index order sees every operand already rewritten. The
+    // rewritten nodes are appended after 'count' and not visited again.
+    int count = ir->count;
+    IrRef* rewritten = ALLOCATE(vm, IrRef, count, MEM_IR);
+
+    for (IrRef ref = 0; ref < count; ref++)
+    {
+        IrNode node = ir->nodes[ref];
+        if (node.op == OP_CONSTANT)
+        {
+            rewritten[ref] = ref;
+            continue;
+        }
+
+        IrRef left = rewritten[node.left];
+        IrRef right = node.right == IR_NONE ? IR_NONE : rewritten[node.right];
+        rewritten[ref] = simplify(vm, ir, node.op, left, right, node.line);
+    }
+
+    IrRef result = rewritten[root];
+    FREE_ARRAY(vm, IrRef, rewritten, count, MEM_IR);
+    return result;
+}
+
+// - bytecode emission
+
+// A node still to emit. It is taken off the work stack twice, once to
+// push its operands and once, after them, to emit its own instruction.
+typedef struct
+{
+    IrRef ref;
+    bool isExpanded;
+} EmitTask;
+
+typedef struct
+{
+    VM* vm;
+    IrGraph* ir;
+    Chunk* chunk;
+    // temp slot of every shared node, or -1
+    int* slots;
+    // whether a shared node has been computed into its slot yet
+    bool* computed;
+
+    int taskCount;
+    int taskCapacity;
+    EmitTask* tasks;
+} Emitter;
+
+static void emitValue(Emitter* emitter, Value value, int line)
+{
+    if (IS_NIL(value))
+    {
+        writeChunk(emitter->vm, emitter->chunk, OP_NIL, line);
+    }
+    else if (IS_BOOL(value))
+    {
+        writeChunk(emitter->vm, emitter->chunk, AS_BOOL(value) ? OP_TRUE : OP_FALSE, line);
+    }
+    else
+    {
+        writeConstant(emitter->vm, emitter->chunk, value, line);
+    }
+}
+
+static void pushTask(Emitter* emitter, IrRef ref, bool isExpanded)
+{
+    if (emitter->taskCapacity < emitter->taskCount + 1)
+    {
+        int oldCapacity = emitter->taskCapacity;
+        emitter->taskCapacity = GROW_CAPACITY(oldCapacity);
+        emitter->tasks = GROW_ARRAY(emitter->vm, emitter->tasks, EmitTask,
+            oldCapacity, emitter->taskCapacity, MEM_IR);
+    }
+    emitter->tasks[emitter->taskCount].ref = ref;
+    emitter->tasks[emitter->taskCount].isExpanded = isExpanded;
+    emitter->taskCount++;
+}
+
+// the value of 'ref' is on top of the stack now
+static void finishNode(Emitter* emitter, IrRef ref)
+{
+    int slot = emitter->slots[ref];
+    if (slot >= 0)
+    {
+        // keep a copy for the other users, the value stays on the stack
+        int line = emitter->ir->nodes[ref].line;
+        writeChunk(emitter->vm, emitter->chunk, OP_SET_TEMP, line);
+        writeChunk(emitter->vm, emitter->chunk, (uint8_t)slot, line);
+        emitter->computed[ref] = true;
+    }
+}
+
+// Operands first, left before right, then the operator. This is a walk
+// with an explicit stack rather than a recursive one, like flattenRope() :
+// a generated "a" + "b" + "b" + ... is a left chain as deep as it is long,
+// one C stack frame per term would overflow long before -O0 and -O1 give
+// up on the same input.
+static void emitNode(Emitter* emitter, IrRef root)
+{
+    pushTask(emitter, root, false);
+    while (emitter->taskCount > 0)
+    {
+        EmitTask task = emitter->tasks[--emitter->taskCount];
+        IrNode node = emitter->ir->nodes[task.ref];
+
+        if (task.isExpanded)
+        {
+            if (node.right == node.left)
+            {
+                // x + x
+                writeChunk(emitter->vm, emitter->chunk, OP_DUP, node.line);
+            }
+            writeChunk(emitter->vm, emitter->chunk, node.op, node.line);
+            finishNode(emitter, task.ref);
+            continue;
+        }
+
+        // common subexpression, already computed
+        int slot = emitter->slots[task.ref];
+        if (slot >= 0 && emitter->computed[task.ref])
+        {
+            writeChunk(emitter->vm, emitter->chunk, OP_GET_TEMP, node.line);
+            writeChunk(emitter->vm, emitter->chunk, (uint8_t)slot, node.line);
+            continue;
+        }
+
+        if (node.op == OP_CONSTANT)
+        {
+            emitValue(emitter, node.value, node.line);
+            finishNode(emitter, task.ref);
+            continue;
+        }
+
+        // popped in the reverse order : left, right, then the operator
+        pushTask(emitter, task.ref, true);
+        if (node.right != IR_NONE && node.right != node.left) pushTask(emitter, node.right, false);
+        pushTask(emitter, node.left, false);
+    }
+}
+
+void irEmit(VM* vm, IrGraph* ir, IrRef root, Chunk* chunk)
+{
+    int count = root + 1;
+    int* uses = ALLOCATE(vm, int, count, MEM_IR);
+    int* slots = ALLOCATE(vm, int, count, MEM_IR);
+    bool* computed = ALLOCATE(vm, bool, count, MEM_IR);
+    memset(uses, 0, sizeof(int) * count);
+    memset(computed, 0, sizeof(bool) * count);
+
+    // Count the users of every node reachable from the root. Walking down
+    // from the root visits each user before its operands. x + x counts as
+    // one use of x, it is emitted with OP_DUP.
+    uses[root] = 1;
+    for (IrRef ref = root; ref >= 0; ref--)
+    {
+        IrNode* node = &ir->nodes[ref];
+        if (uses[ref] == 0 || node->op == OP_CONSTANT) continue;
+
+        uses[node->left]++;
+        if (node->right != IR_NONE && node->right != node->left) uses[node->right]++;
+    }
+
+    // Nodes with several users get a temp slot. Constants don't, loading
+    // them again is as cheap as loading a temp.
+    int temps = 0;
+    for (IrRef ref = 0; ref < count; ref++)
+    {
+        slots[ref] = -1;
+        if (uses[ref] > 1 && ir->nodes[ref].op != OP_CONSTANT && temps < IR_MAX_TEMPS)
+        {
+            slots[ref] = temps++;
+        }
+    }
+
+    // the temp slots sit at the bottom of the stack, under the expression
+    for (int i = 0; i < temps; i++)
+    {
+        writeChunk(vm, chunk, OP_NIL, ir->nodes[root].line);
+    }
+
+    Emitter emitter;
+    emitter.vm = vm;
+    emitter.ir = ir;
+    emitter.chunk = chunk;
+    emitter.slots = slots;
+    emitter.computed = computed;
+    emitter.taskCount = 0;
+    emitter.taskCapacity = 0;
+    emitter.tasks = NULL;
+    emitNode(&emitter, root);
+    FREE_ARRAY(vm, EmitTask, emitter.tasks, emitter.taskCapacity, MEM_IR);
+
+    FREE_ARRAY(vm, int, uses, count, MEM_IR);
+    FREE_ARRAY(vm, int, slots, count, MEM_IR);
+    FREE_ARRAY(vm, bool, computed, count, MEM_IR);
+}
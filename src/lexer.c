@@ -0,0 +1,155 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lexer.h"
+#include "memory.h"
+
+static void* allocateTokens(void* previous, int count)
+{
+    void* tokens = realloc(previous, sizeof(Token) * (count > 0 ? count : 1));
+    if (tokens == NULL)
+    {
+        fprintf(stderr, "Not enough memory to scan the source. \n");
+        exit(74);
+    }
+    return tokens;
+}
+
+// One piece of the source and the thread scanning it.
+//
+// The pieces are scanned in two rounds : first every thread scans its piece
+// into a buffer of its own, then, with the counts known, the buffer of the
+// first piece is grown to hold all the tokens and every other thread copies
+// its tokens to their place in it, fixing the line numbers up on the way.
+//
+// The buffers come from malloc(), the heap of a VM that reallocate() works
+// with is not safe to use from more than one thread, and the array is a
+// malloc() block too : the large blocks glibc maps on their own grow with
+// mremap(), without a copy.
+typedef struct
+{
+    SourcePiece piece;
+    Token* tokens;
+    int count;
+    int capacity;
+
+    // where the tokens go in the array
+    int offset;
+    Token* destination;
+
+    pthread_t thread;
+    bool hasThread;
+} LexJob;
+
+static void pushToken(LexJob* job, Token token)
+{
+    if (job->count == job->capacity)
+    {
+        job->capacity = GROW_CAPACITY(job->capacity);
+        job->tokens = (Token*)allocateTokens(job->tokens, job->capacity);
+    }
+    job->tokens[job->count++] = token;
+}
+
+static void* scanPiece(void* argument)
+{
+    LexJob* job = (LexJob*)argument;
+
+    // a token every 8 characters to start with, growing is cheap anyway
+    job->capacity = (int)(job->piece.length / 8) + 8;
+    job->tokens = (Token*)allocateTokens(NULL, job->capacity);
+
+    Scanner scanner;
+    initScanner(&scanner, job->piece.start, job->piece.length);
+    for (;;)
+    {
+        Token token = scanToken(&scanner);
+        pushToken(job, token);
+        if (token.type == TOKEN_EOF) break;
+    }
+    return NULL;
+}
+
+static void* copyPiece(void* argument)
+{
+    LexJob* job = (LexJob*)argument;
+
+    // the first piece is in place already
+    if (job->destination == job->tokens) return NULL;
+
+    int lines = job->piece.line - 1;
+    for (int i = 0; i < job->count; i++)
+    {
+        job->destination[i] = job->tokens[i];
+        job->destination[i].line += lines;
+    }
+
+    free(job->tokens);
+    return NULL;
+}
+
+// runs 'work' for every job, the first one on this thread
+static void runJobs(LexJob* jobs, int count, void* (*work)(void*))
+{
+    for (int i = 1; i < count; i++)
+    {
+        jobs[i].hasThread = pthread_create(&jobs[i].thread, NULL, work, &jobs[i]) == 0;
+        // without a thread, this one does the work
+        if (!jobs[i].hasThread) work(&jobs[i]);
+    }
+
+    work(&jobs[0]);
+
+    for (int i = 1; i < count; i++)
+    {
+        if (jobs[i].hasThread) pthread_join(jobs[i].thread, NULL);
+    }
+}
+
+void scanTokens(TokenArray* array, const char* source, size_t length, int threads)
+{
+    if (threads < 1) threads = 1;
+    if (threads > LEX_MAX_THREADS) threads = LEX_MAX_THREADS;
+
+    SourcePiece pieces[LEX_MAX_THREADS];
+    int count = splitSource(source, length, threads, pieces);
+
+    LexJob jobs[LEX_MAX_THREADS];
+    for (int i = 0; i < count; i++)
+    {
+        jobs[i].piece = pieces[i];
+        jobs[i].tokens = NULL;
+        jobs[i].count = 0;
+        jobs[i].capacity = 0;
+    }
+    runJobs(jobs, count, scanPiece);
+
+    // Every piece ends with a TOKEN_EOF, only the one of the last piece is
+    // kept. A piece ends right after a newline, outside of any string, so
+    // the others are just that.
+    int total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (i + 1 < count) jobs[i].count--;
+        jobs[i].offset = total;
+        total += jobs[i].count;
+    }
+
+    array->tokens = (Token*)allocateTokens(jobs[0].tokens, total);
+    array->count = total;
+    for (int i = 0; i < count; i++)
+    {
+        jobs[i].destination = array->tokens + jobs[i].offset;
+    }
+    jobs[0].tokens = array->tokens;
+    if (count > 1) runJobs(jobs, count, copyPiece);
+}
+
+void freeTokenArray(TokenArray* array)
+{
+    free(array->tokens);
+    array->tokens = NULL;
+    array->count = 0;
+}
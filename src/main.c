@@ -1,14 +1,32 @@
 #include "common.h"
+#include "batch.h"
+#include "cache.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "lexer.h"
+#include "memory.h"
+#include "shared.h"
+#include "source.h"
 #include "vm.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// see cache.h, set with --cache=
+CacheMode cacheMode = CACHE_READ;
+
+// see source.h, cleared with --no-mmap
+bool useMmap = true;
+
+// the one VM of the command line, static for the --mem-stats summary, which
+// runs at exit
+static VM vm;
+
 // read-execute(evaluate)-print-loop
-static void repl()
+static void repl(VM* vm)
 {
     char line[1024];
     for(;;)
@@ -21,90 +39,216 @@ static void repl()
             break;
         }
 
-        interpret(line);
+        interpret(vm, line, strlen(line));
     }
 }
 
-static char* readFile(const char* path)
+static void runFile(VM* vm, const char* path)
 {
-    FILE* file = fopen(path, "rb");
-    if(file == NULL)
+    SourceFile source;
+    if(!loadSource(&source, path, useMmap))
     {
-        fprintf(stderr, "Could not open file \"%s\". \n", path);
+        fprintf(stderr, "Could not read file \"%s\". \n", path);
         exit(74);
     }
+    InterpretResult result = cacheMode == CACHE_OFF
+        ? interpret(vm, source.chars, source.length)
+        : interpretCached(vm, path, source.chars, source.length, cacheMode);
+    freeSource(&source);
+
+    if(result == INTERPRET_COMPILE_ERROR) exit(65);
+    if(result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if(result == INTERPRET_IO_ERROR) exit(74);
+}
 
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
+// the scripts given on the command line and in manifests
+typedef struct
+{
+    const char** paths;
+    int count;
+    int capacity;
+} PathList;
+
+static void addPath(PathList* list, const char* path)
+{
+    if(list->count == list->capacity)
+    {
+        list->capacity = GROW_CAPACITY(list->capacity);
+        list->paths = (const char**)realloc(list->paths, sizeof(const char*) * list->capacity);
+        if(list->paths == NULL)
+        {
+            fprintf(stderr, "Not enough memory for the list of scripts. \n");
+            exit(74);
+        }
+    }
+    list->paths[list->count++] = path;
+}
 
-    char* buffer = (char*)malloc(fileSize + 1);
-    // memory allocation failed
-    if(buffer == NULL)
+// A manifest lists one script per line, blank lines are skipped. The paths
+// point into a copy of its text, which is kept until the process exits.
+static void addManifest(PathList* list, const char* manifestPath)
+{
+    SourceFile source;
+    if(!loadSource(&source, manifestPath, false))
     {
-        fprintf(stderr, "Not enough memory to read \"%s\". \n", path);
+        fprintf(stderr, "Could not read file \"%s\". \n", manifestPath);
         exit(74);
     }
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize)
+
+    char* text = (char*)malloc(source.length + 1);
+    if(text == NULL)
     {
-        fprintf(stderr, "Could not read file \"%s\". \n", path);
+        fprintf(stderr, "Not enough memory to read \"%s\". \n", manifestPath);
         exit(74);
     }
-    buffer[bytesRead] = '\0';
-
-    fclose(file);
-    return buffer;
-
-    /**
-     *  Extra info :
-     *  
-     *  "
-     *  Actually, the calls to fseek(), ftell(), 
-     *  and rewind() could theoretically fail too,
-     *  but let’s not go too far off in the weeds, shall we?
-     * 
-     *  Even good old printf() can fail. 
-     *  Yup. How many times have you handled that error?
-     *  "
-     * 
-     *  As Bob Nystrom mentioned in the book, printf() it self could fail too.
-     *  I was wondering when will that ever happen, and found this.
-     *  
-     *  Reference : 
-     *  https://silviocesare.wordpress.com/2007/10/20/when-can-a-printf-fail/
-     *  
-     *  "It can fail when the program output is being redirected to the disk, and the disk becomes full."
-     */
+    memcpy(text, source.chars, source.length);
+    char* end = text + source.length;
+    *end = '\0';
+    freeSource(&source);
+
+    for(char* line = text; line < end;)
+    {
+        char* newline = (char*)memchr(line, '\n', end - line);
+        if(newline == NULL) newline = end;
+        *newline = '\0';
+        if(newline > line && newline[-1] == '\r') newline[-1] = '\0';
+
+        if(*line != '\0') addPath(list, line);
+        line = newline + 1;
+    }
 }
 
-static void runFile(const char* path)
+static bool parseCacheMode(const char* mode)
 {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    if(strcmp(mode, "read") == 0)       cacheMode = CACHE_READ;
+    else if(strcmp(mode, "auto") == 0)  cacheMode = CACHE_AUTO;
+    else if(strcmp(mode, "force") == 0) cacheMode = CACHE_FORCE;
+    else if(strcmp(mode, "off") == 0)   cacheMode = CACHE_OFF;
+    else if(strcmp(mode, "emit") == 0)  cacheMode = CACHE_EMIT;
+    else return false;
 
-    if(result == INTERPRET_COMPILE_ERROR) exit(65);
-    if(result == INTERPRET_RUNTIME_ERROR) exit(70);
+    return true;
+}
+
+// installed with atexit() by --mem-stats, so that it also runs when a
+// script fails and exit() is called halfway through runFile()
+static void printMemoryStatsAtExit()
+{
+    printMemoryStats(&vm, stderr);
+    if(vm.sharedStrings != NULL) printSharedStringStats(vm.sharedStrings, stderr);
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [-O0|-O1|-O2] [--cache=read|auto|force|off|emit] [--no-mmap] [--mem-stats] [--lex-threads=n] [--jobs=n] [--manifest=path] [--shared-strings] [--stack-max=n] [path...]\n");
+    fprintf(stderr, "  --cache=read is the default, a valid script.loxc is used but none is written\n");
+    exit(64);
 }
 
 int main(int argc, const char* argv[])
 {
-    initVM();
+    initVM(&vm);
 
-    if(argc == 1)
+    PathList scripts = { NULL, 0, 0 };
+    // more than one script, --jobs or --manifest run them as a batch
+    // (batch.h), 0 jobs is one per core
+    bool isBatch = false;
+    int jobs = 0;
+    bool memStats = false;
+    bool sharedStrings = false;
+    for(int i = 1; i < argc; i++)
     {
-        repl();
+        if(argv[i][0] == '-' && argv[i][1] == 'O' &&
+           argv[i][2] >= '0' && argv[i][2] <= '2' && argv[i][3] == '\0')
+        {
+            setOptimizationLevel(&vm, argv[i][2] - '0');
+        }
+        else if(strcmp(argv[i], "--mem-stats") == 0)
+        {
+            memStats = true;
+        }
+        else if(strcmp(argv[i], "--shared-strings") == 0)
+        {
+            sharedStrings = true;
+        }
+        else if(strcmp(argv[i], "--no-mmap") == 0)
+        {
+            useMmap = false;
+        }
+        else if(strncmp(argv[i], "--cache=", 8) == 0)
+        {
+            if(!parseCacheMode(argv[i] + 8)) usage();
+        }
+        else if(strncmp(argv[i], "--lex-threads=", 14) == 0)
+        {
+            char* end;
+            long threads = strtol(argv[i] + 14, &end, 10);
+            if(end == argv[i] + 14 || *end != '\0' || threads < 0 || threads > LEX_MAX_THREADS) usage();
+            setLexThreads(&vm, (int)threads);
+        }
+        else if(strncmp(argv[i], "--stack-max=", 12) == 0)
+        {
+            char* end;
+            long values = strtol(argv[i] + 12, &end, 10);
+            // half of INT_MAX at most, the capacity doubles on the way
+            if(end == argv[i] + 12 || *end != '\0' || values < 1 || values > INT_MAX / 2) usage();
+            setStackMax(&vm, (int)values);
+        }
+        else if(strncmp(argv[i], "--jobs=", 7) == 0)
+        {
+            char* end;
+            long count = strtol(argv[i] + 7, &end, 10);
+            if(end == argv[i] + 7 || *end != '\0' || count < 1 || count > BATCH_MAX_JOBS) usage();
+            jobs = (int)count;
+            isBatch = true;
+        }
+        else if(strncmp(argv[i], "--manifest=", 11) == 0)
+        {
+            addManifest(&scripts, argv[i] + 11);
+            isBatch = true;
+        }
+        else if(argv[i][0] != '-')
+        {
+            addPath(&scripts, argv[i]);
+        }
+        else
+        {
+            usage();
+        }
     }
-    else if(argc == 2)
+
+    if(isBatch || scripts.count > 1)
+    {
+        BatchOptions options;
+        options.jobs = jobs;
+        options.optimizationLevel = getOptimizationLevel(&vm);
+        options.lexThreads = vm.lexThreads;
+        options.stackMax = vm.stackMax;
+        options.cacheMode = cacheMode;
+        options.useMmap = useMmap;
+        options.memStats = memStats;
+        options.sharedStrings = sharedStrings;
+
+        int exitCode = runBatch(scripts.paths, scripts.count, &options);
+        free(scripts.paths);
+        freeVM(&vm);
+        return exitCode;
+    }
+
+    // a single VM has no one to share with, but the strings still go
+    // through the table, which is what there is to measure then
+    if(sharedStrings) vm.sharedStrings = newSharedStrings();
+    if(memStats) atexit(printMemoryStatsAtExit);
+
+    if(scripts.count == 0)
     {
-        runFile(argv[1]);
+        repl(&vm);
     }
     else
     {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(&vm, scripts.paths[0]);
     }
+    free(scripts.paths);
     
 
     // Chunk chunk;
@@ -132,7 +276,7 @@ int main(int argc, const char* argv[])
     // writeChunk(&chunk, OP_NEGATE, 3);
     // writeChunk(&chunk, OP_RETURN, 3);
 
-    // disassembleChunk(&chunk, "test chunk");
+    // disassembleChunk(stdout, &chunk, "test chunk");
     
     // interpret(&chunk);
     // freeVM();
@@ -1,41 +1,466 @@
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "common.h"
+#include "compiler.h"
 #include "memory.h"
 #include "vm.h"
 
-void* reallocate(void* previous, size_t oldSize, size_t newSize)
+// Slab allocator
+//
+// Most blocks the VM asks for are tiny : every string object is a header
+// plus a few characters, and every one of them used to be a malloc() of
+// its own. Blocks up to SLAB_MAX_SIZE bytes are instead rounded up to a
+// multiple of SLAB_GRANULE, and every such size class carves its blocks
+// out of page-sized slabs. A freed block goes on the free list of its
+// class and is handed out again by the next allocation of that class.
+//
+// Nothing needs a header per block : reallocate() is always told the size
+// of the block it gets back, and that size alone says which class (or
+// the system allocator) owns it.
+//
+// Reference : https://en.wikipedia.org/wiki/Slab_allocation
+
+static int sizeClassOf(size_t size)
+{
+    return (int)((size - 1) / SLAB_GRANULE);
+}
+
+void initHeap(Heap* heap)
+{
+    memset(heap, 0, sizeof(Heap));
+}
+
+static void* slabAllocate(Heap* heap, size_t size)
+{
+    int index = sizeClassOf(size);
+    SizeClass* sizeClass = &heap->sizeClasses[index];
+    sizeClass->liveBlocks++;
+
+    if (sizeClass->freeList != NULL)
+    {
+        FreeBlock* block = sizeClass->freeList;
+        sizeClass->freeList = block->next;
+        return block;
+    }
+
+    size_t blockSize = (size_t)(index + 1) * SLAB_GRANULE;
+    if (sizeClass->unused == NULL || sizeClass->unusedEnd - sizeClass->unused < (ptrdiff_t)blockSize)
+    {
+        Slab* slab = (Slab*)aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+        if (slab == NULL) exit(1);
+        slab->next = heap->slabs;
+        heap->slabs = slab;
+        heap->slabCount++;
+
+        // the header takes one granule, so the blocks stay aligned
+        sizeClass->unused = (char*)slab + SLAB_GRANULE;
+        sizeClass->unusedEnd = (char*)slab + SLAB_SIZE;
+    }
+
+    void* block = sizeClass->unused;
+    sizeClass->unused += blockSize;
+    return block;
+}
+
+static void slabFree(Heap* heap, void* pointer, size_t size)
+{
+    SizeClass* sizeClass = &heap->sizeClasses[sizeClassOf(size)];
+    FreeBlock* block = (FreeBlock*)pointer;
+    block->next = sizeClass->freeList;
+    sizeClass->freeList = block;
+    sizeClass->liveBlocks--;
+}
+
+void freeSlabs(VM* vm)
+{
+    Heap* heap = &vm->heap;
+    while (heap->slabs != NULL)
+    {
+        Slab* next = heap->slabs->next;
+        free(heap->slabs);
+        heap->slabs = next;
+    }
+    heap->slabCount = 0;
+    memset(heap->sizeClasses, 0, sizeof(heap->sizeClasses));
+}
+
+void getSlabStats(VM* vm, SlabStats* stats)
+{
+    Heap* heap = &vm->heap;
+    stats->slabCount = heap->slabCount;
+    stats->slabBytes = heap->slabCount * SLAB_SIZE;
+    stats->usedBytes = 0;
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+    {
+        stats->usedBytes += heap->sizeClasses[i].liveBlocks * (size_t)(i + 1) * SLAB_GRANULE;
+    }
+}
+
+static void countBytes(MemoryStats* stats, size_t oldSize, size_t newSize)
+{
+    stats->currentBytes = stats->currentBytes - oldSize + newSize;
+    if (stats->currentBytes > stats->peakBytes) stats->peakBytes = stats->currentBytes;
+
+    if (oldSize == 0) stats->allocations++;
+    else if (newSize == 0) stats->frees++;
+    else stats->resizes++;
+}
+
+static void releaseBlock(Heap* heap, void* pointer, size_t size)
+{
+    if (size > 0 && size <= SLAB_MAX_SIZE)
+    {
+        slabFree(heap, pointer, size);
+    }
+    else
+    {
+        free(pointer);
+    }
+}
+
+static void gcStep(VM* vm);
+
+void* reallocate(VM* vm, void* previous, size_t oldSize, size_t newSize, MemoryCategory category)
 {
+    Heap* heap = &vm->heap;
+    if (previous == NULL) oldSize = 0;
+    if (oldSize != newSize)
+    {
+        countBytes(&heap->stats[category], oldSize, newSize);
+        countBytes(&heap->stats[MEM_CATEGORY_COUNT], oldSize, newSize);
+    }
+
+    // every allocation pays for a bounded slice of collection work
+    if (newSize > oldSize) gcStep(vm);
+
+    bool oldInSlab = oldSize > 0 && oldSize <= SLAB_MAX_SIZE;
+    bool newInSlab = newSize > 0 && newSize <= SLAB_MAX_SIZE;
+
     if (newSize == 0)
     {
-        free(previous);
+        if (previous != NULL) releaseBlock(heap, previous, oldSize);
         return NULL;
     }
-    // fallback to C standard realloc
-    return realloc(previous, newSize);
+
+    // fallback to C standard realloc for the large blocks
+    if (!oldInSlab && !newInSlab) return realloc(previous, newSize);
+
+    // still fits the block it already has
+    if (oldInSlab && newInSlab && sizeClassOf(oldSize) == sizeClassOf(newSize)) return previous;
+
+    void* block = newInSlab ? slabAllocate(heap, newSize) : malloc(newSize);
+    if (block == NULL) exit(1);
+
+    if (previous != NULL)
+    {
+        memcpy(block, previous, oldSize < newSize ? oldSize : newSize);
+        releaseBlock(heap, previous, oldSize);
+    }
+
+    return block;
 }
 
-static void freeObject(Obj* object)
+void getMemoryStats(VM* vm, MemoryCategory category, MemoryStats* stats)
+{
+    *stats = vm->heap.stats[category];
+}
+
+const char* memoryCategoryName(MemoryCategory category)
+{
+    switch (category)
+    {
+        case MEM_CODE:      return "code";
+        case MEM_LINES:     return "lines";
+        case MEM_CONSTANTS: return "constants";
+        case MEM_TABLE:     return "table";
+        case MEM_STRINGS:   return "strings";
+        case MEM_IR:        return "ir";
+        case MEM_STACK:     return "stack";
+        case MEM_OTHER:     return "other";
+        default:            return "total";
+    }
+}
+
+void printMemoryStats(VM* vm, FILE* out)
+{
+    fprintf(out, "%-10s %12s %12s %12s %12s %12s\n",
+        "category", "current", "peak", "allocations", "frees", "resizes");
+
+    for (int i = 0; i <= MEM_CATEGORY_COUNT; i++)
+    {
+        MemoryStats* stats = &vm->heap.stats[i];
+        fprintf(out, "%-10s %12zu %12zu %12zu %12zu %12zu\n",
+            memoryCategoryName((MemoryCategory)i), stats->currentBytes, stats->peakBytes,
+            stats->allocations, stats->frees, stats->resizes);
+    }
+
+    SlabStats slab;
+    getSlabStats(vm, &slab);
+    fprintf(out, "slabs      %zu slabs, %zu bytes, %zu bytes in use\n",
+        slab.slabCount, slab.slabBytes, slab.usedBytes);
+
+    GcStats* gc = &vm->gcStats;
+    fprintf(out, "gc         %zu cycles, %zu steps, %zu objects freed, "
+        "pause max %.3f us, mean %.3f us\n",
+        gc->cycles, gc->steps, gc->freedObjects, gc->maxPauseNs / 1e3,
+        gc->steps > 0 ? gc->totalPauseNs / 1e3 / gc->steps : 0.0);
+}
+
+// Garbage collector
+//
+// An incremental tri-color mark and sweep. Instead of stopping the world
+// for a whole collection, each allocation that grows the heap does a
+// bounded step of work (GC_STEP_WORK objects traced or swept), so a pause
+// costs the same no matter how large the heap gets.
+//
+// - white objects are not reached yet, whatever is still white once
+//   marking is over is garbage
+// - gray objects are reached, but the objects they reference are not
+//   traced yet, they wait on vm->grayStack
+// - black objects are reached and traced
+//
+// Rather than clearing every mark when a cycle starts, the meaning of
+// Obj.isMarked flips : an object is black when isMarked equals
+// vm->markValue, so flipping vm->markValue turns all of them white at once.
+//
+// The mutator keeps running between steps, which is sound here because
+// of how objects come to be referenced :
+// - new objects are allocated black, they survive the cycle they are
+//   born in
+// - the constant pools and the IR only ever get new objects or strings
+//   out of the intern table, which internBarrier() marks
+// - the VM stack is scanned again, in full, before marking ends
+// So everything reachable when the cycle started, or since, is marked.
+//
+// vm->strings is weak : it does not keep strings alive. Sweeping a string
+// deletes its entry before freeing it.
+//
+// Pauses are bounded by the step size plus the root scan when a cycle
+// starts, which is the stack and the constants of the live chunk.
+//
+// Reference : http://www.craftinginterpreters.com/garbage-collection.html
+// Reference : https://en.wikipedia.org/wiki/Tracing_garbage_collection#Tri-color_marking
+
+// A cycle starts once the object heap doubled since the end of the last
+// one. Only objects count : tables, chunks and the like are not freed by a
+// collection, and counting them lets a big intern table (it has to hold
+// every string allocated between two cycles) push the next cycle further
+// away, which makes the table bigger still.
+#define GC_HEAP_GROW_FACTOR (2)
+#define GC_HEAP_MIN (1024 * 1024)
+#define GC_STEP_WORK (64)
+
+static void freeObject(VM* vm, Obj* object);
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void markObject(VM* vm, Obj* object)
+{
+    // a shared string is marked by no one, it is not swept either
+    if (object == NULL || object->isShared || object->isMarked == vm->markValue) return;
+    object->isMarked = vm->markValue;
+
+    if (vm->grayCapacity < vm->grayCount + 1)
+    {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        // straight to the system allocator, growing the gray stack through
+        // reallocate() could start another step in the middle of this one
+        vm->grayStack = (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
+        if (vm->grayStack == NULL) exit(1);
+    }
+
+    vm->grayStack[vm->grayCount++] = object;
+}
+
+void markValue(VM* vm, Value value)
+{
+    if (IS_OBJ(value)) markObject(vm, AS_OBJ(value));
+}
+
+void internBarrier(VM* vm, Obj* object)
+{
+    // Only strings come out of the intern table, and they reference no
+    // other object, so this is safe in the sweep phase too : the string
+    // is not swept yet (it would have left the table), and marking it
+    // black is all it takes to keep it.
+    if (vm->gcPhase != GC_IDLE) markObject(vm, object);
+}
+
+static void blackenObject(VM* vm, Obj* object)
+{
+    switch (object->type)
+    {
+        case OBJ_STRING:
+            // no references to trace
+            break;
+        case OBJ_ROPE:
+        {
+            // the children are NULL once flattened, markObject() skips them
+            ObjRope* rope = (ObjRope*)object;
+            markObject(vm, rope->left);
+            markObject(vm, rope->right);
+            markObject(vm, (Obj*)rope->flat);
+            break;
+        }
+    }
+}
+
+static void markStack(VM* vm)
+{
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++)
+    {
+        markValue(vm, *slot);
+    }
+}
+
+static void markRoots(VM* vm)
+{
+    markStack(vm);
+
+    if (vm->chunk != NULL)
+    {
+        for (int i = 0; i < vm->chunk->constants.count; i++)
+        {
+            markValue(vm, vm->chunk->constants.values[i]);
+        }
+    }
+
+    markCompilerRoots(vm);
+}
+
+static void startCycle(VM* vm)
+{
+    vm->markValue = !vm->markValue;
+    vm->gcPhase = GC_MARK;
+    vm->gcStats.cycles++;
+
+    markRoots(vm);
+}
+
+static void markStep(VM* vm, int work)
+{
+    while (work-- > 0 && vm->grayCount > 0)
+    {
+        blackenObject(vm, vm->grayStack[--vm->grayCount]);
+    }
+    if (vm->grayCount > 0) return;
+
+    // the stack changed without us watching, everything on it now must
+    // be marked too before we can call it done
+    markStack(vm);
+    if (vm->grayCount > 0) return;
+
+    vm->gcPhase = GC_SWEEP;
+    vm->sweep = &vm->objects;
+}
+
+static void sweepStep(VM* vm, int work)
+{
+    while (work-- > 0 && *vm->sweep != NULL)
+    {
+        Obj* object = *vm->sweep;
+        if (object->isMarked == vm->markValue)
+        {
+            vm->sweep = &object->next;
+            continue;
+        }
+
+        *vm->sweep = object->next;
+        // the intern table is weak, forget the string before it is gone
+        if (object->type == OBJ_STRING)
+        {
+            internRemove(vm, &vm->strings, (ObjString*)object);
+        }
+        freeObject(vm, object);
+        vm->gcStats.freedObjects++;
+    }
+    if (*vm->sweep != NULL) return;
+
+    vm->gcPhase = GC_IDLE;
+    vm->sweep = NULL;
+    vm->nextGC = vm->heap.stats[MEM_STRINGS].currentBytes * GC_HEAP_GROW_FACTOR;
+    if (vm->nextGC < GC_HEAP_MIN) vm->nextGC = GC_HEAP_MIN;
+}
+
+static void gcWork(VM* vm, int work)
+{
+    switch (vm->gcPhase)
+    {
+        case GC_IDLE:  startCycle(vm); break;
+        case GC_MARK:  markStep(vm, work); break;
+        case GC_SWEEP: sweepStep(vm, work); break;
+    }
+}
+
+static void gcStep(VM* vm)
+{
+#ifdef DEBUG_STRESS_GC
+    // keep a cycle running at all times, one object per step, so that a
+    // missing root shows up right away
+    int work = 1;
+#else
+    if (vm->gcPhase == GC_IDLE && vm->heap.stats[MEM_STRINGS].currentBytes < vm->nextGC) return;
+    int work = GC_STEP_WORK;
+#endif
+
+    uint64_t start = nowNs();
+    gcWork(vm, work);
+    uint64_t pause = nowNs() - start;
+
+    vm->gcStats.steps++;
+    vm->gcStats.totalPauseNs += pause;
+    if (pause > vm->gcStats.maxPauseNs) vm->gcStats.maxPauseNs = pause;
+}
+
+void collectGarbage(VM* vm)
+{
+    if (vm->gcPhase == GC_IDLE) startCycle(vm);
+    while (vm->gcPhase != GC_IDLE)
+    {
+        gcWork(vm, INT32_MAX);
+    }
+}
+
+static void freeObject(VM* vm, Obj* object)
 {
     switch (object->type)
     {
         case OBJ_STRING:
         {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            // chars is a flexible array member, it lives in the same block
+            // as the header, so there is nothing else to free
+            reallocate(vm, object, sizeof(ObjString) + string->length + 1, 0, MEM_STRINGS);
             break;
         }
+        case OBJ_ROPE:
+            FREE(vm, ObjRope, object, MEM_STRINGS);
+            break;
     }
 }
 
-void freeObjects()
-{         
-    Obj* object = vm.objects;
+void freeObjects(VM* vm)
+{
+    Obj* object = vm->objects;
     while (object != NULL)
     {
         Obj* next = object->next;
-        freeObject(object);
+        freeObject(vm, object);
         object = next;
     }
+    vm->objects = NULL;
+
+    free(vm->grayStack);
+    vm->grayStack = NULL;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->gcPhase = GC_IDLE;
+    vm->sweep = NULL;
 }
\ No newline at end of file
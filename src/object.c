@@ -1,48 +1,148 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
 #include "object.h"
-#include "table.h"
+#include "intern.h"
+#include "shared.h"
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocateObject(vm, sizeof(type), objectType)
 
-#define ALLOCATE_OBJ_SIZE(type, size, objectType) \
-    (type*)allocateObject(size, objectType)
-
-static Obj* allocateObject(size_t size, ObjType type)
-{    
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+// link a freshly allocated object into the heap
+static void initObject(VM* vm, Obj* object, ObjType type)
+{
     object->type = type;
+    // allocated black, an object born during a collection survives it
+    object->isMarked = vm->markValue;
+    object->isShared = false;
     // add the allocated object to the obejct list for GC tracking
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = vm->objects;
+    vm->objects = object;
+}
+
+static Obj* allocateObject(VM* vm, size_t size, ObjType type)
+{    
+    Obj* object = (Obj*)reallocate(vm, NULL, 0, size, MEM_STRINGS);
+    initObject(vm, object, type);
     //
     return object;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash)
+#if defined(FNV_HASH) || !defined(__SIZEOF_INT128__)
+
+uint32_t hashString(const char* key, int length)
 {
-    // ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    // string->length = length;
-    // string->chars = chars;
-    // 
-    // above : invalid use of flexible array member
-    //
-    // Reference : https://stackoverflow.com/questions/35423293/flexible-array-member-not-getting-copied-when-i-make-a-shallow-copy-of-a-struct
-    // to fix this, manually assign the element or copy the memory explicitly
+    // Reference :
+    // https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function#FNV-1a_hash
     //
-    ObjString* string = ALLOCATE_OBJ_SIZE(ObjString, 
-        sizeof(ObjString) + length * sizeof(char) , OBJ_STRING);
-    string->length = length;
-    memcpy(string->chars, chars, length);
+    // FNV-1a hashing
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash ^= key[i];
+        // 32 bit FNV_prime = 16777619
+        // if 64 bit, use 1099511628211
+        hash *= 16777619;
+    }
+
+    return hash;
+}
 
+#else
+
+// Eight bytes per step instead of one : every word of the string is mixed
+// in with a 64 x 64 -> 128 bit multiply, whose two halves folded together
+// depend on every bit of both operands. The final mix spreads the result
+// over the 32 bits kept, the low ones pick the control byte and the high
+// ones the group (group.h), so both ends have to be good.
+//
+// Reference : https://github.com/wangyi-fudan/wyhash, the same mixing
+// with fewer rounds, interned strings are mostly short.
+
+#define HASH_SEED (0xa0761d6478bd642full)
+#define HASH_PRIME (0xe7037ed1a0b428dbull)
+
+static inline uint64_t mixWords(uint64_t a, uint64_t b)
+{
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+// memcpy is how C reads a word at any alignment, it compiles to a plain load
+static inline uint64_t readWord(const char* bytes)
+{
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static inline uint64_t readHalfWord(const char* bytes)
+{
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+// the last 1 to 8 bytes, without reading a byte past them : two reads that
+// overlap when there are less than 8, or a few single bytes below 4
+static inline uint64_t readTail(const char* bytes, int length)
+{
+    if (length == 8) return readWord(bytes);
+    if (length >= 4) return readHalfWord(bytes) << 32 | readHalfWord(bytes + length - 4);
+
+    const uint8_t* tail = (const uint8_t*)bytes;
+    return (uint64_t)tail[0] << 16 | (uint64_t)tail[length / 2] << 8 | tail[length - 1];
+}
+
+uint32_t hashString(const char* key, int length)
+{
+    // the length goes in first, "ab" and "ab\0" read the same tail
+    uint64_t hash = HASH_SEED ^ ((uint64_t)length * HASH_PRIME);
+
+    int left = length;
+    if (left > 32)
+    {
+        // two independent chains, the multiplies of one run while the
+        // other waits for its result
+        uint64_t other = hash ^ HASH_PRIME;
+        for (; left > 16; left -= 16, key += 16)
+        {
+            hash = mixWords(hash ^ readWord(key), HASH_PRIME);
+            other = mixWords(other ^ readWord(key + 8), HASH_SEED);
+        }
+        hash ^= other;
+    }
+    for (; left > 8; left -= 8, key += 8)
+    {
+        hash = mixWords(hash ^ readWord(key), HASH_PRIME);
+    }
+    if (left > 0) hash = mixWords(hash ^ readTail(key, left), HASH_PRIME);
+
+    hash = mixWords(hash, HASH_SEED);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+#endif
+
+// the size of the single block holding an ObjString and its characters,
+// one more char for the terminator, printObject() relies on it
+static size_t stringSize(int length)
+{
+    return sizeof(ObjString) + (length + 1) * sizeof(char);
+}
+
+// Turn a finished reservation into a real, interned string object
+static ObjString* internString(VM* vm, ObjString* string, uint32_t hash)
+{
     string->hash = hash;
+    initObject(vm, (Obj*)string, OBJ_STRING);
 
-    // Use the hash-table as a hash-set, where only key matters
+    // A hash-set, where only key matters
     // This is basically a unordered_set in C++
     //
     // Reference : https://www.geeksforgeeks.org/unordered_set-in-cpp-stl/
@@ -51,70 +151,277 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash)
     // hashed into indices of a hash table so that the insertion is always 
     // randomized.
 
-    tableSet(&vm.strings, string, NIL_VAL);
+    // growing the set may run the collector, and the string is not
+    // referenced from anywhere yet
+    push(vm, OBJ_VAL(string));
+    internAdd(vm, &vm->strings, string);
+    pop(vm);
 
     return string;
 }
 
-static uint32_t hashString(const char* key, int length)
+ObjString* reserveString(VM* vm, int length)
 {
-    // Reference :
-    // https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function#FNV-1a_hash
-    //
-    // FNV-1a hashing
-    uint32_t hash = 2166136261u;
+    // Reference : https://en.wikipedia.org/wiki/Flexible_array_member
+    // the characters live in the same block as the header, and the caller
+    // writes them there directly, there is no buffer to copy from
+    ObjString* string = (ObjString*)reallocate(vm, NULL, 0, stringSize(length), MEM_STRINGS);
+    string->length = length;
+    string->chars[length] = '\0';
+    return string;
+}
 
-    for (size_t i = 0; i < length; ++i)
+ObjString* finishString(VM* vm, ObjString* string)
+{
+    uint32_t hash = hashString(string->chars, string->length);
+
+    // If it is interned already, the reservation is not needed after all.
+    // It is not an object yet, nothing but us knows about it, giving the
+    // block back is all it takes.
+    ObjString* interned = internFind(vm, &vm->strings, string->chars, string->length, hash);
+    if (interned != NULL)
     {
-        hash ^= key[i];
-        // 32 bit FNV_prime = 16777619
-        // if 64 bit, use 1099511628211
-        hash *= 16777619;
+        reallocate(vm, string, stringSize(string->length), 0, MEM_STRINGS);
+        internBarrier(vm, (Obj*)interned);
+        return interned;
     }
 
-    return hash;
+    // a string the VM made itself stays in its own set, unless another VM
+    // shared it already
+    if (vm->sharedStrings != NULL)
+    {
+        interned = sharedFind(vm->sharedStrings, string->chars, string->length, hash);
+        if (interned != NULL)
+        {
+            reallocate(vm, string, stringSize(string->length), 0, MEM_STRINGS);
+            return interned;
+        }
+    }
+
+    return internString(vm, string, hash);
 }
 
-ObjString* takeString(char* chars, int length)
+ObjString* copyString(VM* vm, const char* chars, int length)
 {
     uint32_t hash = hashString(chars, length);
 
-    // If we find it, before we return it, 
-    // we free the memory for the string that was passed in. 
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    // Check if this string is interned yet, 
+    // if so, simply return the interned string;
+    // instead of “copying”, we just return a reference to that string
+    ObjString* interned = internFind(vm, &vm->strings, chars, length, hash);
     if (interned != NULL)
     {
-        FREE_ARRAY(char, chars, length + 1);
+        internBarrier(vm, (Obj*)interned);
         return interned;
     }
 
-    // from an allocated c-string, allocate a lox-string
-    return allocateString(chars, length, hash);
+    // Not ours, most likely a literal, and the same in every VM running
+    // the same code. The own set is looked at first all the same : a VM
+    // that has a string of its own must keep using that one.
+    if (vm->sharedStrings != NULL) return sharedIntern(vm->sharedStrings, chars, length, hash);
+
+    // the hash is known already, skip finishString() and its second lookup
+    ObjString* string = reserveString(vm, length);
+    memcpy(string->chars, chars, length);
+    return internString(vm, string, hash);
 }
 
-ObjString* copyString(const char* chars, int length)
+// how many lookups ahead copyStrings() prefetches, see bench/intern_bench
+#define INTERN_PREFETCH_DISTANCE (16)
+
+void copyStrings(VM* vm, const StringRef* strings, int count, ObjString** results)
 {
-    uint32_t hash = hashString(chars, length);
+    if (count == 0) return;
 
-    // Check if this string is interned yet, 
-    // if so, simply return the interned string;
-    // instead of “copying”, we just return a reference to that string
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) return interned;
+    // Everything that does not depend on the set first : hash every
+    // string. Growing the set ahead for all of them would be a guess, most
+    // sources repeat their literals, and a set sized for every one of them
+    // is slower to probe than one grown as needed.
+    uint32_t* hashes = ALLOCATE(vm, uint32_t, count, MEM_OTHER);
+    for (int i = 0; i < count; i++)
+    {
+        hashes[i] = hashString(strings[i].chars, strings[i].length);
+    }
+
+    // Then look them up in order, with the groups of the lookups a few
+    // strings ahead already on their way into the cache. Done in order, a
+    // string that appears twice is found the second time.
+    for (int i = 0; i < count; i++)
+    {
+        if (i + INTERN_PREFETCH_DISTANCE < count)
+        {
+            internPrefetch(&vm->strings, hashes[i + INTERN_PREFETCH_DISTANCE]);
+        }
+
+        const char* chars = strings[i].chars;
+        int length = strings[i].length;
+
+        ObjString* interned = internFind(vm, &vm->strings, chars, length, hashes[i]);
+        if (interned != NULL)
+        {
+            internBarrier(vm, (Obj*)interned);
+            results[i] = interned;
+            continue;
+        }
+
+        if (vm->sharedStrings != NULL)
+        {
+            results[i] = sharedIntern(vm->sharedStrings, chars, length, hashes[i]);
+            continue;
+        }
+
+        ObjString* string = reserveString(vm, length);
+        memcpy(string->chars, chars, length);
+        results[i] = internString(vm, string, hashes[i]);
+    }
+
+    FREE_ARRAY(vm, uint32_t, hashes, count, MEM_OTHER);
+}
+
+// a flattened rope stands for its string, only unflattened ones are kept
+// as children of a new node
+static Obj* resolveRope(Obj* object)
+{
+    if (object->type == OBJ_ROPE && ((ObjRope*)object)->flat != NULL)
+    {
+        return (Obj*)((ObjRope*)object)->flat;
+    }
+    return object;
+}
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
+static int textLength(Obj* object)
+{
+    return object->type == OBJ_STRING
+        ? ((ObjString*)object)->length
+        : ((ObjRope*)object)->length;
+}
+
+Obj* concatenateStrings(VM* vm, Obj* a, Obj* b)
+{
+    a = resolveRope(a);
+    b = resolveRope(b);
+    int length = textLength(a) + textLength(b);
 
-    return allocateString(heapChars, length, hash);
+    // Short results are copied, ropes are never shorter than this, so both
+    // operands are plain strings here
+    if (length < ROPE_MIN_LENGTH)
+    {
+        ObjString* left = (ObjString*)a;
+        ObjString* right = (ObjString*)b;
+
+        ObjString* string = reserveString(vm, length);
+        memcpy(string->chars, left->chars, left->length);
+        memcpy(string->chars + left->length, right->chars, right->length);
+        return (Obj*)finishString(vm, string);
+    }
+
+    ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = a;
+    rope->right = b;
+    rope->flat = NULL;
+    return (Obj*)rope;
 }
 
-void printObject(Value value)
+ObjString* flattenRope(VM* vm, ObjRope* rope)
+{
+    if (rope->flat != NULL) return rope->flat;
+
+    ObjString* string = reserveString(vm, rope->length);
+    char* chars = string->chars;
+
+    // Fill the buffer back to front with an explicit stack of nodes, the
+    // right child is popped (and copied) before the left one. A chain built
+    // left to right ("a + b + c") only ever has a couple of nodes on it, one
+    // nested the other way round can be as deep as the rope itself, which
+    // is why this is not recursive.
+    int count = 0;
+    int capacity = 16;
+    Obj** stack = (Obj**)malloc(sizeof(Obj*) * capacity);
+    if (stack == NULL) exit(1);
+
+    int end = rope->length;
+    stack[count++] = (Obj*)rope;
+    while (count > 0)
+    {
+        Obj* node = resolveRope(stack[--count]);
+        if (node->type == OBJ_STRING)
+        {
+            ObjString* string = (ObjString*)node;
+            end -= string->length;
+            memcpy(chars + end, string->chars, string->length);
+            continue;
+        }
+
+        if (capacity < count + 2)
+        {
+            capacity = GROW_CAPACITY(capacity);
+            stack = (Obj**)realloc(stack, sizeof(Obj*) * capacity);
+            if (stack == NULL) exit(1);
+        }
+        stack[count++] = ((ObjRope*)node)->left;
+        stack[count++] = ((ObjRope*)node)->right;
+    }
+    free(stack);
+
+    // The rope may already be black when this runs in the middle of a
+    // cycle. That needs no extra barrier : the string is either new, and
+    // so allocated black, or an interned one finishString() just marked.
+    rope->flat = finishString(vm, string);
+    // the children are not needed any more, let them go
+    rope->left = NULL;
+    rope->right = NULL;
+    return rope->flat;
+}
+
+// Prints the pieces in order, without flattening : that would allocate, and
+// printing has no VM to allocate from. The same explicit stack as above, the
+// left child is popped (and printed) first.
+static void printRope(FILE* out, ObjRope* rope)
+{
+    if (rope->flat != NULL)
+    {
+        fprintf(out, "%s", rope->flat->chars);
+        return;
+    }
+
+    int count = 0;
+    int capacity = 16;
+    Obj** stack = (Obj**)malloc(sizeof(Obj*) * capacity);
+    if (stack == NULL) exit(1);
+
+    stack[count++] = (Obj*)rope;
+    while (count > 0)
+    {
+        Obj* node = resolveRope(stack[--count]);
+        if (node->type == OBJ_STRING)
+        {
+            ObjString* string = (ObjString*)node;
+            fwrite(string->chars, sizeof(char), string->length, out);
+            continue;
+        }
+
+        if (capacity < count + 2)
+        {
+            capacity = GROW_CAPACITY(capacity);
+            stack = (Obj**)realloc(stack, sizeof(Obj*) * capacity);
+            if (stack == NULL) exit(1);
+        }
+        stack[count++] = ((ObjRope*)node)->right;
+        stack[count++] = ((ObjRope*)node)->left;
+    }
+    free(stack);
+}
+
+void printObject(FILE* out, Value value)
 {
     switch (OBJ_TYPE(value))
     {
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            fprintf(out, "%s", AS_CSTRING(value));
+            break;
+        case OBJ_ROPE:
+            printRope(out, AS_ROPE(value));
             break;
     }
 }
\ No newline at end of file
@@ -0,0 +1,126 @@
+#include "chunk.h"
+#include "memory.h"
+#include "peephole.h"
+
+// The pass walks the finished chunk once and copies it into a fresh code
+// array, replacing pairs of instructions with a single superinstruction.
+// Every fused pair saves one dispatch, and for the *_CONST forms also one
+// push/pop round trip through the stack.
+//
+// Rewriting pairs blindly is only sound because the bytecode has no jumps
+// yet. Once it does, a pair must not be fused across a jump target and the
+// jump offsets have to be relocated.
+
+// Walks the RLE line table alongside the code. Offsets handed to lineAt()
+// never decrease, so the cursor only ever moves forward and the whole pass
+// stays linear, where getLine() would be a binary search per instruction.
+typedef struct
+{
+    LineRecordList* list;
+    int record;
+} LineCursor;
+
+static void initLineCursor(LineCursor* cursor, LineRecordList* list)
+{
+    cursor->list = list;
+    cursor->record = 0;
+}
+
+static int lineAt(LineCursor* cursor, int offset)
+{
+    while (cursor->record + 1 < cursor->list->count &&
+           cursor->list->lineRecords[cursor->record + 1].startOffset <= offset)
+    {
+        cursor->record++;
+    }
+
+    return cursor->list->lineRecords[cursor->record].lineNumber;
+}
+
+// returns the superinstruction for "first second", or -1 if there is none
+static int fusedOpcode(uint8_t first, uint8_t second)
+{
+    if (second == OP_NOT)
+    {
+        // a != b is compiled as !(a == b), a >= b as !(a < b) and so on
+        switch (first)
+        {
+            case OP_EQUAL:   return OP_NOT_EQUAL;
+            case OP_LESS:    return OP_GREATER_EQUAL;
+            case OP_GREATER: return OP_LESS_EQUAL;
+            default:         return -1;
+        }
+    }
+
+    // the constant is always the right hand side operand, it was pushed
+    // last, right before the operator pops both
+    if (first == OP_CONSTANT)
+    {
+        switch (second)
+        {
+            case OP_ADD:      return OP_ADD_CONST;
+            case OP_SUBTRACT: return OP_SUBTRACT_CONST;
+            case OP_MULTIPLY: return OP_MULTIPLY_CONST;
+            case OP_DIVIDE:   return OP_DIVIDE_CONST;
+            default:          return -1;
+        }
+    }
+
+    return -1;
+}
+
+void peepholeOptimize(VM* vm, Chunk* chunk)
+{
+    if (chunk->count == 0) return;
+
+    // only code and lines are rebuilt, the constants stay where they are
+    Chunk optimized;
+    initChunk(&optimized);
+
+    LineCursor cursor;
+    initLineCursor(&cursor, &chunk->lineRecordList);
+
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        uint8_t instruction = chunk->code[offset];
+        int length = instructionLength(instruction);
+        int next = offset + length;
+
+        int fused = next < chunk->count ?
+            fusedOpcode(instruction, chunk->code[next]) : -1;
+
+        if (fused != -1)
+        {
+            // The superinstruction takes the line of the instruction its
+            // runtime errors come from : the comparison for the *_NOT
+            // forms (OP_NOT never fails), the operator for the *_CONST
+            // ones (a constant load never fails).
+            int line = lineAt(&cursor, instruction == OP_CONSTANT ? next : offset);
+            writeChunk(vm, &optimized, (uint8_t)fused, line);
+            // keep the operand of the first instruction, if any
+            for (int i = 1; i < length; i++)
+            {
+                writeChunk(vm, &optimized, chunk->code[offset + i], line);
+            }
+
+            offset = next + instructionLength(chunk->code[next]);
+            continue;
+        }
+
+        int line = lineAt(&cursor, offset);
+        for (int i = 0; i < length; i++)
+        {
+            writeChunk(vm, &optimized, chunk->code[offset + i], line);
+        }
+        offset = next;
+    }
+
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity, MEM_CODE);
+    FREE_ARRAY(vm, LineRecord, chunk->lineRecordList.lineRecords, chunk->lineRecordList.capacity, MEM_LINES);
+
+    chunk->code = optimized.code;
+    chunk->count = optimized.count;
+    chunk->capacity = optimized.capacity;
+    chunk->lineRecordList = optimized.lineRecordList;
+}
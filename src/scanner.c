@@ -4,20 +4,94 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct
+// Fast paths for the long runs of characters : blanks, comments, string
+// literals and identifiers are scanned a chunk of SCAN_CHUNK bytes at a
+// time, with one compare per character class over the whole chunk and a
+// bit mask per class out of it. The last bytes, less than a chunk, and
+// builds without SSE2 (or with SCALAR_SCANNER) go through the loops that
+// look at one character at a time.
+//
+// Every chunk is loaded from at most 'end' - SCAN_CHUNK, the source may be
+// a mapping of the file that ends right there.
+#if !defined(SCALAR_SCANNER) && defined(__AVX2__)
+#include <immintrin.h>
+
+#define SCAN_CHUNK (32)
+typedef __m256i Chunk;
+
+static inline Chunk loadChunk(const char* bytes)
+{
+    return _mm256_loadu_si256((const __m256i*)bytes);
+}
+
+// bit i set when byte i is 'c'
+static inline uint32_t matchChar(Chunk chunk, char c)
+{
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(c)));
+}
+
+// bit i set when byte i is within [low, high], bytes above 0x7F never are
+static inline uint32_t matchRange(Chunk chunk, char low, char high)
+{
+    __m256i above = _mm256_cmpgt_epi8(chunk, _mm256_set1_epi8((char)(low - 1)));
+    __m256i below = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(high + 1)), chunk);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(above, below));
+}
+
+// 'A' to 'Z' and 'a' to 'z' are 0x20 apart, setting that bit folds the
+// first range onto the second (and nothing else onto either)
+static inline Chunk foldCase(Chunk chunk)
+{
+    return _mm256_or_si256(chunk, _mm256_set1_epi8(0x20));
+}
+
+#elif !defined(SCALAR_SCANNER) && defined(__SSE2__)
+#include <emmintrin.h>
+
+#define SCAN_CHUNK (16)
+typedef __m128i Chunk;
+
+static inline Chunk loadChunk(const char* bytes)
 {
-    const char* start;
-    const char* current;
-    int line;
-} Scanner;
+    return _mm_loadu_si128((const __m128i*)bytes);
+}
+
+static inline uint32_t matchChar(Chunk chunk, char c)
+{
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)));
+}
 
-Scanner scanner;
+static inline uint32_t matchRange(Chunk chunk, char low, char high)
+{
+    __m128i above = _mm_cmpgt_epi8(chunk, _mm_set1_epi8((char)(low - 1)));
+    __m128i below = _mm_cmpgt_epi8(_mm_set1_epi8((char)(high + 1)), chunk);
+    return (uint32_t)_mm_movemask_epi8(_mm_and_si128(above, below));
+}
 
-void initScanner(const char* source)
+static inline Chunk foldCase(Chunk chunk)
 {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    return _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+}
+
+#endif
+
+#ifdef SCAN_CHUNK
+// a bit for every byte of a chunk
+#define CHUNK_MASK ((uint32_t)((1ull << SCAN_CHUNK) - 1))
+
+// the bits of a mask below bit 'count'
+static inline uint32_t bitsBelow(int count)
+{
+    return (uint32_t)((1ull << count) - 1);
+}
+#endif
+
+void initScanner(Scanner* scanner, const char* source, size_t length)
+{
+    scanner->start = source;
+    scanner->current = source;
+    scanner->end = source + length;
+    scanner->line = 1;
 }
 
 static bool isDigit(char c)
@@ -32,82 +106,140 @@ static bool isAlpha(char c)
             c == '_';
 }
 
-static bool isAtEnd()
+static bool isAtEnd(Scanner* scanner)
 {
-    return *scanner.current == '\0';
+    return scanner->current >= scanner->end;
 }
 
-static char advance()
+static char advance(Scanner* scanner)
 {
-    scanner.current++;
-    return scanner.current[-1];
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static char peek()
+// Both peeks still hand out a '\0' past the end, so the loops below can go
+// on testing characters without checking isAtEnd() first.
+static char peek(Scanner* scanner)
 {
-    return *scanner.current;
+    if(isAtEnd(scanner)) return '\0';
+    return *scanner->current;
 }
 
-static char peekNext()
+static char peekNext(Scanner* scanner)
 {
-    if(isAtEnd()) return '\0';
-    return scanner.current[1];
+    if(scanner->current + 1 >= scanner->end) return '\0';
+    return scanner->current[1];
 }
 
-static bool match(char expected)
+static bool match(Scanner* scanner, char expected)
 {
-    if(isAtEnd()) return false;
-    if(*scanner.current != expected) return false;
+    if(isAtEnd(scanner)) return false;
+    if(*scanner->current != expected) return false;
 
-    scanner.current++;
+    scanner->current++;
     return true;
 }
 
-static Token makeToken(TokenType type)
+static Token makeToken(Scanner* scanner, TokenType type)
 {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
 
     return token;
 }
 
-static Token errorToken(const char* message)
+static Token errorToken(Scanner* scanner, const char* message)
 {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
 
     return token;
 }
 
-static void skipWhiteSpace()
+// a run of spaces, tabs, carriage returns and newlines
+static void skipBlanks(Scanner* scanner)
 {
+#ifdef SCAN_CHUNK
+    while (scanner->end - scanner->current >= SCAN_CHUNK)
+    {
+        Chunk chunk = loadChunk(scanner->current);
+        uint32_t newlines = matchChar(chunk, '\n');
+        uint32_t blanks = newlines | matchChar(chunk, ' ') |
+            matchChar(chunk, '\t') | matchChar(chunk, '\r');
+
+        uint32_t others = ~blanks & CHUNK_MASK;
+        int run = others != 0 ? __builtin_ctz(others) : SCAN_CHUNK;
+        if (newlines != 0) scanner->line += __builtin_popcount(newlines & bitsBelow(run));
+        scanner->current += run;
+        if (others != 0) return;
+    }
+#endif
+
     for(;;)
     {
-        char c = peek();
-        switch(c)
+        switch(peek(scanner))
         {
             case ' ':
             case '\r':
             case '\t':
-                advance();
+                advance(scanner);
                 break;
 
             case '\n':
-                scanner.line++;
-                advance();
+                scanner->line++;
+                advance(scanner);
+                break;
+
+            default:
+                return;
+        }
+    }
+}
+
+// up to the newline ending a comment, or the end of the source
+static void skipComment(Scanner* scanner)
+{
+#ifdef SCAN_CHUNK
+    while (scanner->end - scanner->current >= SCAN_CHUNK)
+    {
+        uint32_t newlines = matchChar(loadChunk(scanner->current), '\n');
+        if (newlines != 0)
+        {
+            scanner->current += __builtin_ctz(newlines);
+            return;
+        }
+        scanner->current += SCAN_CHUNK;
+    }
+#endif
+
+    while (peek(scanner) != '\n' && !isAtEnd(scanner)) advance(scanner);
+}
+
+static void skipWhiteSpace(Scanner* scanner)
+{
+    for(;;)
+    {
+        char c = peek(scanner);
+        switch(c)
+        {
+            case ' ':
+            case '\r':
+            case '\t':
+            case '\n':
+                skipBlanks(scanner);
                 break;
 
             case '/':
-                if( peekNext() == '/' )
+                if( peekNext(scanner) == '/' )
                 {
                     // A comment goes until the end of the line.
-                    while (peek() != '\n' && !isAtEnd()) advance();
+                    skipComment(scanner);
                 }
                 else
                 {
@@ -121,142 +253,317 @@ static void skipWhiteSpace()
     }
 }
 
-static TokenType checkKeyword(int start, int length, 
-    const char* rest, TokenType type)
+// Keywords, found with a minimal perfect hash : the length, first and last
+// character of an identifier pick one of KEYWORD_SLOTS slots, each holding
+// one keyword, and a single compare with that keyword settles it.
+//
+// Reference : https://en.wikipedia.org/wiki/Perfect_hash_function
+//
+// The slot is the top bits of the three packed into a word and multiplied
+// by KEYWORD_MULTIPLIER, an odd constant that happens to give every keyword
+// a slot of its own. A new keyword is a new line in 'keywords' below; if
+// two keywords land in the same slot the table does not compile (the
+// pragma makes initializing an entry twice an error), then trying random
+// multipliers until they all get a slot of their own finds a new one
+// quickly. Past 16 keywords, KEYWORD_BITS goes up by one.
+#define KEYWORD_BITS (4)
+#define KEYWORD_SLOTS (1 << KEYWORD_BITS)
+#define KEYWORD_MULTIPLIER (0xc4e84e6bu)
+
+#define KEYWORD_SLOT(first, last, length) \
+    ((((uint32_t)(uint8_t)(first) | (uint32_t)(uint8_t)(last) << 8 | \
+       (uint32_t)(length) << 16) * KEYWORD_MULTIPLIER) >> (32 - KEYWORD_BITS))
+
+// the shortest and longest keyword
+#define KEYWORD_MIN_LENGTH (2)
+#define KEYWORD_MAX_LENGTH (6)
+
+typedef struct
+{
+    // zero padded, compared as one word
+    char chars[8];
+    int length;
+    TokenType type;
+} Keyword;
+
+// A keyword is spelled out one character at a time, the length and the
+// first and last character are all taken from that one list. They could
+// not come from a string : indexing a string literal is no constant
+// expression, so it cannot pick the slot of a designated initializer.
+#define KEYWORD_FIRST(first, ...) first
+#define KEYWORD_LENGTH(...) KEYWORD_LENGTH_(__VA_ARGS__, 6, 5, 4, 3, 2, 1)
+#define KEYWORD_LENGTH_(c1, c2, c3, c4, c5, c6, length, ...) length
+// the argument at position KEYWORD_LENGTH(), expanded before it is pasted
+#define KEYWORD_LAST(...) KEYWORD_LAST_(KEYWORD_LENGTH(__VA_ARGS__), __VA_ARGS__)
+#define KEYWORD_LAST_(length, ...) KEYWORD_LAST_AT(length, __VA_ARGS__)
+#define KEYWORD_LAST_AT(length, ...) KEYWORD_LAST_##length(__VA_ARGS__)
+#define KEYWORD_LAST_2(c1, c2) c2
+#define KEYWORD_LAST_3(c1, c2, c3) c3
+#define KEYWORD_LAST_4(c1, c2, c3, c4) c4
+#define KEYWORD_LAST_5(c1, c2, c3, c4, c5) c5
+#define KEYWORD_LAST_6(c1, c2, c3, c4, c5, c6) c6
+
+#define KEYWORD(type, ...) \
+    [KEYWORD_SLOT(KEYWORD_FIRST(__VA_ARGS__), KEYWORD_LAST(__VA_ARGS__), KEYWORD_LENGTH(__VA_ARGS__))] = \
+        { { __VA_ARGS__ }, KEYWORD_LENGTH(__VA_ARGS__), type }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+static const Keyword keywords[KEYWORD_SLOTS] =
+{
+    KEYWORD(TOKEN_AND,    'a', 'n', 'd'),
+    KEYWORD(TOKEN_CLASS,  'c', 'l', 'a', 's', 's'),
+    KEYWORD(TOKEN_ELSE,   'e', 'l', 's', 'e'),
+    KEYWORD(TOKEN_FALSE,  'f', 'a', 'l', 's', 'e'),
+    KEYWORD(TOKEN_FOR,    'f', 'o', 'r'),
+    KEYWORD(TOKEN_FUN,    'f', 'u', 'n'),
+    KEYWORD(TOKEN_IF,     'i', 'f'),
+    KEYWORD(TOKEN_NIL,    'n', 'i', 'l'),
+    KEYWORD(TOKEN_OR,     'o', 'r'),
+    KEYWORD(TOKEN_PRINT,  'p', 'r', 'i', 'n', 't'),
+    KEYWORD(TOKEN_RETURN, 'r', 'e', 't', 'u', 'r', 'n'),
+    KEYWORD(TOKEN_SUPER,  's', 'u', 'p', 'e', 'r'),
+    KEYWORD(TOKEN_THIS,   't', 'h', 'i', 's'),
+    KEYWORD(TOKEN_TRUE,   't', 'r', 'u', 'e'),
+    KEYWORD(TOKEN_VAR,    'v', 'a', 'r'),
+    KEYWORD(TOKEN_WHILE,  'w', 'h', 'i', 'l', 'e'),
+};
+#pragma GCC diagnostic pop
+
+static inline uint64_t readWord(const char* bytes)
+{
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+// The identifier against the zero padded keyword, as one 8 byte word with
+// the bytes past the identifier masked off. Near the end of the source a
+// word would read past it, there the compare is a plain memcmp().
+static bool isKeyword(Scanner* scanner, const Keyword* keyword, int length)
 {
-    if(scanner.current - scanner.start == start + length &&
-       memcmp(scanner.start + start, rest, length) == 0)
+    // 'length' bytes of ones followed by zeros, whatever the byte order
+    static const uint8_t ones[16] =
+    {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    };
+
+    if (scanner->end - scanner->start < 8)
     {
-        return type;
+        return keyword->length == length && memcmp(keyword->chars, scanner->start, length) == 0;
     }
 
-    return TOKEN_IDENTIFIER;
+    uint64_t word = readWord(scanner->start) & readWord((const char*)ones + 8 - length);
+    return (word == readWord(keyword->chars)) & (keyword->length == length);
 }
 
-static TokenType identifierType()
+static TokenType identifierType(Scanner* scanner)
 {
-    switch(scanner.start[0])
-    {
-        // easy keywords with no branching
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-        // branching keywords
-        case 'f':
-            if (scanner.current - scanner.start > 1)
-            {
-                switch (scanner.start[1])
-                {
-                case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-                }
-            }
-            break;
-        case 't':
-            if (scanner.current - scanner.start > 1)
-            {
-                switch (scanner.start[1])
-                {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            }
-            break;
-    }
+    int length = (int)(scanner->current - scanner->start);
+    if (length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH) return TOKEN_IDENTIFIER;
 
-    return TOKEN_IDENTIFIER;
+    const Keyword* keyword =
+        &keywords[KEYWORD_SLOT(scanner->start[0], scanner->start[length - 1], length)];
+    return isKeyword(scanner, keyword, length) ? keyword->type : TOKEN_IDENTIFIER;
 }
 
-static Token identifier()
+static Token identifier(Scanner* scanner)
 {
-    while(isAlpha(peek()) || isDigit(peek())) advance();
+#ifdef SCAN_CHUNK
+    while (scanner->end - scanner->current >= SCAN_CHUNK)
+    {
+        Chunk chunk = loadChunk(scanner->current);
+        uint32_t word = matchRange(foldCase(chunk), 'a', 'z') | matchRange(chunk, '0', '9') |
+            matchChar(chunk, '_');
 
-    return makeToken(identifierType());
+        uint32_t others = ~word & CHUNK_MASK;
+        if (others != 0)
+        {
+            scanner->current += __builtin_ctz(others);
+            return makeToken(scanner, identifierType(scanner));
+        }
+        scanner->current += SCAN_CHUNK;
+    }
+#endif
+
+    while(isAlpha(peek(scanner)) || isDigit(peek(scanner))) advance(scanner);
+
+    return makeToken(scanner, identifierType(scanner));
 }
 
-static Token number()
+static Token number(Scanner* scanner)
 {
-    while(isDigit(peek())) advance();
+    while(isDigit(peek(scanner))) advance(scanner);
 
     // look for a fractional part
-    if(peek() == '.' && isDigit(peekNext()))
+    if(peek(scanner) == '.' && isDigit(peekNext(scanner)))
     {
         // consume the '.' character
-        advance();
+        advance(scanner);
 
-        while(isDigit(peek())) advance();
+        while(isDigit(peek(scanner))) advance(scanner);
     }
 
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static Token string()
+// up to the closing quote of a string literal, or the end of the source
+static void skipString(Scanner* scanner)
 {
-    while(peek() != '"' && !isAtEnd())
+#ifdef SCAN_CHUNK
+    while (scanner->end - scanner->current >= SCAN_CHUNK)
+    {
+        Chunk chunk = loadChunk(scanner->current);
+        uint32_t quotes = matchChar(chunk, '"');
+        uint32_t newlines = matchChar(chunk, '\n');
+
+        int run = quotes != 0 ? __builtin_ctz(quotes) : SCAN_CHUNK;
+        if (newlines != 0) scanner->line += __builtin_popcount(newlines & bitsBelow(run));
+        scanner->current += run;
+        // the closing quote is left to the loop below
+        if (quotes != 0) break;
+    }
+#endif
+
+    while(peek(scanner) != '"' && !isAtEnd(scanner))
     {
-        if(peek() == '\n') scanner.line++;
-        advance();
+        if(peek(scanner) == '\n') scanner->line++;
+        advance(scanner);
     }
+}
+
+static Token string(Scanner* scanner)
+{
+    skipString(scanner);
 
-    if(isAtEnd()) return errorToken("Unterminated string.");
+    if(isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
     // the closing quote
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
-Token scanToken()
+Token scanToken(Scanner* scanner)
 {
-    skipWhiteSpace();
+    skipWhiteSpace(scanner);
 
-    scanner.start = scanner.current;
+    scanner->start = scanner->current;
 
-    if(isAtEnd() == true)
+    if(isAtEnd(scanner) == true)
     {
-        return makeToken(TOKEN_EOF);
+        return makeToken(scanner, TOKEN_EOF);
     }
 
-    char next_character = advance();
+    char next_character = advance(scanner);
 
-    if(isAlpha(next_character)) return identifier();
-    if(isDigit(next_character)) return number();
+    if(isAlpha(next_character)) return identifier(scanner);
+    if(isDigit(next_character)) return number(scanner);
 
     switch (next_character)
     {
-        case '(': return makeToken(TOKEN_LEFT_PAREN);
-        case ')': return makeToken(TOKEN_RIGHT_PAREN);
-        case '{': return makeToken(TOKEN_LEFT_BRACE);
-        case '}': return makeToken(TOKEN_RIGHT_BRACE);
-        case ';': return makeToken(TOKEN_SEMICOLON);
-        case ',': return makeToken(TOKEN_COMMA);
-        case '.': return makeToken(TOKEN_DOT);
-        case '-': return makeToken(TOKEN_MINUS);
-        case '+': return makeToken(TOKEN_PLUS);
-        case '/': return makeToken(TOKEN_SLASH);
-        case '*': return makeToken(TOKEN_STAR);
+        case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+        case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+        case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+        case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+        case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+        case ',': return makeToken(scanner, TOKEN_COMMA);
+        case '.': return makeToken(scanner, TOKEN_DOT);
+        case '-': return makeToken(scanner, TOKEN_MINUS);
+        case '+': return makeToken(scanner, TOKEN_PLUS);
+        case '/': return makeToken(scanner, TOKEN_SLASH);
+        case '*': return makeToken(scanner, TOKEN_STAR);
 
         case '!':
-            return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
         case '=':
-            return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
         case '<':
-            return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
         case '>':
-            return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
 
         case '"':
-            return string();
+            return string(scanner);
+    }
+
+    return errorToken(scanner, "Unexpected character.");
+}
+
+// up to the next character that may start a string, a comment or a new
+// line, or the end of the source
+static void skipCode(Scanner* scanner)
+{
+#ifdef SCAN_CHUNK
+    while (scanner->end - scanner->current >= SCAN_CHUNK)
+    {
+        Chunk chunk = loadChunk(scanner->current);
+        uint32_t stops = matchChar(chunk, '"') | matchChar(chunk, '/') | matchChar(chunk, '\n');
+        if (stops != 0)
+        {
+            scanner->current += __builtin_ctz(stops);
+            return;
+        }
+        scanner->current += SCAN_CHUNK;
     }
+#endif
 
-    return errorToken("Unexpected character.");
+    while (!isAtEnd(scanner) && peek(scanner) != '"' && peek(scanner) != '/' && peek(scanner) != '\n') advance(scanner);
 }
 
+int splitSource(const char* source, size_t length, int count, SourcePiece* pieces)
+{
+    Scanner splitter;
+    Scanner* scanner = &splitter;
+    initScanner(scanner, source, length);
+    pieces[0].start = source;
+    pieces[0].line = 1;
+    int pieceCount = 1;
+
+    // Only strings and comments matter : no other token holds a '"', a
+    // "//" or a newline, and only outside of both does a '"' start a
+    // string and a "//" a comment, exactly as in scanToken().
+    while (pieceCount < count && !isAtEnd(scanner))
+    {
+        const char* target = source + length / count * pieceCount;
+
+        skipCode(scanner);
+        switch (peek(scanner))
+        {
+            case '"':
+                advance(scanner);
+                skipString(scanner);
+                if (!isAtEnd(scanner)) advance(scanner);
+                break;
+
+            case '/':
+                if (peekNext(scanner) == '/')
+                {
+                    skipComment(scanner);
+                }
+                else
+                {
+                    advance(scanner);
+                }
+                break;
+
+            case '\n':
+                advance(scanner);
+                scanner->line++;
+                // far enough for the next piece to start after this newline
+                if (scanner->current > target && !isAtEnd(scanner))
+                {
+                    pieces[pieceCount].start = scanner->current;
+                    pieces[pieceCount].line = scanner->line;
+                    pieceCount++;
+                }
+                break;
+        }
+    }
+
+    for (int i = 0; i < pieceCount; i++)
+    {
+        const char* end = i + 1 < pieceCount ? pieces[i + 1].start : source + length;
+        pieces[i].length = (size_t)(end - pieces[i].start);
+    }
+    return pieceCount;
+}
@@ -0,0 +1,226 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "object.h"
+#include "shared.h"
+
+// 64 shards, picked by the top 6 bits of the hash, the slot in a shard by
+// the low bits
+#define SHARED_SHARD_BITS (6)
+#define SHARED_SHARD_COUNT (1 << SHARED_SHARD_BITS)
+
+// Linear probing, a lookup ends at the first empty slot. Slots are only
+// pointers, keeping them at most half full is cheap.
+#define SHARED_MAX_LOAD (0.5)
+#define SHARED_MIN_CAPACITY (64)
+
+// The slots of a shard. A grown array replaces the current one, the old
+// one stays on the 'retired' list : a lookup may still be reading it.
+typedef struct sSharedArray
+{
+    struct sSharedArray* retired;
+    int capacity;
+    _Atomic(ObjString*) slots[];
+} SharedArray;
+
+// a cache line each, the shards are locked and filled independently
+typedef struct
+{
+    _Alignas(64) _Atomic(SharedArray*) array;
+    pthread_mutex_t lock;
+    // under 'lock'
+    int count;
+    size_t stringBytes;
+} SharedShard;
+
+struct sSharedStrings
+{
+    SharedShard shards[SHARED_SHARD_COUNT];
+};
+
+static void* allocateShared(size_t size)
+{
+    void* block = malloc(size);
+    if (block == NULL)
+    {
+        fprintf(stderr, "Not enough memory for the shared strings. \n");
+        exit(74);
+    }
+    return block;
+}
+
+static SharedArray* newArray(int capacity)
+{
+    SharedArray* array = (SharedArray*)allocateShared(sizeof(SharedArray) + sizeof(ObjString*) * capacity);
+    array->retired = NULL;
+    array->capacity = capacity;
+    for (int i = 0; i < capacity; i++) atomic_init(&array->slots[i], NULL);
+    return array;
+}
+
+static SharedShard* shardOf(SharedStrings* shared, uint32_t hash)
+{
+    return &shared->shards[hash >> (32 - SHARED_SHARD_BITS)];
+}
+
+SharedStrings* newSharedStrings()
+{
+    SharedStrings* shared = (SharedStrings*)allocateShared(sizeof(SharedStrings));
+    for (int i = 0; i < SHARED_SHARD_COUNT; i++)
+    {
+        SharedShard* shard = &shared->shards[i];
+        atomic_init(&shard->array, newArray(SHARED_MIN_CAPACITY));
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->count = 0;
+        shard->stringBytes = 0;
+    }
+    return shared;
+}
+
+void freeSharedStrings(SharedStrings* shared)
+{
+    for (int i = 0; i < SHARED_SHARD_COUNT; i++)
+    {
+        SharedShard* shard = &shared->shards[i];
+        SharedArray* array = atomic_load_explicit(&shard->array, memory_order_relaxed);
+
+        // every string is in the current array, the retired ones only
+        // hold copies of some of the pointers
+        for (int slot = 0; slot < array->capacity; slot++)
+        {
+            free(atomic_load_explicit(&array->slots[slot], memory_order_relaxed));
+        }
+        while (array != NULL)
+        {
+            SharedArray* retired = array->retired;
+            free(array);
+            array = retired;
+        }
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(shared);
+}
+
+// The lookup both sharedFind() and sharedIntern() start with, no lock. The
+// acquire load of a slot pairs with the release store that published the
+// string in it, a string seen is a string whole.
+static ObjString* findInArray(SharedArray* array, const char* chars, int length, uint32_t hash)
+{
+    uint32_t mask = (uint32_t)array->capacity - 1;
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask)
+    {
+        ObjString* string = atomic_load_explicit(&array->slots[index], memory_order_acquire);
+        if (string == NULL) return NULL;
+
+        if (string->hash == hash && string->length == length &&
+            memcmp(string->chars, chars, length) == 0)
+        {
+            return string;
+        }
+    }
+}
+
+ObjString* sharedFind(SharedStrings* shared, const char* chars, int length, uint32_t hash)
+{
+    SharedShard* shard = shardOf(shared, hash);
+    SharedArray* array = atomic_load_explicit(&shard->array, memory_order_acquire);
+    return findInArray(array, chars, length, hash);
+}
+
+// puts 'string' in the first free slot of its probe, an array is only
+// ever written under the lock of its shard
+static void insertSlot(SharedArray* array, ObjString* string)
+{
+    uint32_t mask = (uint32_t)array->capacity - 1;
+    uint32_t index = string->hash & mask;
+    while (atomic_load_explicit(&array->slots[index], memory_order_relaxed) != NULL)
+    {
+        index = (index + 1) & mask;
+    }
+    atomic_store_explicit(&array->slots[index], string, memory_order_release);
+}
+
+// Called with the lock held. The new array is filled before it is
+// published, a lookup sees either array whole.
+static SharedArray* growShard(SharedShard* shard, SharedArray* array)
+{
+    SharedArray* grown = newArray(array->capacity * 2);
+    for (int i = 0; i < array->capacity; i++)
+    {
+        ObjString* string = atomic_load_explicit(&array->slots[i], memory_order_relaxed);
+        if (string != NULL) insertSlot(grown, string);
+    }
+    grown->retired = array;
+    atomic_store_explicit(&shard->array, grown, memory_order_release);
+    return grown;
+}
+
+// a string object of no VM, see Obj.isShared
+static ObjString* newSharedString(const char* chars, int length, uint32_t hash)
+{
+    ObjString* string = (ObjString*)allocateShared(sizeof(ObjString) + length + 1);
+    string->obj.type = OBJ_STRING;
+    string->obj.isMarked = false;
+    string->obj.isShared = true;
+    string->obj.next = NULL;
+    string->length = length;
+    string->hash = hash;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    return string;
+}
+
+ObjString* sharedIntern(SharedStrings* shared, const char* chars, int length, uint32_t hash)
+{
+    ObjString* string = sharedFind(shared, chars, length, hash);
+    if (string != NULL) return string;
+
+    SharedShard* shard = shardOf(shared, hash);
+    pthread_mutex_lock(&shard->lock);
+
+    // another thread may have added it since the lookup above
+    SharedArray* array = atomic_load_explicit(&shard->array, memory_order_relaxed);
+    string = findInArray(array, chars, length, hash);
+    if (string == NULL)
+    {
+        if (shard->count + 1 > array->capacity * SHARED_MAX_LOAD) array = growShard(shard, array);
+
+        string = newSharedString(chars, length, hash);
+        insertSlot(array, string);
+        shard->count++;
+        shard->stringBytes += sizeof(ObjString) + length + 1;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return string;
+}
+
+void getSharedStringStats(SharedStrings* shared, SharedStringStats* stats)
+{
+    memset(stats, 0, sizeof(SharedStringStats));
+    stats->tableBytes = sizeof(SharedStrings);
+
+    for (int i = 0; i < SHARED_SHARD_COUNT; i++)
+    {
+        SharedShard* shard = &shared->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->strings += shard->count;
+        stats->stringBytes += shard->stringBytes;
+        SharedArray* array = atomic_load_explicit(&shard->array, memory_order_relaxed);
+        for (; array != NULL; array = array->retired)
+        {
+            stats->tableBytes += sizeof(SharedArray) + sizeof(ObjString*) * array->capacity;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void printSharedStringStats(SharedStrings* shared, FILE* out)
+{
+    SharedStringStats stats;
+    getSharedStringStats(shared, &stats);
+    fprintf(out, "shared     %zu strings, %zu bytes of strings, %zu bytes of table\n",
+        stats.strings, stats.stringBytes, stats.tableBytes);
+}
@@ -0,0 +1,161 @@
+// madvise() is not part of C11, ask glibc for it explicitly
+#define _DEFAULT_SOURCE
+
+#include "source.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char* allocateSource(const char* path, char* buffer, size_t size)
+{
+    buffer = (char*)realloc(buffer, size);
+    // memory allocation failed
+    if(buffer == NULL)
+    {
+        fprintf(stderr, "Not enough memory to read \"%s\". \n", path);
+        exit(74);
+    }
+    return buffer;
+}
+
+// Pipes, terminals and the like have no size to seek to, read them until
+// the end in growing blocks.
+static char* readStream(FILE* file, const char* path, size_t* length)
+{
+    size_t capacity = 4096;
+    size_t count = 0;
+    char* buffer = allocateSource(path, NULL, capacity);
+    for(;;)
+    {
+        count += fread(buffer + count, sizeof(char), capacity - count, file);
+        if(count < capacity) break;
+        capacity *= 2;
+        buffer = allocateSource(path, buffer, capacity);
+    }
+
+    if(ferror(file))
+    {
+        free(buffer);
+        return NULL;
+    }
+    *length = count;
+    return buffer;
+}
+
+// returns NULL when the file cannot be opened or read
+static char* readFile(const char* path, size_t* length)
+{
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) return NULL;
+
+    struct stat info;
+    if(fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        char* buffer = readStream(file, path, length);
+        fclose(file);
+        return buffer;
+    }
+
+    size_t fileSize = (size_t)info.st_size;
+    char* buffer = allocateSource(path, NULL, fileSize + 1);
+    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    if (bytesRead < fileSize)
+    {
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+    buffer[bytesRead] = '\0';
+    *length = bytesRead;
+
+    fclose(file);
+    return buffer;
+
+    /**
+     *  Extra info :
+     *  
+     *  "
+     *  Actually, the calls to fseek(), ftell(), 
+     *  and rewind() could theoretically fail too,
+     *  but let’s not go too far off in the weeds, shall we?
+     * 
+     *  Even good old printf() can fail. 
+     *  Yup. How many times have you handled that error?
+     *  "
+     * 
+     *  As Bob Nystrom mentioned in the book, printf() it self could fail too.
+     *  I was wondering when will that ever happen, and found this.
+     *  
+     *  Reference : 
+     *  https://silviocesare.wordpress.com/2007/10/20/when-can-a-printf-fail/
+     *  
+     *  "It can fail when the program output is being redirected to the disk, and the disk becomes full."
+     */
+}
+
+// returns NULL when the file is not something mmap can handle, the caller
+// then falls back to readFile(), which also finds out when it cannot be
+// opened at all
+static const char* mapFile(const char* path, size_t* length)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    struct stat info;
+    // pipes and the like have no size to map, and mmap refuses
+    // zero-length mappings
+    if(fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void* mapping = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping keeps the file alive on its own
+    close(fd);
+    if(mapping == MAP_FAILED) return NULL;
+
+    // The scanner reads the file exactly once, front to back. This lets the
+    // kernel read ahead aggressively and drop pages once we are past them.
+    madvise(mapping, (size_t)info.st_size, MADV_SEQUENTIAL);
+
+    *length = (size_t)info.st_size;
+    return (const char*)mapping;
+}
+
+bool loadSource(SourceFile* source, const char* path, bool useMmap)
+{
+    source->isMapped = false;
+
+    if(useMmap)
+    {
+        source->chars = mapFile(path, &source->length);
+        if(source->chars != NULL)
+        {
+            source->isMapped = true;
+            return true;
+        }
+    }
+
+    source->chars = readFile(path, &source->length);
+    return source->chars != NULL;
+}
+
+void freeSource(SourceFile* source)
+{
+    if(source->isMapped)
+    {
+        munmap((void*)source->chars, source->length);
+    }
+    else
+    {
+        free((char*)source->chars);
+    }
+
+    source->chars = NULL;
+    source->length = 0;
+}
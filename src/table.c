@@ -1,181 +1,135 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "group.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-// use parenthesis to group the constant value, just to avoid any shenanigans
-#define TABLE_MAX_LOAD (0.75)
+static uint32_t entryHash(const void* slot)
+{
+    return ((const Entry*)slot)->key->hash;
+}
+
+static const GroupLayout entryLayout = { sizeof(Entry), entryHash };
 
 void initTable(Table* table)
 {
-    table->count = 0;
-    table->capacity = 0;
-    table->entries = NULL;
+    initGroups(&table->groups);
 }
 
-void freeTable(Table* table)
+void freeTable(VM* vm, Table* table)
 {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    initTable(table);
+    freeGroups(vm, &table->groups, &entryLayout);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
-{            
-    uint32_t index = key->hash % capacity;
-    Entry* tombstone = NULL;
-
-    for (;;)
-    {
-        Entry* entry = &entries[index];
-
-        // since the hash table grows when nearly full, 
-        // this can never result in an infinite loop, since there
-        // will always be an empty entry.
-
-        // if (entry->key == key || entry->key == NULL)
-        // {
-        //     return entry;
-        // }
-
-        if (entry->key == NULL)
-        {
-            if (IS_NIL(entry->value))
-            {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else // entry->value == BOOL_VAL(true)
-            {
-                // We found a tombstone.
-                if (tombstone == NULL) tombstone = entry;
-            }
-        }
-        else if (entry->key == key)
-        {
-            // We found the key.
-            return entry;
-        }
-
-        // linear probing
-        index = (index + 1) % capacity;
-    }
+static bool matchesKey(const void* slot, const void* key)
+{
+    return ((const Entry*)slot)->key == key;
 }
 
-static void adjustCapacity(Table* table, int capacity)
+// the entry for 'key' in either the new or the old arrays, NULL when there
+// is none
+static Entry* findEntry(Table* table, ObjString* key)
 {
-    Entry* entries = ALLOCATE(Entry, capacity);
-
-    for (size_t i = 0; i < capacity; ++i)
-    {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
-
-    table->count = 0;
-    // re-inserting every entry in the original hash table to the new one
-    for (int i = 0; i < table->capacity; i++)
-    {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
-
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
-    }
-
-    // free the old array / hash table
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    GroupSlot found = findGroups(&table->groups, &entryLayout, key->hash, matchesKey, key);
+    return found.index >= 0 ? foundSlot(&table->groups, &entryLayout, found) : NULL;
 }
 
-bool tableGet(Table* table, ObjString* key, Value* value)
+bool tableGet(VM* vm, Table* table, ObjString* key, Value* value)
 {
-    if (table->count == 0) return false;
+    stepResize(vm, &table->groups, &entryLayout);
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    Entry* entry = findEntry(table, key);
+    if (entry == NULL) return false;
 
     *value = entry->value;
     return true;
 }
 
-bool tableSet(Table* table, ObjString* key, Value value)
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value)
 {
-    if(table->count + 1 > table->capacity * TABLE_MAX_LOAD)
+    stepResize(vm, &table->groups, &entryLayout);
+
+    Entry* entry = findEntry(table, key);
+    if (entry != NULL)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        entry->value = value;
+        return false;
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-
-    bool isNewKey = (entry->key == NULL);
-    // if entry->key == NULL and value is not null, it is a tombstone
-    // which will be considered a full bucket when computing load factor
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
-
+    int slot = claimGroupSlot(vm, &table->groups, &entryLayout, key->hash);
+    entry = slotAt(table->groups.slots, &entryLayout, slot);
     entry->key = key;
     entry->value = value;
     // returns true if a new key is added
-    return isNewKey;
+    return true;
 }
 
-void tableAddAll(Table* from, Table* to)
+void tableAddAll(VM* vm, Table* from, Table* to)
 {   
-    for (int i = 0; i < from->capacity; i++)
+    Groups* groups = &from->groups;
+    for (int i = 0; i < groups->capacity; i++)
     {
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL)
+        if (isFullControl(groups->control[i]))
         {
-            tableSet(to, entry->key, entry->value);
+            Entry* entry = slotAt(groups->slots, &entryLayout, i);
+            tableSet(vm, to, entry->key, entry->value);
+        }
+    }
+
+    // and what has not moved yet
+    for (int i = groups->migrated; i < groups->oldCapacity; i++)
+    {
+        if (isFullControl(groups->oldControl[i]))
+        {
+            Entry* entry = slotAt(groups->oldSlots, &entryLayout, i);
+            tableSet(vm, to, entry->key, entry->value);
         }
     }
 }
 
-bool tableDelete(Table* table, ObjString* key)
+bool tableDelete(VM* vm, Table* table, ObjString* key)
 {
-    if (table->count == 0) return false;
+    stepResize(vm, &table->groups, &entryLayout);
 
     // Find the entry.
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    GroupSlot found = findGroups(&table->groups, &entryLayout, key->hash, matchesKey, key);
+    if (found.index < 0) return false;
 
     // Place a tombstone in the entry.
+    removeGroupSlot(&table->groups, found);
+    Entry* entry = foundSlot(&table->groups, &entryLayout, found);
     entry->key = NULL;
-    entry->value = BOOL_VAL(true);
-
+    entry->value = NIL_VAL;
     return true;
 }
 
-ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash)
+// the characters tableFindString() is after
+typedef struct
 {
-    if (table->count == 0) return NULL;
+    const char* chars;
+    int length;
+    uint32_t hash;
+} StringKey;
 
-    uint32_t index = hash % table->capacity;
+static bool matchesString(const void* slot, const void* key)
+{
+    ObjString* string = ((const Entry*)slot)->key;
+    const StringKey* wanted = key;
+    return string->hash == wanted->hash && string->length == wanted->length &&
+        memcmp(string->chars, wanted->chars, wanted->length) == 0;
+}
 
-    for (;;)
-    {
-        Entry* entry = &table->entries[index];
+ObjString* tableFindString(VM* vm, Table* table, const char* chars, int length, uint32_t hash)
+{
+    stepResize(vm, &table->groups, &entryLayout);
 
-        if (entry->key == NULL)
-        {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
-        }
-        else if (
-            entry->key->length == length &&
-            entry->key->hash == hash &&
-            memcmp(entry->key->chars, chars, length) == 0)
-        {
-            // We found it.
-            return entry->key;
-        }
+    StringKey key = { chars, length, hash };
+    GroupSlot found = findGroups(&table->groups, &entryLayout, hash, matchesString, &key);
+    if (found.index < 0) return NULL;
 
-        index = (index + 1) % table->capacity;
-    }
-}
\ No newline at end of file
+    // We found it.
+    return ((Entry*)foundSlot(&table->groups, &entryLayout, found))->key;
+}
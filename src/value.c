@@ -12,40 +12,69 @@ void initValueArray(ValueArray* array)
     array->count = 0;
 }
 
-void writeValueArray(ValueArray* array, Value value)
+void writeValueArray(VM* vm, ValueArray* array, Value value)
 {
     if(array->capacity < array->count + 1)
     {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(array->values, Value, oldCapacity, array->capacity);
+        array->values = GROW_ARRAY(vm, array->values, Value, oldCapacity, array->capacity, MEM_CONSTANTS);
     }
     array->values[array->count] = value;
     array->count++;
 }
 
-void freeValueArray(ValueArray* array)
+void freeValueArray(VM* vm, ValueArray* array)
 {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    FREE_ARRAY(vm, Value, array->values, array->capacity, MEM_CONSTANTS);
     initValueArray(array);
 }
 
-void printValue(Value value)
+void printValue(FILE* out, Value value)
 {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value))
+    {
+        fprintf(out, AS_BOOL(value) ? "true" : "false");
+    }
+    else if (IS_NIL(value))
+    {
+        fprintf(out, "nil");
+    }
+    else if (IS_NUMBER(value))
+    {
+        fprintf(out, "%g", AS_NUMBER(value));
+    }
+    else if (IS_OBJ(value))
+    {
+        printObject(out, value);
+    }
+#else
     switch (value.type)
     {
-        case VAL_BOOL:   printf(AS_BOOL(value) ? "true" : "false"); break;
-        case VAL_NIL:    printf("nil"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-        case VAL_OBJ:    printObject(value); break;
+        case VAL_BOOL:   fprintf(out, AS_BOOL(value) ? "true" : "false"); break;
+        case VAL_NIL:    fprintf(out, "nil"); break;
+        case VAL_NUMBER: fprintf(out, "%g", AS_NUMBER(value)); break;
+        case VAL_OBJ:    printObject(out, value); break;
 
         default:
-            printf("printValue not covering value type : %d \n", value.type);
+            fprintf(out, "printValue not covering value type : %d \n", value.type);
     }
+#endif
 }
 
 bool valuesEqual(Value a, Value b)
 {
+#ifdef NAN_BOXING
+    // NaN is not equal to itself, so numbers can't be compared bitwise.
+    // Everything else is a singleton tag or an interned object pointer,
+    // comparing the raw bits is enough.
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return a == b;
+#else
     if (a.type != b.type) return false;
 
     switch (a.type)
@@ -71,4 +100,48 @@ bool valuesEqual(Value a, Value b)
     }
 
     return false; // unreachable
+#endif
+}
+
+// the raw bits of a value, numbers included, without the padding of the
+// tagged union
+static uint64_t valueBits(Value value)
+{
+#ifdef NAN_BOXING
+    return value;
+#else
+    uint64_t bits = 0;
+    switch (value.type)
+    {
+        case VAL_BOOL:   bits = AS_BOOL(value); break;
+        case VAL_NIL:    bits = 0; break;
+        case VAL_NUMBER: memcpy(&bits, &value.as.number, sizeof(double)); break;
+        case VAL_OBJ:    bits = (uint64_t)(uintptr_t)AS_OBJ(value); break;
+    }
+    return bits;
+#endif
+}
+
+bool valuesIdentical(Value a, Value b)
+{
+#ifndef NAN_BOXING
+    if (a.type != b.type) return false;
+#endif
+    return valueBits(a) == valueBits(b);
+}
+
+uint32_t hashValue(Value value)
+{
+    uint64_t bits = valueBits(value);
+#ifndef NAN_BOXING
+    bits ^= (uint64_t)value.type << 61;
+#endif
+    // Reference : https://nullprogram.com/blog/2018/07/31/
+    // a 64-bit integer finalizer, every input bit affects every output bit
+    bits ^= bits >> 32;
+    bits *= 0xd6e8feb86659fd93u;
+    bits ^= bits >> 32;
+    bits *= 0xd6e8feb86659fd93u;
+    bits ^= bits >> 32;
+    return (uint32_t)bits;
 }
\ No newline at end of file
@@ -11,74 +11,140 @@
 #include "memory.h"
 #include "value.h"
 
-// a damned global variable
-VM vm;
-
 int getLine(Chunk* chunk, int offset)
 {
-    int offsetLeft = offset;
-    for(int lineRecordIndex = 0; lineRecordIndex < chunk->lineRecordList.count; lineRecordIndex++)
+    LineRecordList* list = &chunk->lineRecordList;
+    if(list->count == 0 || offset < list->lineRecords[0].startOffset || offset >= chunk->count)
     {
-        if(chunk->lineRecordList.lineRecords[lineRecordIndex].offsetPerLine > offsetLeft)
+        return -1;
+    }
+
+    // binary search for the last run starting at or before 'offset'
+    int low = 0;
+    int high = list->count - 1;
+    while(low < high)
+    {
+        // round up, so that 'low = middle' always makes progress
+        int middle = low + (high - low + 1) / 2;
+        if(list->lineRecords[middle].startOffset <= offset)
         {
-            return chunk->lineRecordList.lineRecords[lineRecordIndex].lineNumber;
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
         }
-        offsetLeft -= chunk->lineRecordList.lineRecords[lineRecordIndex].offsetPerLine;
     }
 
-    printf("Error : getLine returns -1 \n");
-    return -1;
+    return list->lineRecords[low].lineNumber;
 }
 
-static void resetStack()
+static void resetStack(VM* vm)
 {
-    vm.stackTop = vm.stack;
+    vm->stackTop = vm->stack;
 }
 
-static void runtimeError(const char* format, ...)
+static void runtimeError(VM* vm, const char* format, ...)
 {
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm->err, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", vm->err);
+
+    // ip already moved past the opcode (and maybe some operands), step back
+    // by one so that we stay inside the failing instruction
+    size_t instructionOffset = vm->ip - vm->chunk->code - 1;
+    // int line = vm->chunk->lines[instruction];
+    int line = getLine(vm->chunk, instructionOffset);
+    fprintf(vm->err, "[line %d] in script\n", line);
+
+    resetStack(vm);
+}
 
-    size_t instructionOffset = vm.ip - vm.chunk->code;
-    // int line = vm.chunk->lines[instruction];
-    int line = getLine(vm.chunk, instructionOffset);
-    fprintf(stderr, "[line %d] in script\n", line);
+void initVM(VM* vm)
+{
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+    vm->stackMax = STACK_DEFAULT_MAX;
+    resetStack(vm);
+    vm->chunk = NULL;
+    vm->objects = NULL;
+    initHeap(&vm->heap);
+    initInternSet(&vm->strings);
+
+    vm->gcPhase = GC_IDLE;
+    vm->markValue = false;
+    // the object heap size at which the first collection starts
+    vm->nextGC = 1024 * 1024;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+    vm->sweep = NULL;
+    memset(&vm->gcStats, 0, sizeof(GcStats));
+
+    vm->compiler = NULL;
+    vm->optimizationLevel = 1;
+    vm->lexThreads = 0;
+
+    vm->out = stdout;
+    vm->err = stderr;
+    vm->sharedStrings = NULL;
+
+    // last, the allocation needs the collector state above
+    reserveStack(vm, STACK_INITIAL);
+}
 
-    resetStack();
+void freeVM(VM* vm)
+{
+    freeInternSet(vm, &vm->strings);
+    freeObjects(vm);
+    FREE_ARRAY(vm, Value, vm->stack, vm->stackCapacity, MEM_STACK);
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+    // the chunks and the compiler are long gone, nothing uses a slab now
+    freeSlabs(vm);
 }
 
-void initVM()
+void push(VM* vm, Value value)
 {
-    resetStack();
-    vm.objects = NULL;
-    initTable(&vm.strings);
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
-void freeVM()
+Value pop(VM* vm)
 {
-    freeTable(&vm.strings);
-    freeObjects();
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
-void push(Value value)
+bool reserveStack(VM* vm, int slots)
 {
-    *vm.stackTop = value;
-    vm.stackTop++;
+    int needed = (int)(vm->stackTop - vm->stack) + slots;
+    if (needed > vm->stackMax) return false;
+    if (needed <= vm->stackCapacity) return true;
+
+    int capacity = vm->stackCapacity;
+    while (capacity < needed) capacity = GROW_CAPACITY(capacity);
+    if (capacity > vm->stackMax) capacity = vm->stackMax;
+
+    // The collector may run before the block moves and marks the values
+    // still in the old one, the copy keeps them.
+    int count = (int)(vm->stackTop - vm->stack);
+    vm->stack = GROW_ARRAY(vm, vm->stack, Value, vm->stackCapacity, capacity, MEM_STACK);
+    vm->stackCapacity = capacity;
+    vm->stackTop = vm->stack + count;
+    return true;
 }
 
-Value pop()
+void setStackMax(VM* vm, int stackMax)
 {
-    vm.stackTop--;
-    return *vm.stackTop;
+    vm->stackMax = stackMax;
 }
 
-static Value peek(int distance)
+static Value peek(VM* vm, int distance)
 {
-    return vm.stackTop[-1 - distance];
+    return vm->stackTop[-1 - distance];
 }
 
 static bool isFalsey(Value value)
@@ -88,94 +154,189 @@ static bool isFalsey(Value value)
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate()
+static void concatenate(VM* vm)
 {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
-
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    // the operands stay on the stack until the result is made, the
+    // allocations below may run the collector and the stack is its root
+    Obj* b = AS_OBJ(peek(vm, 0));
+    Obj* a = AS_OBJ(peek(vm, 1));
+
+    // a rope most of the time, nothing is copied until it is flattened
+    Obj* result = concatenateStrings(vm, a, b);
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(result));
+}
 
-    ObjString* result = takeString(chars, length);
-    push(OBJ_VAL(result));
+// Replace a rope on the stack by its flat string, where the characters are
+// needed. It stays on the stack while it is flattened, which may collect.
+static void flattenOperand(VM* vm, int distance)
+{
+    Value value = peek(vm, distance);
+    if (IS_ROPE(value))
+    {
+        vm->stackTop[-1 - distance] = OBJ_VAL(flattenRope(vm, AS_ROPE(value)));
+    }
 }
 
-static InterpretResult run()
+static InterpretResult run(VM* vm)
 {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+#define READ_BYTE() (*vm->ip++)
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
 #define BINARY_OP(valueType, op) \
     do \
     { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) \
         { \
-            runtimeError("Operands must be numbers."); \
+            runtimeError(vm, "Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
+        double b = AS_NUMBER(pop(vm)); \
+        double a = AS_NUMBER(pop(vm)); \
+        push(vm, valueType(a op b)); \
+    } while (false);
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+// same as BINARY_OP, with the right operand read from the constant pool
+// instead of the stack
+#define BINARY_OP_CONST(valueType, op) \
+    do \
+    { \
+        Value constant = READ_CONSTANT(); \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(constant)) \
+        { \
+            runtimeError(vm, "Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        double a = AS_NUMBER(pop(vm)); \
+        push(vm, valueType(a op AS_NUMBER(constant))); \
     } while (false);
 
-    for(;;)
-    {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
-        {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+#define TRACE_INSTRUCTION() \
+    do \
+    { \
+        fprintf(vm->out, "          "); \
+        for (Value* slot = vm->stack; slot < vm->stackTop; slot++) \
+        { \
+            fprintf(vm->out, "[ "); \
+            printValue(vm->out, *slot); \
+            fprintf(vm->out, " ]"); \
+        } \
+        fprintf(vm->out, "\n"); \
+        disassembleInstruction(vm->out, vm->chunk, (int)(vm->ip - vm->chunk->code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
 #endif
 
+#ifdef THREADED_DISPATCH
+#define VM_LABEL(opcode) label_##opcode
+
+    // Reference : https://gcc.gnu.org/onlinedocs/gcc/Labels-as-Values.html
+    //
+    // Every handler ends with its own copy of the indirect jump to the next
+    // handler, instead of all of them sharing the single jump the switch
+    // compiles to. The branch predictor then gets one history per opcode,
+    // so sequences like "OP_CONSTANT is usually followed by OP_ADD" become
+    // predictable.
+    static void* dispatchTable[256] =
+    {
+        // anything not listed below is an unknown opcode
+        [0 ... 255]         = &&VM_LABEL(UNKNOWN),
+
+        [OP_CONSTANT]       = &&VM_LABEL(OP_CONSTANT),
+        [OP_NIL]            = &&VM_LABEL(OP_NIL),
+        [OP_TRUE]           = &&VM_LABEL(OP_TRUE),
+        [OP_FALSE]          = &&VM_LABEL(OP_FALSE),
+        [OP_EQUAL]          = &&VM_LABEL(OP_EQUAL),
+        [OP_GREATER]        = &&VM_LABEL(OP_GREATER),
+        [OP_LESS]           = &&VM_LABEL(OP_LESS),
+        [OP_ADD]            = &&VM_LABEL(OP_ADD),
+        [OP_SUBTRACT]       = &&VM_LABEL(OP_SUBTRACT),
+        [OP_MULTIPLY]       = &&VM_LABEL(OP_MULTIPLY),
+        [OP_DIVIDE]         = &&VM_LABEL(OP_DIVIDE),
+        [OP_NOT]            = &&VM_LABEL(OP_NOT),
+        [OP_NEGATE]         = &&VM_LABEL(OP_NEGATE),
+        [OP_CONSTANT_LONG]  = &&VM_LABEL(OP_CONSTANT_LONG),
+        [OP_RETURN]         = &&VM_LABEL(OP_RETURN),
+        [OP_DUP]            = &&VM_LABEL(OP_DUP),
+        [OP_GET_TEMP]       = &&VM_LABEL(OP_GET_TEMP),
+        [OP_SET_TEMP]       = &&VM_LABEL(OP_SET_TEMP),
+        [OP_NOT_EQUAL]      = &&VM_LABEL(OP_NOT_EQUAL),
+        [OP_GREATER_EQUAL]  = &&VM_LABEL(OP_GREATER_EQUAL),
+        [OP_LESS_EQUAL]     = &&VM_LABEL(OP_LESS_EQUAL),
+        [OP_ADD_CONST]      = &&VM_LABEL(OP_ADD_CONST),
+        [OP_SUBTRACT_CONST] = &&VM_LABEL(OP_SUBTRACT_CONST),
+        [OP_MULTIPLY_CONST] = &&VM_LABEL(OP_MULTIPLY_CONST),
+        [OP_DIVIDE_CONST]   = &&VM_LABEL(OP_DIVIDE_CONST),
+    };
+
+#define DISPATCH() \
+    do \
+    { \
+        TRACE_INSTRUCTION(); \
+        goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+#define VM_CASE(opcode) VM_LABEL(opcode)
+#define VM_DEFAULT      VM_LABEL(UNKNOWN)
+#define VM_BREAK        DISPATCH()
+
+    DISPATCH();
+#else
+#define VM_CASE(opcode) case opcode
+#define VM_DEFAULT      default
+#define VM_BREAK        break
+
+    for(;;)
+    {
+        TRACE_INSTRUCTION();
+
         uint8_t instruction;
         switch (instruction = READ_BYTE())
         {
-        case OP_CONSTANT_LONG:
+#endif
+        VM_CASE(OP_CONSTANT_LONG):
         {
             uint32_t index = READ_BYTE();
             index |= READ_BYTE() << 8;
             index |= READ_BYTE() << 16;
-            push(vm.chunk->constants.values[index]);
-            break;
+            push(vm, vm->chunk->constants.values[index]);
+            VM_BREAK;
         }
-        case OP_CONSTANT:
+        VM_CASE(OP_CONSTANT):
         {
             Value constant = READ_CONSTANT();
-            push(constant);
-            break;
+            push(vm, constant);
+            VM_BREAK;
         }
 
-        case OP_NIL: push(NIL_VAL); break;
-        case OP_TRUE: push(BOOL_VAL(true)); break;
-        case OP_FALSE: push(BOOL_VAL(false)); break;
+        VM_CASE(OP_NIL): push(vm, NIL_VAL); VM_BREAK;
+        VM_CASE(OP_TRUE): push(vm, BOOL_VAL(true)); VM_BREAK;
+        VM_CASE(OP_FALSE): push(vm, BOOL_VAL(false)); VM_BREAK;
 
-        case OP_EQUAL:
+        VM_CASE(OP_EQUAL):
         {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(valuesEqual(a, b)));
-            break;
+            // interned strings compare by address, ropes are not interned
+            flattenOperand(vm, 0);
+            flattenOperand(vm, 1);
+            Value b = pop(vm);
+            Value a = pop(vm);
+            push(vm, BOOL_VAL(valuesEqual(a, b)));
+            VM_BREAK;
         }
 
-        case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-        case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
+        VM_CASE(OP_GREATER):  BINARY_OP(BOOL_VAL, >); VM_BREAK;
+        VM_CASE(OP_LESS):     BINARY_OP(BOOL_VAL, <); VM_BREAK;
 
         // since the '+' operator also acts as concat function for strings
         // in lox, we need to decide what an '+' actually means during runtime
-        case OP_ADD:
+        VM_CASE(OP_ADD):
         {
-            if(IS_STRING(peek(0)) && IS_STRING(peek(1)))
+            if(isText(peek(vm, 0)) && isText(peek(vm, 1)))
             {
-                concatenate();
+                concatenate(vm);
             }
-            else if(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+            else if(IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
             {
                 // It's worth noting that since the elements poped
                 // is in reverse order of which is pushed. When we
@@ -183,66 +344,153 @@ static InterpretResult run()
                 // pop, then a in the second one.
                 // This might not cause ay difference when the addition
                 // has Commutative property.
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+                double b = AS_NUMBER(pop(vm));
+                double a = AS_NUMBER(pop(vm));
+                push(vm, NUMBER_VAL(a + b));
             }
             else
             {
-                runtimeError("Operands must be two numbers or two strings.");
+                runtimeError(vm, "Operands must be two numbers or two strings.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            VM_BREAK;
         }
-        case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-        case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-        case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-        case OP_NOT:
-            push(BOOL_VAL(isFalsey(pop())));
-            break;
-        case OP_NEGATE:
+        VM_CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); VM_BREAK;
+        VM_CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); VM_BREAK;
+        VM_CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /); VM_BREAK;
+        VM_CASE(OP_NOT):
+            push(vm, BOOL_VAL(isFalsey(pop(vm))));
+            VM_BREAK;
+        VM_CASE(OP_NEGATE):
         {
             // push(-pop());
-            if(!IS_NUMBER(peek(0)))
+            if(!IS_NUMBER(peek(vm, 0)))
             {
-                runtimeError("Operand must be a number.");
+                runtimeError(vm, "Operand must be a number.");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
+            push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+            VM_BREAK;
         }
-        case OP_RETURN:
-            printValue(pop());
-            printf("\n");
+        VM_CASE(OP_RETURN):
+            flattenOperand(vm, 0);
+            printValue(vm->out, pop(vm));
+            fprintf(vm->out, "\n");
             return INTERPRET_OK;
 
-        default:
-            break;
+        // - expression temporaries, the IR emitter reserves them at the
+        // bottom of the stack before anything else is pushed
+        VM_CASE(OP_DUP): push(vm, peek(vm, 0)); VM_BREAK;
+        VM_CASE(OP_GET_TEMP):
+        {
+            uint8_t slot = READ_BYTE();
+            push(vm, vm->stack[slot]);
+            VM_BREAK;
+        }
+        VM_CASE(OP_SET_TEMP):
+        {
+            uint8_t slot = READ_BYTE();
+            vm->stack[slot] = peek(vm, 0);
+            VM_BREAK;
+        }
+
+        // - superinstructions
+        VM_CASE(OP_NOT_EQUAL):
+        {
+            flattenOperand(vm, 0);
+            flattenOperand(vm, 1);
+            Value b = pop(vm);
+            Value a = pop(vm);
+            push(vm, BOOL_VAL(!valuesEqual(a, b)));
+            VM_BREAK;
+        }
+        // These are !(a < b) and !(a > b) on purpose, rather than a >= b
+        // and a <= b. The two only differ when a NaN is involved, and the
+        // fused instruction has to behave exactly like the pair it replaced.
+        VM_CASE(OP_GREATER_EQUAL): BINARY_OP(NOT_BOOL_VAL, <); VM_BREAK;
+        VM_CASE(OP_LESS_EQUAL):    BINARY_OP(NOT_BOOL_VAL, >); VM_BREAK;
+
+        VM_CASE(OP_ADD_CONST):
+        {
+            Value constant = READ_CONSTANT();
+            if(isText(peek(vm, 0)) && IS_STRING(constant))
+            {
+                push(vm, constant);
+                concatenate(vm);
+            }
+            else if(IS_NUMBER(peek(vm, 0)) && IS_NUMBER(constant))
+            {
+                double a = AS_NUMBER(pop(vm));
+                push(vm, NUMBER_VAL(a + AS_NUMBER(constant)));
+            }
+            else
+            {
+                runtimeError(vm, "Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            VM_BREAK;
+        }
+        VM_CASE(OP_SUBTRACT_CONST): BINARY_OP_CONST(NUMBER_VAL, -); VM_BREAK;
+        VM_CASE(OP_MULTIPLY_CONST): BINARY_OP_CONST(NUMBER_VAL, *); VM_BREAK;
+        VM_CASE(OP_DIVIDE_CONST):   BINARY_OP_CONST(NUMBER_VAL, /); VM_BREAK;
+
+        VM_DEFAULT:
+            VM_BREAK;
+#ifndef THREADED_DISPATCH
         }
     }
+#endif
 
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef BINARY_OP
+#undef BINARY_OP_CONST
+#undef NOT_BOOL_VAL
+#undef TRACE_INSTRUCTION
+#undef VM_CASE
+#undef VM_DEFAULT
+#undef VM_BREAK
+#ifdef THREADED_DISPATCH
+#undef VM_LABEL
+#undef DISPATCH
+#endif
 }
 
-InterpretResult interpret(const char* source)
+// run an already compiled chunk, the caller keeps the ownership of it
+InterpretResult interpretChunk(VM* vm, Chunk* chunk)
+{
+    vm->chunk = chunk;
+    vm->ip = vm->chunk->code;
+    // temporaries are addressed from the bottom of the stack
+    resetStack(vm);
+
+    // all of it now, or nothing runs
+    if (!reserveStack(vm, chunk->maxStack + STACK_SLACK))
+    {
+        // runtimeError() blames the instruction before ip, the first one
+        vm->ip++;
+        runtimeError(vm, "Stack overflow, the expression needs %d values and the stack holds %d.",
+            chunk->maxStack + STACK_SLACK, vm->stackMax);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    return run(vm);
+}
+
+InterpretResult interpret(VM* vm, const char* source, size_t length)
 {
     Chunk chunk;
     initChunk(&chunk);
 
-    if(!compile(source, &chunk))
+    if(!compile(vm, source, length, &chunk))
     {
-        freeChunk(&chunk);
+        freeChunk(vm, &chunk);
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
-
-    InterpretResult result = run();
+    InterpretResult result = interpretChunk(vm, &chunk);
 
-    freeChunk(&chunk);
+    freeChunk(vm, &chunk);
     return result;
 }
\ No newline at end of file
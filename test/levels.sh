@@ -0,0 +1,45 @@
+#!/bin/sh
+# Runs every test/levels/*.lox at -O0, -O1 and -O2 and checks that all
+# three print the same thing, runtime errors and their line included, and
+# exit with the same code. -O0 compiles the expression as written, so it
+# is the reference the optimizing levels are held to.
+#
+# Needs a CLOX_RELEASE build, otherwise the code listing and the trace,
+# which differ between the levels on purpose, are compared too :
+#
+#   make clean && make test DEFINES=-DCLOX_RELEASE
+
+CLOX=${1:-./main}
+DIR=$(dirname "$0")/levels
+failed=0
+
+if printf 'nil\n' | "$CLOX" --cache=off /dev/stdin | grep -q "== code =="; then
+    echo "$CLOX prints its code listing, build it with -DCLOX_RELEASE"
+    exit 2
+fi
+
+# Too big to keep around : a left chain of 300000 strings, one C stack
+# frame per term would overflow anything that walks it recursively.
+GENERATED=/tmp/levels_chain.$$.lox
+python3 "$(dirname "$0")/../bench/gen.py" string 300000 > "$GENERATED" || exit 2
+
+for script in "$DIR"/*.lox "$GENERATED"; do
+    expected=$("$CLOX" -O0 --cache=off "$script" 2>&1; echo "exit $?")
+    for level in -O1 -O2; do
+        actual=$("$CLOX" "$level" --cache=off "$script" 2>&1; echo "exit $?")
+        if [ "$actual" != "$expected" ]; then
+            echo "FAIL $script $level"
+            echo "  -O0 : $(echo "$expected" | tr '\n' '|' | cut -c 1-200)"
+            echo "  $level : $(echo "$actual" | tr '\n' '|' | cut -c 1-200)"
+            failed=$((failed + 1))
+        fi
+    done
+done
+
+rm -f "$GENERATED"
+
+if [ "$failed" -ne 0 ]; then
+    echo "$failed failed"
+    exit 1
+fi
+echo "all the same at -O0, -O1 and -O2"